@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Seeding throughput (probes/s) of align and assemble, with and without huge pages and NUMA placement
+#
+# usage: scripts/bench_probes.sh [rekit binary] [reference Mbp] [coverage]  (default: ./rekit 500 20)
+#
+# Builds a random single-channel reference and simulates molecules from it (both from a fixed seed, so every
+# run probes the same index), then reports the "# Probed ... probes/s" line of:
+#   align    with --huge-pages none, thp and hugetlb (hugetlb falls back to thp without vm.nr_hugepages)
+#   align    pinned to node 0 with its memory on node 0 and on the last node, if numactl and >1 node
+#   assemble with --threads <nproc>, without and with --numa, on a 1/10 subset of the molecules
+# Scratch files go under $TMPDIR and are removed on exit. Compare runs on an otherwise idle machine.
+
+set -e
+
+REKIT=${1:-./rekit}
+MBP=${2:-500}
+COV=${3:-20}
+THREADS=$(nproc 2>/dev/null || echo 1)
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/bench_probes.XXXXXX")
+trap 'rm -rf "$DIR"' EXIT
+
+if [ ! -x "$REKIT" ]; then
+  echo "rekit binary '$REKIT' not found, run make first" >&2
+  exit 1
+fi
+
+# maps of 10 Mbp with labels ~9 kbp apart, as for a 6-cutter nickase on a human-like genome
+awk -v mbp="$MBP" 'BEGIN {
+  srand(1);
+  n_maps = int(mbp / 10); if(n_maps < 1) n_maps = 1;
+  len = 10000000;
+  print "# CMAP File Version:\t0.1";
+  print "# Label Channels:\t1";
+  print "# Nickase Recognition Site 1:\tGCTCTTC";
+  print "# Number of Consensus Nanomaps:\t" n_maps;
+  print "#h CMapId\tContigLength\tNumSites\tSiteID\tLabelChannel\tPosition\tStdDev\tCoverage\tOccurrence";
+  print "#f int\tfloat\tint\tint\tint\tfloat\tfloat\tint\tint";
+  for(m = 1; m <= n_maps; m++) {
+    n = 0;
+    for(p = 1 + int(-9000 * log(1 - rand())); p < len; p += 1 + int(-9000 * log(1 - rand()))) pos[++n] = p;
+    for(i = 1; i <= n; i++) printf "%d\t%.1f\t%d\t%d\t1\t%.1f\t1.0\t1\t1\n", m, len, n, i, pos[i];
+    printf "%d\t%.1f\t%d\t%d\t0\t%.1f\t0.0\t1\t0\n", m, len, n, n+1, len;
+  }
+}' > "$DIR/ref.cmap"
+
+"$REKIT" simulate -c "$DIR/ref.cmap" -x "$COV" > "$DIR/mol.bnx" 2> "$DIR/sim.log"
+awk '/^0\t/ { n++ } n % 10 == 1 || /^#/' "$DIR/mol.bnx" > "$DIR/sub.bnx"
+
+# prints the run's label and the probes/s figure from its stderr, or its last lines if it failed
+probes() {
+  label=$1
+  shift
+  rate=
+  if "$@" > /dev/null 2> "$DIR/run.log"; then
+    rate=$(sed -n 's/^# Probed .*(\([0-9]*\) probes\/s.*/\1/p' "$DIR/run.log" | tail -n 1)
+  fi
+  if [ -n "$rate" ]; then
+    printf '%-40s %15s probes/s\n' "$label" "$rate"
+  else
+    printf '%-40s %15s\n' "$label" "failed"
+    tail -n 3 "$DIR/run.log" >&2
+  fi
+}
+
+echo "# reference $MBP Mbp, coverage ${COV}x, $THREADS threads, $("$REKIT" --version 2>&1 | head -n 1)"
+for hp in none thp hugetlb; do
+  probes "align --huge-pages $hp" "$REKIT" align -b "$DIR/mol.bnx" -c "$DIR/ref.cmap" --huge-pages "$hp"
+done
+
+NODES=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+if command -v numactl > /dev/null 2>&1 && [ "$NODES" -gt 1 ]; then
+  LAST=$(ls -d /sys/devices/system/node/node[0-9]* | sed 's/.*node//' | sort -n | tail -n 1)
+  probes "align node 0, memory on node 0" numactl --cpunodebind=0 --membind=0 "$REKIT" align -b "$DIR/mol.bnx" -c "$DIR/ref.cmap"
+  probes "align node 0, memory on node $LAST" numactl --cpunodebind=0 --membind="$LAST" "$REKIT" align -b "$DIR/mol.bnx" -c "$DIR/ref.cmap"
+else
+  echo "# single NUMA node or no numactl, skipping the align placement runs"
+fi
+
+probes "assemble --threads $THREADS" "$REKIT" assemble -b "$DIR/sub.bnx" --threads "$THREADS"
+probes "assemble --threads $THREADS --numa" "$REKIT" assemble -b "$DIR/sub.bnx" --threads "$THREADS" --numa
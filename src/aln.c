@@ -0,0 +1,639 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Alignment IO
+ *
+ * Text records are the 17 tab-delimited columns described in the README. Binary records are a fixed-width
+ * core followed by the path as runs of (length << 2 | move), so they are read without parsing and the
+ * path takes a few words instead of a byte per move. Sorting is an external merge sort - runs of up to
+ * ALN_SORT_MEM bytes of records are sorted in memory and spilled to temporary files, which are then merged
+ * The region index (<fn>.idx) has one fixed-width line per reference window of 1 << ALN_INDEX_SHIFT bp
+ * covered by a sorted file: the window and the uncompressed offset of the first record overlapping it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "klib/kvec.h"
+#include "klib/ksort.h"
+#include "klib/kstring.h"
+#include "cmap.h"
+#include "dtw.h"
+#include "aln.h"
+
+#define ALN_N_FIELDS 17 // columns of text records
+#define ALN_SORT_MEM (1 << 28) // bytes of records sorted in memory before spilling a run to disk
+#define ALN_INDEX_SHIFT 16 // region index window size (64Kb)
+#define ALN_IDX_LINE 43 // 10-digit reference ID, tab, 10-digit window, tab, 20-digit offset, newline
+
+// fixed-width part of a binary record, followed by n_runs uint32_t path runs
+typedef struct aln_core {
+  uint32_t qid;
+  uint32_t ref_id;
+  uint32_t qstart;
+  uint32_t qend;
+  uint32_t qlen;
+  uint32_t qpos_start;
+  uint32_t qpos_end;
+  uint32_t qlength;
+  uint32_t tstart;
+  uint32_t tend;
+  uint32_t tlen;
+  uint32_t tpos_start;
+  uint32_t tpos_end;
+  uint32_t tlength;
+  float score;
+  uint8_t aligned;
+  uint8_t rev;
+  uint16_t reserved;
+  uint32_t n_runs;
+} aln_core;
+
+// sort key of a record held in memory (off is its offset in the run buffer)
+typedef struct aln_key {
+  uint32_t ref;
+  uint32_t pos;
+  uint32_t qid;
+  size_t off;
+} aln_key;
+
+// reference order, with unaligned molecules last
+#define aln_key_lt(a, b) ((a).ref < (b).ref || ((a).ref == (b).ref && ((a).pos < (b).pos || ((a).pos == (b).pos && (a).qid < (b).qid))))
+KSORT_INIT(aln_key_cmp, aln_key, aln_key_lt)
+
+static const char path_chars[] = {'.', 'I', 'D'};
+
+static alnFile* aln_init(BGZF* fp, const char* mode, int binary) {
+  alnFile* f = malloc(sizeof(alnFile));
+  f->fp = fp;
+  f->binary = binary;
+  f->buf.l = f->buf.m = 0;
+  f->buf.s = NULL;
+  if(mode[0] == 'r') {
+    // binary files start with the magic number, text records with a molecule ID
+    char magic[4];
+    f->binary = bgzf_peek(fp) == ALN_MAGIC[0];
+    if(f->binary && (bgzf_read(fp, magic, 4) != 4 || memcmp(magic, ALN_MAGIC, 4) != 0)) {
+      fprintf(stderr, "Not a rekit alignment file\n");
+      free(f);
+      return NULL;
+    }
+  } else if(binary && bgzf_write(fp, ALN_MAGIC, 4) != 4) {
+    fprintf(stderr, "Failed to write alignment header\n");
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+/*
+ * Opens an alignment file (- for stdin/stdout) with a mode as for open_map_file() - reading detects the
+ * format, writing is binary if binary is set, otherwise text
+ */
+alnFile* aln_open(const char* fn, const char* mode, int binary) {
+  BGZF* fp = open_map_file(fn, mode);
+  if(!fp) {
+    fprintf(stderr, "Failed to open alignments '%s'\n", fn);
+    return NULL;
+  }
+  alnFile* f = aln_init(fp, mode, binary);
+  if(!f) bgzf_close(fp);
+  return f;
+}
+
+int aln_close(alnFile* f) {
+  int ret = bgzf_close(f->fp);
+  free(f->buf.s);
+  free(f);
+  return ret;
+}
+
+// fills a record from a DTW result - the record shares the result's path
+void aln_set(aln_rec* a, molecule* q, molecule* t, result* r) {
+  a->qid = q->id;
+  a->ref_id = t->id;
+  a->aligned = 1;
+  a->rev = r->qrev;
+  a->qstart = r->qstart;
+  a->qend = r->qend;
+  a->qlen = q->n_labels;
+  a->qpos_start = q->labels[r->qstart].position;
+  a->qpos_end = q->labels[r->qend > 0 ? r->qend-1 : 0].position;
+  a->qlength = q->length;
+  a->tstart = r->tstart;
+  a->tend = r->tend;
+  a->tlen = t->n_labels;
+  a->tpos_start = t->labels[r->tstart].position;
+  a->tpos_end = t->labels[r->tend > 0 ? r->tend-1 : 0].position;
+  a->tlength = t->length;
+  a->score = r->score;
+  a->path = r->path;
+}
+
+void aln_set_unaligned(aln_rec* a, molecule* q) {
+  memset(a, 0, sizeof(aln_rec));
+  a->qid = q->id;
+  a->qlen = q->n_labels;
+  a->qlength = q->length;
+}
+
+// appends the binary encoding of a record to s
+static void aln_encode(aln_rec* a, kstring_t* s) {
+  aln_core c;
+  size_t i, j;
+  memset(&c, 0, sizeof(aln_core));
+  c.qid = a->qid;
+  c.ref_id = a->ref_id;
+  c.qstart = a->qstart;
+  c.qend = a->qend;
+  c.qlen = a->qlen;
+  c.qpos_start = a->qpos_start;
+  c.qpos_end = a->qpos_end;
+  c.qlength = a->qlength;
+  c.tstart = a->tstart;
+  c.tend = a->tend;
+  c.tlen = a->tlen;
+  c.tpos_start = a->tpos_start;
+  c.tpos_end = a->tpos_end;
+  c.tlength = a->tlength;
+  c.score = a->score;
+  c.aligned = a->aligned;
+  c.rev = a->rev;
+  for(i = 0; i < kv_size(a->path); i = j) {
+    for(j = i + 1; j < kv_size(a->path) && kv_A(a->path, j) == kv_A(a->path, i); j++);
+    c.n_runs++;
+  }
+  ks_resize(s, s->l + sizeof(aln_core) + c.n_runs * sizeof(uint32_t));
+  memcpy(s->s + s->l, &c, sizeof(aln_core));
+  s->l += sizeof(aln_core);
+  for(i = 0; i < kv_size(a->path); i = j) {
+    for(j = i + 1; j < kv_size(a->path) && kv_A(a->path, j) == kv_A(a->path, i); j++);
+    uint32_t run = (uint32_t)(j - i) << 2 | kv_A(a->path, i);
+    memcpy(s->s + s->l, &run, sizeof(uint32_t));
+    s->l += sizeof(uint32_t);
+  }
+}
+
+// decodes a binary record core and its runs into a (whose path is reused)
+static void aln_decode(aln_core* c, const char* runs, aln_rec* a) {
+  uint32_t i, k, run;
+  a->qid = c->qid;
+  a->ref_id = c->ref_id;
+  a->aligned = c->aligned;
+  a->rev = c->rev;
+  a->qstart = c->qstart;
+  a->qend = c->qend;
+  a->qlen = c->qlen;
+  a->qpos_start = c->qpos_start;
+  a->qpos_end = c->qpos_end;
+  a->qlength = c->qlength;
+  a->tstart = c->tstart;
+  a->tend = c->tend;
+  a->tlen = c->tlen;
+  a->tpos_start = c->tpos_start;
+  a->tpos_end = c->tpos_end;
+  a->tlength = c->tlength;
+  a->score = c->score;
+  kv_size(a->path) = 0;
+  for(i = 0; i < c->n_runs; i++) {
+    memcpy(&run, runs + i * sizeof(uint32_t), sizeof(uint32_t));
+    for(k = 0; k < run >> 2; k++) kv_push(uint8_t, a->path, run & 3);
+  }
+}
+
+// splits a tab-delimited line in place, returning the number of fields found (at most max)
+static int split_fields(char* s, char** fields, int max) {
+  int n = 0;
+  while(n < max) {
+    fields[n++] = s;
+    s = strchr(s, '\t');
+    if(s == NULL) break;
+    *s++ = '\0';
+  }
+  return n;
+}
+
+static int aln_parse(char* line, aln_rec* a) {
+  char* f[ALN_N_FIELDS];
+  char* p;
+  if(split_fields(line, f, ALN_N_FIELDS) < ALN_N_FIELDS) return -1;
+  a->qid = strtoul(f[0], NULL, 10);
+  a->qlen = strtoul(f[5], NULL, 10);
+  a->qlength = strtoul(f[8], NULL, 10);
+  kv_size(a->path) = 0;
+  a->aligned = f[1][0] != '-';
+  if(!a->aligned) return 0;
+  a->ref_id = strtoul(f[1], NULL, 10);
+  a->rev = atoi(f[2]);
+  a->qstart = strtoul(f[3], NULL, 10);
+  a->qend = strtoul(f[4], NULL, 10);
+  a->qpos_start = strtoul(f[6], NULL, 10);
+  a->qpos_end = strtoul(f[7], NULL, 10);
+  a->tstart = strtoul(f[9], NULL, 10);
+  a->tend = strtoul(f[10], NULL, 10);
+  a->tlen = strtoul(f[11], NULL, 10);
+  a->tpos_start = strtoul(f[12], NULL, 10);
+  a->tpos_end = strtoul(f[13], NULL, 10);
+  a->tlength = strtoul(f[14], NULL, 10);
+  a->score = atof(f[15]);
+  for(p = f[16]; *p; p++) {
+    if(*p == '.') kv_push(uint8_t, a->path, MATCH);
+    else if(*p == 'I') kv_push(uint8_t, a->path, INS);
+    else if(*p == 'D') kv_push(uint8_t, a->path, DEL);
+    else return -1;
+  }
+  return 0;
+}
+
+/*
+ * Reads the next record into a (initialize a->path with kv_init() before the first read)
+ * Returns 0 on success, 1 at the end of the file, -1 if the record is malformed
+ */
+int aln_read(alnFile* f, aln_rec* a) {
+  if(f->binary) {
+    aln_core c;
+    ssize_t n = bgzf_read(f->fp, &c, sizeof(aln_core));
+    if(n == 0) return 1;
+    if(n != sizeof(aln_core)) return -1;
+    size_t len = c.n_runs * sizeof(uint32_t);
+    ks_resize(&f->buf, len + 1);
+    if(bgzf_read(f->fp, f->buf.s, len) != (ssize_t)len) return -1;
+    aln_decode(&c, f->buf.s, a);
+    return 0;
+  }
+  if(bgzf_getline(f->fp, '\n', &f->buf) < 0) return 1;
+  return aln_parse(f->buf.s, a);
+}
+
+int aln_write(alnFile* f, aln_rec* a) {
+  size_t i;
+  f->buf.l = 0;
+  if(f->binary) {
+    aln_encode(a, &f->buf);
+  } else if(!a->aligned) {
+    ksprintf(&f->buf, "%u\t-\t-\t-\t-\t%u\t-\t-\t%u\t-\t-\t-\t-\t-\t-\t-\t-\n", a->qid, a->qlen, a->qlength);
+  } else {
+    ksprintf(&f->buf, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t", a->qid, a->ref_id, a->rev, a->qstart, a->qend, a->qlen, a->qpos_start, a->qpos_end, a->qlength);
+    ksprintf(&f->buf, "%u\t%u\t%u\t%u\t%u\t%u\t%f\t", a->tstart, a->tend, a->tlen, a->tpos_start, a->tpos_end, a->tlength, a->score);
+    ks_resize(&f->buf, f->buf.l + kv_size(a->path) + 2);
+    for(i = 0; i < kv_size(a->path); i++) f->buf.s[f->buf.l++] = path_chars[kv_A(a->path, i)];
+    f->buf.s[f->buf.l++] = '\n';
+  }
+  if(bgzf_write(f->fp, f->buf.s, f->buf.l) != (ssize_t)f->buf.l) {
+    fprintf(stderr, "Failed to write alignment\n");
+    return 1;
+  }
+  return 0;
+}
+
+// reads one encoded record from a spilled run, -1 at its end
+static int read_run_record(FILE* fp, kstring_t* s, aln_rec* a) {
+  aln_core c;
+  if(fread(&c, sizeof(aln_core), 1, fp) != 1) return -1;
+  ks_resize(s, c.n_runs * sizeof(uint32_t) + 1);
+  if(c.n_runs > 0 && fread(s->s, sizeof(uint32_t), c.n_runs, fp) != c.n_runs) return -1;
+  aln_decode(&c, s->s, a);
+  return 0;
+}
+
+static inline aln_key record_key(aln_rec* a) {
+  aln_key k;
+  k.ref = a->aligned ? a->ref_id : UINT32_MAX;
+  k.pos = a->aligned ? a->tpos_start : 0;
+  k.qid = a->qid;
+  k.off = 0;
+  return k;
+}
+
+// sorts the records in buf by keys and writes them to fp (a run file) or out
+static int write_sorted(kstring_t* buf, aln_key* keys, size_t n, FILE* fp, alnFile* out, aln_rec* a) {
+  size_t i;
+  aln_core c;
+  ks_mergesort(aln_key_cmp, n, keys, 0);
+  for(i = 0; i < n; i++) {
+    memcpy(&c, buf->s + keys[i].off, sizeof(aln_core));
+    size_t len = sizeof(aln_core) + c.n_runs * sizeof(uint32_t);
+    if(fp) {
+      if(fwrite(buf->s + keys[i].off, 1, len, fp) != len) {
+        fprintf(stderr, "Failed to write temporary sort file\n");
+        return 1;
+      }
+    } else {
+      aln_decode(&c, buf->s + keys[i].off + sizeof(aln_core), a);
+      if(aln_write(out, a) != 0) return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sorts alignments by reference ID and start position (unaligned molecules last) into out_fn, as binary or
+ * text, in bounded memory: input beyond ALN_SORT_MEM is sorted in runs spilled to temporary files
+ */
+int sort_alignments(const char* in_fn, const char* out_fn, int binary, int compress) {
+  alnFile* in = aln_open(in_fn, "r", 0);
+  if(!in) return 1;
+  alnFile* out = aln_open(out_fn, compress ? "w" : "wu", binary);
+  if(!out) {
+    aln_close(in);
+    return 1;
+  }
+
+  kstring_t buf = {0, 0, NULL};
+  kvec_t(aln_key) keys;
+  kvec_t(FILE*) runs;
+  kv_init(keys);
+  kv_init(runs);
+  aln_rec a;
+  kv_init(a.path);
+  size_t n = 0, i;
+  int r, ret = 0;
+
+  while((r = aln_read(in, &a)) == 0) {
+    aln_key k = record_key(&a);
+    k.off = buf.l;
+    kv_push(aln_key, keys, k);
+    aln_encode(&a, &buf);
+    n++;
+    if(buf.l >= ALN_SORT_MEM) {
+      FILE* fp = tmpfile();
+      if(!fp || write_sorted(&buf, keys.a, kv_size(keys), fp, NULL, &a) != 0) {
+        fprintf(stderr, "Failed to spill sorted alignments to a temporary file\n");
+        ret = 1;
+        break;
+      }
+      kv_push(FILE*, runs, fp);
+      buf.l = 0;
+      kv_size(keys) = 0;
+    }
+  }
+  if(r < 0) {
+    fprintf(stderr, "Malformed alignment record %zu in '%s'\n", n + 1, in_fn);
+    ret = 1;
+  }
+
+  if(ret == 0 && kv_size(runs) == 0) {
+    ret = write_sorted(&buf, keys.a, kv_size(keys), NULL, out, &a);
+  } else if(ret == 0) {
+    // spill the last run too, then merge - runs are few, so the smallest head is found by a linear scan
+    FILE* fp = tmpfile();
+    if(!fp || write_sorted(&buf, keys.a, kv_size(keys), fp, NULL, &a) != 0) {
+      fprintf(stderr, "Failed to spill sorted alignments to a temporary file\n");
+      ret = 1;
+    } else {
+      kv_push(FILE*, runs, fp);
+    }
+    size_t n_runs = kv_size(runs), best;
+    aln_rec* heads = malloc(n_runs * sizeof(aln_rec));
+    aln_key* head_keys = malloc(n_runs * sizeof(aln_key));
+    int* live = malloc(n_runs * sizeof(int));
+    for(i = 0; i < n_runs && ret == 0; i++) {
+      rewind(kv_A(runs, i));
+      kv_init(heads[i].path);
+      live[i] = read_run_record(kv_A(runs, i), &buf, &heads[i]) == 0;
+      if(live[i]) head_keys[i] = record_key(&heads[i]);
+    }
+    fprintf(stderr, "# Merging %zu sorted runs of alignments\n", n_runs);
+    while(ret == 0) {
+      best = n_runs;
+      for(i = 0; i < n_runs; i++) {
+        if(live[i] && (best == n_runs || aln_key_lt(head_keys[i], head_keys[best]))) best = i;
+      }
+      if(best == n_runs) break;
+      ret = aln_write(out, &heads[best]);
+      live[best] = read_run_record(kv_A(runs, best), &buf, &heads[best]) == 0;
+      if(live[best]) head_keys[best] = record_key(&heads[best]);
+    }
+    for(i = 0; i < n_runs; i++) kv_destroy(heads[i].path);
+    free(heads);
+    free(head_keys);
+    free(live);
+  }
+
+  for(i = 0; i < kv_size(runs); i++) fclose(kv_A(runs, i));
+  kv_destroy(runs);
+  kv_destroy(keys);
+  kv_destroy(a.path);
+  free(buf.s);
+  aln_close(in);
+  if(aln_close(out) != 0) ret = 1;
+  if(ret == 0) fprintf(stderr, "# Sorted %zu alignment records\n", n);
+  return ret;
+}
+
+static char* aln_idx_name(const char* fn) {
+  char* idx = malloc(strlen(fn) + 5);
+  sprintf(idx, "%s.idx", fn);
+  return idx;
+}
+
+// the index is usable if it exists and is no older than the alignments
+static int aln_idx_current(const char* fn, const char* idx) {
+  struct stat fs, is;
+  if(stat(fn, &fs) != 0 || stat(idx, &is) != 0) return 0;
+  return is.st_mtime >= fs.st_mtime;
+}
+
+// builds the region index <fn>.idx (and <fn>.gzi if the file is BGZF) of a sorted alignment file
+int index_alignments(const char* fn) {
+  BGZF* fp = open_map_file(fn, "r");
+  if(!fp) {
+    fprintf(stderr, "File '%s' not found\n", fn);
+    return 1;
+  }
+  int bgzf = bgzf_compression(fp) == 2;
+  if(bgzf && bgzf_index_build_init(fp) != 0) {
+    fprintf(stderr, "Failed to index '%s'\n", fn);
+    bgzf_close(fp);
+    return 1;
+  }
+  alnFile* f = aln_init(fp, "r", 0);
+  if(!f) {
+    bgzf_close(fp);
+    return 1;
+  }
+
+  // written to a temporary file, then renamed, so concurrent readers never see a partial index
+  char* idx = aln_idx_name(fn);
+  char* tmp = create_temp(idx);
+  FILE* o = tmp != NULL ? fopen(tmp, "w") : NULL;
+  if(!o) {
+    fprintf(stderr, "Failed to write index '%s'\n", idx);
+    if(tmp != NULL) commit_temp(tmp, idx, 1);
+    aln_close(f);
+    free(idx);
+    return 1;
+  }
+
+  aln_rec a;
+  kv_init(a.path);
+  int64_t off = bgzf_utell(fp), w, last_w = -1;
+  uint32_t ref = 0, pos = 0;
+  size_t n = 0, n_windows = 0;
+  int r, ret = 0, started = 0, unaligned = 0;
+  while((r = aln_read(f, &a)) == 0) {
+    n++;
+    if(!a.aligned) {
+      unaligned = 1;
+    } else if(unaligned || (started && (a.ref_id < ref || (a.ref_id == ref && a.tpos_start < pos)))) {
+      fprintf(stderr, "Alignments must be sorted (rekit sort) to be indexed, record %zu is out of order\n", n);
+      ret = 1;
+      break;
+    } else {
+      if(!started || a.ref_id != ref) last_w = -1;
+      started = 1;
+      ref = a.ref_id;
+      pos = a.tpos_start;
+      // each window not yet covered by an earlier record starts at this one
+      for(w = last_w + 1 > (a.tpos_start >> ALN_INDEX_SHIFT) ? last_w + 1 : (a.tpos_start >> ALN_INDEX_SHIFT); w <= (a.tpos_end >> ALN_INDEX_SHIFT); w++) {
+        fprintf(o, "%010u\t%010lld\t%020lld\n", ref, (long long)w, (long long)off);
+        n_windows++;
+        last_w = w;
+      }
+    }
+    off = bgzf_utell(fp);
+  }
+  if(r < 0) {
+    fprintf(stderr, "Malformed alignment record %zu in '%s'\n", n + 1, fn);
+    ret = 1;
+  }
+  kv_destroy(a.path);
+
+  if(fclose(o) != 0) ret = 1;
+  if(bgzf && !ret) ret = dump_bgzf_index(fp, fn);
+  ret = commit_temp(tmp, idx, ret);
+  if(ret) fprintf(stderr, "Failed to write index '%s'\n", idx);
+  else fprintf(stderr, "# Indexed %zu alignment records (%zu windows) in '%s'\n", n, n_windows, idx);
+  aln_close(f);
+  free(idx);
+  return ret;
+}
+
+// reads index entry i, returning 0 on success
+static int read_idx_entry(FILE* fp, size_t i, uint32_t* ref, uint32_t* w, int64_t* off) {
+  char buf[ALN_IDX_LINE + 1];
+  if(fseeko(fp, (off_t)i * ALN_IDX_LINE, SEEK_SET) != 0 || fread(buf, 1, ALN_IDX_LINE, fp) != ALN_IDX_LINE) return 1;
+  buf[ALN_IDX_LINE] = '\0';
+  *ref = strtoul(buf, NULL, 10);
+  *w = strtoul(buf + 11, NULL, 10);
+  *off = atoll(buf + 22);
+  return 0;
+}
+
+/*
+ * Seeks f (opened from fn) to the first record that may overlap position pos of reference ref_id, by
+ * binary search of <fn>.idx
+ * Returns 0 on success, 1 if no record aligns to the reference, -1 if there is no usable index
+ */
+int aln_seek(alnFile* f, const char* fn, uint32_t ref_id, uint32_t pos) {
+  char* idx = aln_idx_name(fn);
+  FILE* fp = fopen(idx, "r");
+  free(idx);
+  if(!fp) return -1;
+  fseeko(fp, 0, SEEK_END);
+  size_t n = ftello(fp) / ALN_IDX_LINE, lo = 0, hi = n, mid;
+  uint32_t ref, w, target = pos >> ALN_INDEX_SHIFT;
+  int64_t off;
+
+  // first entry after (ref_id, target)
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(read_idx_entry(fp, mid, &ref, &w, &off) != 0) {
+      fclose(fp);
+      return -1;
+    }
+    if(ref < ref_id || (ref == ref_id && w <= target)) lo = mid + 1;
+    else hi = mid;
+  }
+  // the entry before it if it is on this reference, otherwise the reference's first window
+  int found = 0;
+  if(lo > 0 && read_idx_entry(fp, lo - 1, &ref, &w, &off) == 0 && ref == ref_id) found = 1;
+  else if(lo < n && read_idx_entry(fp, lo, &ref, &w, &off) == 0 && ref == ref_id) found = 1;
+  fclose(fp);
+  if(!found) return 1;
+  return bgzf_useek(f->fp, off, SEEK_SET) == 0 ? 0 : -1;
+}
+
+/*
+ * Writes the alignments in fn to stdout, as binary or text - only those overlapping region
+ * (<ref_id>[:<start>-<end>]) if it is given, read through the region index
+ */
+int view_alignments(const char* fn, const char* region, int binary, int compress) {
+  uint32_t ref_id = 0, start = 0, end = UINT32_MAX;
+  if(region != NULL) {
+    char* p;
+    ref_id = strtoul(region, &p, 10);
+    if(p == region || (*p != '\0' && (*p != ':' || sscanf(p + 1, "%u-%u", &start, &end) != 2))) {
+      fprintf(stderr, "Region must be <ref_id> or <ref_id>:<start>-<end>, not '%s'\n", region);
+      return 1;
+    }
+    char* idx = aln_idx_name(fn);
+    if(!aln_idx_current(fn, idx)) {
+      fprintf(stderr, "# Building region index '%s'\n", idx);
+      if(index_alignments(fn) != 0) {
+        free(idx);
+        return 1;
+      }
+    }
+    free(idx);
+  }
+
+  // opened after indexing, to pick up a freshly built .gzi
+  alnFile* in = aln_open(fn, "r", 0);
+  if(!in) return 1;
+  alnFile* out = aln_open("-", compress ? "w" : "wu", binary);
+  if(!out) {
+    aln_close(in);
+    return 1;
+  }
+  aln_rec a;
+  kv_init(a.path);
+  int r = 0, ret = 0;
+  if(region != NULL) {
+    r = aln_seek(in, fn, ref_id, start);
+    if(r < 0) {
+      fprintf(stderr, "Failed to seek to region '%s'\n", region);
+      ret = 1;
+    }
+  }
+  while(r == 0 && ret == 0 && (r = aln_read(in, &a)) == 0) {
+    if(region != NULL) {
+      if(!a.aligned || a.ref_id != ref_id || a.tpos_start > end) break;
+      if(a.tpos_end < start) continue;
+    }
+    ret = aln_write(out, &a);
+  }
+  if(r < 0 && ret == 0) {
+    fprintf(stderr, "Malformed alignment record in '%s'\n", fn);
+    ret = 1;
+  }
+  kv_destroy(a.path);
+  aln_close(in);
+  if(aln_close(out) != 0) ret = 1;
+  return ret;
+}
@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include "cmap.h"
+#include "dtw.h"
+
+#ifndef __ALN_H__
+#define __ALN_H__
+
+/*
+ * Alignment records, read and written as tab-delimited text (see README) or binary
+ *
+ * Binary alignment files start with ALN_MAGIC, followed by one record per alignment: a fixed-width core
+ * (aln_core in aln.c) and the DTW path as run-length encoded moves. Either format may be BGZF-compressed,
+ * and once sorted (sort_alignments()) and indexed (index_alignments()) can be read by region
+ */
+#define ALN_MAGIC "RKA\1"
+
+typedef struct aln_rec {
+  uint32_t qid;
+  uint32_t ref_id;
+  uint8_t aligned; // 0 if the molecule did not align - then only qid, qlen and qlength are set
+  uint8_t rev;
+  uint32_t qstart; // query label indices
+  uint32_t qend;
+  uint32_t qlen;
+  uint32_t qpos_start; // query label positions
+  uint32_t qpos_end;
+  uint32_t qlength;
+  uint32_t tstart; // reference label indices
+  uint32_t tend;
+  uint32_t tlen;
+  uint32_t tpos_start; // reference label positions
+  uint32_t tpos_end;
+  uint32_t tlength;
+  float score;
+  pathvec path; // DTW moves (MATCH, INS, DEL) from the end of the alignment back
+} aln_rec;
+
+typedef struct aln_file {
+  BGZF* fp;
+  int binary;
+  kstring_t buf; // a text line, or an encoded binary record
+} alnFile;
+
+alnFile* aln_open(const char* fn, const char* mode, int binary);
+int aln_close(alnFile* f);
+int aln_read(alnFile* f, aln_rec* a);
+int aln_write(alnFile* f, aln_rec* a);
+void aln_set(aln_rec* a, molecule* q, molecule* t, result* r);
+void aln_set_unaligned(aln_rec* a, molecule* q);
+
+int sort_alignments(const char* in_fn, const char* out_fn, int binary, int compress);
+int index_alignments(const char* fn);
+int aln_seek(alnFile* f, const char* fn, uint32_t ref_id, uint32_t pos);
+int view_alignments(const char* fn, const char* region, int binary, int compress);
+
+#endif /* __ALN_H__ */
@@ -0,0 +1,944 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Consensus map assembly (overlap - layout - consensus)
+ *
+ * Overlap: molecules are seeded against the q-gram (or cross-ratio) index of one block of molecules at a
+ * time, so only one block's index is ever in memory, and candidate pairs are verified by DTW
+ * Layout: contained molecules are set aside, the string graph of the remaining overlaps is transitively
+ * reduced, and each unbranched path becomes a contig along with the molecules contained in it
+ * Consensus: a contig's molecules are aligned in turn to its growing consensus map, which keeps the mean
+ * and stdev of each label position and how many molecules observed and spanned each label
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "klib/kvec.h"
+#include "klib/khash.h"
+#include "klib/ksort.h"
+#include "cmap.h"
+#include "hash.h"
+#include "chain.h"
+#include "dtw.h"
+#include "assemble.h"
+
+#define ASM_BLOCK_LABELS (1 << 26) // labels indexed per block, which bounds the index size
+#define ASM_MAX_CANDIDATES 200 // candidate molecules kept per molecule and orientation - each costs a DTW
+#define ASM_END_SLACK 1 // unaligned labels allowed at either end of a contained molecule
+#define ASM_FUZZ 10000 // bp of disagreement allowed between overlap lengths in transitive reduction
+#define ASM_WINDOW_MIN 20000 // bp the consensus window extends past a molecule's expected position on either side
+#define ASM_WINDOW_FRAC 0.1 // ...or this fraction of the molecule length, if larger
+#define ASM_MERGE_DIST 1000 // bp within which an unaligned label joins an existing consensus label
+#define ASM_MIN_MATCHED 0.4 // fraction of its labels a molecule must match to the consensus to join it
+
+// a molecule's labels (without the end marker) and the label-to-label fragments between them
+typedef struct mol_frags {
+  uint32_t* pos; // n label positions
+  uint8_t* chan; // n label channels
+  uint32_t* frags; // n-1 fragments, fragment j runs from label j to j+1
+  uint8_t* fchan; // channel of the label ending each fragment, as dtw() expects
+  uint32_t n;
+} mol_frags;
+
+// positions are from the start of the molecule in the given orientation; a molecule whose labels are out of
+// order gets none, so it is left out of the assembly
+static void get_mol_frags(molecule* m, int rev, mol_frags* f) {
+  uint32_t i, n = m->n_labels > 0 ? m->n_labels - 1 : 0;
+  for(i = 1; i < n; i++) {
+    if(m->labels[i].position < m->labels[i-1].position) n = 0;
+  }
+  f->n = n;
+  f->pos = malloc((n + 1) * sizeof(uint32_t));
+  f->chan = malloc(n + 1);
+  f->frags = malloc((n + 1) * sizeof(uint32_t));
+  f->fchan = malloc(n + 1);
+  for(i = 0; i < n; i++) {
+    label* l = &m->labels[rev ? n-1-i : i];
+    f->pos[i] = rev ? m->length - l->position : l->position;
+    f->chan[i] = l->channel;
+  }
+  for(i = 0; i + 1 < n; i++) {
+    f->frags[i] = f->pos[i+1] - f->pos[i];
+    f->fchan[i] = f->chan[i+1];
+  }
+}
+
+static void free_mol_frags(mol_frags* f) {
+  free(f->pos);
+  free(f->chan);
+  free(f->frags);
+  free(f->fchan);
+}
+
+// -------------------------------- overlap --------------------------------
+
+typedef struct ovl_ctx {
+  cmap* b;
+  mol_frags* mf; // forward labels and fragments of every molecule
+  seedIndex** idx; // index of molecules [blk_start, blk_end), one copy per NUMA node
+  int n_nodes;
+  float* xr_edges;
+  uint32_t blk_start;
+  uint32_t next; // next query molecule, claimed atomically
+  int seed_mode, q, bin_size, max_qgrams, chain_threshold, min_labels;
+  float dtw_threshold;
+  ovlVec* found; // per thread
+  lookupBuf* lb; // per thread, kept across blocks for the probe counts
+} ovl_ctx;
+
+typedef struct worker_arg {
+  void* ctx;
+  int id;
+} worker_arg;
+
+/*
+ * Turns a DTW alignment of molecule b (oriented by rev, as the query) to a (the target) into an overlap
+ *
+ * Fragment counts in the alignment are label indices: the alignment starts at labels (qstart, tstart) and
+ * ends at (qend, tend), and b's offset in a is the mean of the offsets those two label pairs imply
+ */
+static overlap make_overlap(uint32_t a, uint32_t b, int rev, mol_frags* fa, mol_frags* fb, result* r) {
+  overlap o;
+  o.a = a;
+  o.b = b;
+  o.rev = rev;
+  o.score = r->score;
+  o.offset = (int32_t)((((int64_t)fa->pos[r->tend] - fb->pos[r->qend]) + ((int64_t)fa->pos[r->tstart] - fb->pos[r->qstart])) / 2);
+  int b_in_a = r->qstart <= ASM_END_SLACK && fb->n-1 - r->qend <= ASM_END_SLACK;
+  int a_in_b = r->tstart <= ASM_END_SLACK && fa->n-1 - r->tend <= ASM_END_SLACK;
+  if(b_in_a && a_in_b) // the same map, keep the one with more labels
+    o.type = fb->n <= fa->n ? OVL_B_IN_A : OVL_A_IN_B;
+  else
+    o.type = b_in_a ? OVL_B_IN_A : (a_in_b ? OVL_A_IN_B : OVL_DOVETAIL);
+  return o;
+}
+
+/*
+ * Finds and verifies the overlaps of each query molecule with the lower-numbered molecules of the current block
+ *
+ * Candidates from both orientations are scored together (score-only) and only those passing the DTW
+ * threshold are traced back to place them
+ */
+static void* overlap_worker(void* arg) {
+  ovl_ctx* ctx = (ovl_ctx*)((worker_arg*)arg)->ctx;
+  int id = ((worker_arg*)arg)->id;
+  ovlVec* found = &ctx->found[id];
+  lookupBuf* lb = &ctx->lb[id];
+  cmap* b = ctx->b;
+  uint32_t qi, a;
+  int rev, j;
+  size_t k;
+
+  // workers are spread over the nodes and use their node's copy of the index
+  int node = id % ctx->n_nodes;
+  if(ctx->n_nodes > 1) pin_to_node(node);
+  seedIndex* idx = ctx->idx[node];
+
+  kvec_t(dtw_task) tasks;
+  kv_init(tasks);
+  u32Vec cands; // candidate molecule << 1 | orientation, parallel to tasks
+  kv_init(cands);
+
+  while((qi = __sync_fetch_and_add(&ctx->next, 1)) < b->n_maps) {
+    molecule* m = &b->molecules[qi];
+    if(m->n_labels < ctx->min_labels || ctx->mf[qi].n < 2) continue;
+    mol_frags qr;
+    get_mol_frags(m, 1, &qr);
+    tasks.n = 0;
+    cands.n = 0;
+
+    // one lookup seeds both orientations
+    if(ctx->seed_mode == SEED_XRATIO)
+      lookup_xratio(m->labels, m->n_labels, idx, ctx->max_qgrams, ctx->bin_size, ctx->xr_edges, lb);
+    else
+      lookup(m->labels, m->n_labels, qi, ctx->q, idx, ctx->max_qgrams, ctx->bin_size, lb);
+    for(rev = 0; rev <= 1; rev++) {
+      chain* chains = do_chain(lb->hits[rev].a, kv_size(lb->hits[rev]), ASM_MAX_CANDIDATES, 1, 4, 0.25, 50, ctx->chain_threshold); // match_score, gap_cost, max_gap as in query_db()
+      for(j = 0; chains[j].n_anchors > 0; j++) {
+        a = ctx->blk_start + chains[j].ref;
+        if(a >= qi || ctx->mf[a].n < 2) continue; // each pair is verified once, from its higher-numbered molecule
+        dtw_task t;
+        t.query = rev ? qr.frags : ctx->mf[qi].frags;
+        t.qchan = rev ? qr.fchan : ctx->mf[qi].fchan;
+        t.qlen = ctx->mf[qi].n - 1;
+        t.target = ctx->mf[a].frags;
+        t.tchan = ctx->mf[a].fchan;
+        t.tlen = ctx->mf[a].n - 1;
+        t.rev = 0; // already oriented
+        kv_push(dtw_task, tasks, t);
+        kv_push(uint32_t, cands, a << 1 | rev);
+      }
+      free(chains);
+    }
+
+    dtw_batch(tasks.a, kv_size(tasks), -1, -1, 0.2, ctx->dtw_threshold, 0); // ins_score, del_score, neutral_deviation, min_score, top_k
+    for(k = 0; k < kv_size(tasks); k++) {
+      dtw_task* t = &kv_A(tasks, k);
+      if(t->score < ctx->dtw_threshold) continue;
+      result r = dtw(t->query, t->target, t->qchan, t->tchan, t->qlen, t->tlen, -1, -1, 0.2, 0);
+      if(!r.failed) {
+        a = kv_A(cands, k) >> 1;
+        rev = kv_A(cands, k) & 1;
+        kv_push(overlap, *found, make_overlap(a, qi, rev, &ctx->mf[a], rev ? &qr : &ctx->mf[qi], &r));
+        kv_destroy(r.path);
+      }
+    }
+    free_mol_frags(&qr);
+  }
+
+  kv_destroy(tasks);
+  kv_destroy(cands);
+  return NULL;
+}
+
+static void run_workers(void* (*fn)(void*), void* ctx, int threads) {
+  pthread_t* th = malloc(threads * sizeof(pthread_t));
+  worker_arg* args = malloc(threads * sizeof(worker_arg));
+  int i;
+  for(i = 0; i < threads; i++) {
+    args[i].ctx = ctx;
+    args[i].id = i;
+    pthread_create(&th[i], NULL, fn, &args[i]);
+  }
+  for(i = 0; i < threads; i++) {
+    pthread_join(th[i], NULL);
+  }
+  free(th);
+  free(args);
+}
+
+// copies ctx->idx[0] to node id, from a thread pinned there so that the copy's pages are local to it
+static void* replica_worker(void* arg) {
+  ovl_ctx* ctx = (ovl_ctx*)((worker_arg*)arg)->ctx;
+  int node = ((worker_arg*)arg)->id + 1;
+  pin_to_node(node);
+  ctx->idx[node] = copy_index(ctx->idx[0]);
+  return NULL;
+}
+
+// best-scoring overlap first within each pair
+#define ovl_lt(x, y) ((x).a < (y).a || ((x).a == (y).a && ((x).b < (y).b || ((x).b == (y).b && (x).score > (y).score))))
+KSORT_INIT(ovl_cmp, overlap, ovl_lt)
+
+/*
+ * All-vs-all overlaps, at most one (the best) per pair of molecules
+ *
+ * The index covers one block of up to ASM_BLOCK_LABELS labels at a time, and every molecule after the
+ * block's start is looked up in it; memory is one block's index plus the overlaps found
+ *
+ * The index is allocated with the given MEM_* placement; with numa (and more than one node) it is copied
+ * to every node, and each worker is pinned to a node and probes that node's copy
+ */
+static ovlVec find_overlaps(cmap* b, mol_frags* mf, int seed_mode, int q, int bin_size, int max_qgrams, float repeat_frac, int chain_threshold, float dtw_threshold, int min_labels, int threads, int placement, int numa) {
+  ovlVec all;
+  kv_init(all);
+  uint32_t blk_end, i;
+  size_t n_labels;
+  int t;
+
+  ovl_ctx ctx;
+  ctx.b = b;
+  ctx.mf = mf;
+  ctx.seed_mode = seed_mode;
+  ctx.q = q;
+  ctx.bin_size = bin_size;
+  ctx.max_qgrams = max_qgrams;
+  ctx.chain_threshold = chain_threshold;
+  ctx.dtw_threshold = dtw_threshold;
+  ctx.min_labels = min_labels;
+  ctx.xr_edges = seed_mode == SEED_XRATIO ? xratio_edges(bin_size) : NULL;
+  ctx.found = malloc(threads * sizeof(ovlVec));
+  ctx.lb = malloc(threads * sizeof(lookupBuf));
+  for(t = 0; t < threads; t++) {
+    kv_init(ctx.found[t]);
+    init_lookup_buf(&ctx.lb[t]);
+  }
+  ctx.n_nodes = numa ? numa_nodes() : 1;
+  if(ctx.n_nodes > threads) ctx.n_nodes = threads; // no node without a worker
+  ctx.idx = malloc(ctx.n_nodes * sizeof(seedIndex*));
+  if(ctx.n_nodes > 1) fprintf(stderr, "# Replicating the index on %d NUMA nodes\n", ctx.n_nodes);
+
+  for(ctx.blk_start = 0; ctx.blk_start < b->n_maps; ctx.blk_start = blk_end) {
+    n_labels = 0;
+    for(blk_end = ctx.blk_start; blk_end < b->n_maps && blk_end - ctx.blk_start < ANCHOR_MAX_TARGETS - 1 && (n_labels < ASM_BLOCK_LABELS || blk_end == ctx.blk_start); blk_end++)
+      n_labels += b->molecules[blk_end].n_labels;
+
+    cmap blk = *b;
+    blk.molecules = b->molecules + ctx.blk_start;
+    blk.n_maps = blk_end - ctx.blk_start;
+    khash_t(qgramHash) *db = kh_init(qgramHash);
+    if(seed_mode == SEED_XRATIO)
+      build_xratio_db(blk, db, -1, bin_size, ctx.xr_edges);
+    else
+      build_hash_db(blk, q, db, -1, bin_size, 0);
+    mask_repeats(db, repeat_frac, max_qgrams);
+    ctx.idx[0] = freeze_hash_db(db, placement);
+    if(ctx.idx[0] == NULL) break;
+    // node 0 keeps the original, wherever it was placed
+    if(ctx.n_nodes > 1) run_workers(replica_worker, &ctx, ctx.n_nodes - 1);
+    for(t = 1; t < ctx.n_nodes; t++) {
+      if(ctx.idx[t] == NULL) ctx.idx[t] = ctx.idx[0]; // out of memory on that node, share
+    }
+    fprintf(stderr, "# Indexed molecules %u-%u, finding overlaps\n", ctx.blk_start + 1, blk_end);
+
+    ctx.next = ctx.blk_start + 1;
+    run_workers(overlap_worker, &ctx, threads);
+    for(t = 1; t < ctx.n_nodes; t++) {
+      if(ctx.idx[t] != ctx.idx[0]) destroy_index(ctx.idx[t]);
+    }
+    destroy_index(ctx.idx[0]);
+
+    for(t = 0; t < threads; t++) {
+      for(i = 0; i < kv_size(ctx.found[t]); i++) kv_push(overlap, all, kv_A(ctx.found[t], i));
+      ctx.found[t].n = 0;
+    }
+  }
+
+  uint64_t n_probes = 0;
+  double probe_secs = 0;
+  for(t = 0; t < threads; t++) {
+    n_probes += ctx.lb[t].n_probes;
+    probe_secs += ctx.lb[t].probe_secs;
+    kv_destroy(ctx.found[t]);
+    free_lookup_buf(&ctx.lb[t]);
+  }
+  fprintf(stderr, "# Probed %llu seeds in %.2f thread-seconds (%.0f probes/s per thread)\n", (unsigned long long)n_probes, probe_secs, probe_secs > 0 ? n_probes / probe_secs : 0);
+  free(ctx.found);
+  free(ctx.lb);
+  free(ctx.idx);
+  free(ctx.xr_edges);
+
+  // keep the best overlap of each pair (a pair can be found in both orientations)
+  if(kv_size(all) > 0) {
+    ks_introsort(ovl_cmp, kv_size(all), all.a);
+    size_t j = 0;
+    for(i = 1; i < kv_size(all); i++) {
+      if(kv_A(all, i).a != kv_A(all, j).a || kv_A(all, i).b != kv_A(all, j).b) kv_A(all, ++j) = kv_A(all, i);
+    }
+    all.n = j + 1;
+  }
+  return all;
+}
+
+// -------------------------------- layout --------------------------------
+
+// string graph nodes are molecule << 1 | strand, and the edge u -> v means v starts len bp after u and ends past it
+typedef struct sg_edge {
+  uint32_t from;
+  uint32_t to;
+  int32_t len;
+  uint32_t ovl; // the overlap it came from (each gives an edge and its reverse complement)
+} sg_edge;
+
+typedef kvec_t(sg_edge) edgeVec;
+
+#define edge_lt(x, y) ((x).from < (y).from || ((x).from == (y).from && (x).len < (y).len))
+KSORT_INIT(edge_cmp, sg_edge, edge_lt)
+
+// where a contained molecule sits in the forward coordinates of its container
+typedef struct containment {
+  uint32_t container;
+  int32_t offset;
+  uint8_t rev;
+  float score; // of the overlap, the best is kept
+} containment;
+
+typedef struct placement {
+  uint32_t mol;
+  uint8_t rev;
+  int64_t pos; // layout position of the oriented molecule's start
+} placement;
+
+typedef kvec_t(placement) placeVec;
+typedef kvec_t(placeVec) contigVec;
+
+#define place_lt(x, y) ((x).pos < (y).pos)
+KSORT_INIT(place_cmp, placement, place_lt)
+
+static void push_edge(edgeVec* edges, uint32_t from, uint32_t to, int64_t len, uint32_t ovl) {
+  if(len <= 0) return; // inconsistent with a dovetail, drop it
+  sg_edge e;
+  e.from = from;
+  e.to = to;
+  e.len = (int32_t)len;
+  e.ovl = ovl;
+  kv_push(sg_edge, *edges, e);
+}
+
+#define VACANT 0
+#define INPLAY 1
+#define ELIMINATED 2
+
+/*
+ * Lays out contigs: contained molecules are set aside, the string graph of the rest is transitively reduced
+ * (Myers 2005) and walked into unbranched paths, then contained molecules are placed through their containers
+ *
+ * returns one placement vector per contig, of at least two molecules
+ */
+static contigVec layout(cmap* b, ovlVec* ovls) {
+  uint32_t n = b->n_maps, n_nodes = 2 * n, i, v, w, x;
+  size_t e, f;
+  contigVec contigs;
+  kv_init(contigs);
+
+  // best container of each contained molecule
+  containment* cont = malloc((n + 1) * sizeof(containment));
+  for(i = 0; i < n; i++) cont[i].container = UINT32_MAX;
+  for(i = 0; i < kv_size(*ovls); i++) {
+    overlap* o = &kv_A(*ovls, i);
+    int64_t la = b->molecules[o->a].length, lb = b->molecules[o->b].length;
+    if(o->type == OVL_B_IN_A && (cont[o->b].container == UINT32_MAX || o->score > cont[o->b].score)) {
+      cont[o->b].container = o->a;
+      cont[o->b].offset = o->offset;
+      cont[o->b].rev = o->rev;
+      cont[o->b].score = o->score;
+    } else if(o->type == OVL_A_IN_B && (cont[o->a].container == UINT32_MAX || o->score > cont[o->a].score)) {
+      // a in b's forward coordinates: b runs over [offset, offset + lb] of a, reversed if rev
+      cont[o->a].container = o->b;
+      cont[o->a].offset = o->rev ? lb + o->offset - la : -o->offset;
+      cont[o->a].rev = o->rev;
+      cont[o->a].score = o->score;
+    }
+  }
+  // a containment cycle (near-identical maps) would leave its molecules nowhere, break it at its lowest molecule
+  for(i = 0; i < n; i++) {
+    uint32_t c = cont[i].container, steps = 0;
+    while(c != UINT32_MAX && c != i && steps++ < n) c = cont[c].container;
+    if(c == i) cont[i].container = UINT32_MAX;
+  }
+
+  // both edges of every dovetail between uncontained molecules
+  edgeVec edges;
+  kv_init(edges);
+  for(i = 0; i < kv_size(*ovls); i++) {
+    overlap* o = &kv_A(*ovls, i);
+    if(o->type != OVL_DOVETAIL || cont[o->a].container != UINT32_MAX || cont[o->b].container != UINT32_MAX) continue;
+    int64_t la = b->molecules[o->a].length, lb = b->molecules[o->b].length;
+    uint32_t na = o->a << 1, nb = o->b << 1 | o->rev;
+    if(o->offset > 0) { // a then b
+      push_edge(&edges, na, nb, o->offset, i);
+      push_edge(&edges, nb ^ 1, na ^ 1, o->offset + lb - la, i);
+    } else { // b then a
+      push_edge(&edges, nb, na, -(int64_t)o->offset, i);
+      push_edge(&edges, na ^ 1, nb ^ 1, la - o->offset - lb, i);
+    }
+  }
+  if(kv_size(edges) > 0) ks_introsort(edge_cmp, kv_size(edges), edges.a);
+  size_t* first = calloc(n_nodes + 1, sizeof(size_t));
+  for(e = 0; e < kv_size(edges); e++) first[kv_A(edges, e).from + 1]++;
+  for(v = 0; v < n_nodes; v++) first[v+1] += first[v];
+
+  // transitive reduction: u -> w is redundant if u -> v -> w spans about the same distance
+  uint8_t* mark = calloc(n_nodes, 1);
+  uint8_t* reduced = calloc(kv_size(*ovls) + 1, 1); // per overlap, so both of its edges go together
+  for(v = 0; v < n_nodes; v++) {
+    if(first[v] == first[v+1]) continue;
+    for(e = first[v]; e < first[v+1]; e++) mark[kv_A(edges, e).to] = INPLAY;
+    int64_t longest = kv_A(edges, first[v+1]-1).len + ASM_FUZZ;
+    for(e = first[v]; e < first[v+1]; e++) {
+      w = kv_A(edges, e).to;
+      if(mark[w] != INPLAY) continue;
+      for(f = first[w]; f < first[w+1] && kv_A(edges, e).len + kv_A(edges, f).len <= longest; f++) {
+        if(mark[kv_A(edges, f).to] == INPLAY) mark[kv_A(edges, f).to] = ELIMINATED;
+      }
+    }
+    for(e = first[v]; e < first[v+1]; e++) {
+      w = kv_A(edges, e).to;
+      for(f = first[w]; f < first[w+1] && (kv_A(edges, f).len < ASM_FUZZ || f == first[w]); f++) {
+        if(mark[kv_A(edges, f).to] == INPLAY) mark[kv_A(edges, f).to] = ELIMINATED;
+      }
+    }
+    for(e = first[v]; e < first[v+1]; e++) {
+      if(mark[kv_A(edges, e).to] == ELIMINATED) reduced[kv_A(edges, e).ovl] = 1;
+      mark[kv_A(edges, e).to] = VACANT;
+    }
+  }
+
+  // out-degree and the last out-edge of every node, over the edges left; in-edges of v are out-edges of v ^ 1
+  uint32_t* outdeg = calloc(n_nodes, sizeof(uint32_t));
+  size_t* out1 = malloc((n_nodes + 1) * sizeof(size_t));
+  for(e = 0; e < kv_size(edges); e++) {
+    if(reduced[kv_A(edges, e).ovl]) continue;
+    outdeg[kv_A(edges, e).from]++;
+    out1[kv_A(edges, e).from] = e;
+  }
+#define indeg(v) outdeg[(v) ^ 1]
+
+  // contained molecules by container, to place them once their container is
+  uint32_t* cfirst = calloc(n + 1, sizeof(uint32_t));
+  uint32_t* cmols = malloc((n + 1) * sizeof(uint32_t));
+  for(i = 0; i < n; i++) if(cont[i].container != UINT32_MAX) cfirst[cont[i].container + 1]++;
+  for(i = 0; i < n; i++) cfirst[i+1] += cfirst[i];
+  uint32_t* cfill = malloc((n + 1) * sizeof(uint32_t));
+  memcpy(cfill, cfirst, (n + 1) * sizeof(uint32_t));
+  for(i = 0; i < n; i++) if(cont[i].container != UINT32_MAX) cmols[cfill[cont[i].container]++] = i;
+  free(cfill);
+
+  uint8_t* used = calloc(n, 1);
+  for(i = 0; i < n; i++) {
+    if(used[i] || cont[i].container != UINT32_MAX || b->molecules[i].n_labels < 2) continue;
+
+    // back up to the start of the unbranched path through i
+    v = i << 1;
+    uint32_t steps = 0;
+    while(indeg(v) == 1 && steps++ < n) {
+      uint32_t p = kv_A(edges, out1[v ^ 1]).to ^ 1;
+      if(outdeg[p] != 1 || used[p >> 1] || (p >> 1) == i) break;
+      v = p;
+    }
+
+    placeVec path;
+    kv_init(path);
+    placement pl;
+    pl.mol = v >> 1;
+    pl.rev = v & 1;
+    pl.pos = 0;
+    kv_push(placement, path, pl);
+    used[v >> 1] = 1;
+    while(outdeg[v] == 1) {
+      sg_edge* ed = &kv_A(edges, out1[v]);
+      w = ed->to;
+      if(indeg(w) != 1 || used[w >> 1]) break;
+      pl.mol = w >> 1;
+      pl.rev = w & 1;
+      pl.pos += ed->len;
+      kv_push(placement, path, pl);
+      used[w >> 1] = 1;
+      v = w;
+    }
+
+    // contained molecules, breadth-first through nested containment
+    for(f = 0; f < kv_size(path); f++) {
+      placement c = kv_A(path, f);
+      int64_t lc = b->molecules[c.mol].length;
+      for(x = cfirst[c.mol]; x < cfirst[c.mol + 1]; x++) {
+        uint32_t m = cmols[x];
+        if(used[m]) continue;
+        int64_t lm = b->molecules[m].length;
+        pl.mol = m;
+        pl.rev = cont[m].rev ^ c.rev;
+        pl.pos = c.rev ? c.pos + lc - (cont[m].offset + lm) : c.pos + cont[m].offset;
+        kv_push(placement, path, pl);
+        used[m] = 1;
+      }
+    }
+
+    if(kv_size(path) < 2) {
+      kv_destroy(path);
+      continue;
+    }
+    ks_introsort(place_cmp, kv_size(path), path.a);
+    kv_push(placeVec, contigs, path);
+  }
+#undef indeg
+
+  free(cont);
+  kv_destroy(edges);
+  free(first);
+  free(mark);
+  free(reduced);
+  free(outdeg);
+  free(out1);
+  free(cfirst);
+  free(cmols);
+  free(used);
+  return contigs;
+}
+
+// -------------------------------- consensus --------------------------------
+
+typedef struct cons_label {
+  double mean; // position
+  double m2; // sum of squared deviations from the mean (Welford)
+  uint32_t occurrence; // molecules with this label
+  uint32_t coverage; // molecules aligned across it
+  uint32_t last; // the last molecule (contig index + 1) to add to it
+  uint8_t chan;
+} cons_label;
+
+typedef kvec_t(cons_label) consVec;
+
+static inline void cons_add(cons_label* l, double x, uint32_t mol) {
+  l->last = mol;
+  l->occurrence++;
+  double d = x - l->mean;
+  l->mean += d / l->occurrence;
+  l->m2 += d * (x - l->mean);
+}
+
+static inline cons_label cons_new(double x, uint8_t chan, uint32_t mol) {
+  cons_label l;
+  l.last = mol;
+  l.mean = x;
+  l.m2 = 0;
+  l.occurrence = 1;
+  l.coverage = 1;
+  l.chan = chan;
+  return l;
+}
+
+// first consensus label at or after position x
+static size_t cons_lower_bound(consVec* c, double x) {
+  size_t lo = 0, hi = kv_size(*c), mid;
+  while(lo < hi) {
+    mid = (lo + hi) >> 1;
+    if(kv_A(*c, mid).mean < x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// least-squares slope of consensus against molecule positions - the molecule's stretch relative to the consensus
+static double fit_scale(double* px, double* py, size_t n) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, scale = 1;
+  size_t j;
+  for(j = 0; j < n; j++) {
+    sx += px[j];
+    sy += py[j];
+    sxx += px[j] * px[j];
+    sxy += px[j] * py[j];
+  }
+  if(n >= 2 && sxx * n - sx * sx > 0) scale = (sxy * n - sx * sy) / (sxx * n - sx * sx);
+  return scale < 0.8 || scale > 1.25 ? 1 : scale; // too few or too clustered labels to trust a fit
+}
+
+/*
+ * Consensus position of molecule position x, interpolated between the nearest matched labels on either side
+ * (stretch is not uniform along a molecule) or extrapolated at the given scale past the first or last
+ *
+ * px/py are the molecule and consensus positions of the n matches, increasing; match skip is left out (n for none)
+ */
+static double place(double* px, double* py, size_t n, double x, size_t skip, double scale) {
+  size_t lo = 0, hi = n, mid, l, r;
+  while(lo < hi) {
+    mid = (lo + hi) >> 1;
+    if(px[mid] < x) lo = mid + 1;
+    else hi = mid;
+  }
+  r = lo == skip ? lo + 1 : lo; // first match at or after x
+  l = lo > 0 && lo - 1 == skip ? lo - 1 : lo; // one past the last match before x
+  if(l > 0 && r < n) return px[r] > px[l-1] ? py[l-1] + (x - px[l-1]) * (py[r] - py[l-1]) / (px[r] - px[l-1]) : py[l-1];
+  if(l > 0) return py[l-1] + (x - px[l-1]) * scale;
+  if(r < n) return py[r] - (px[r] - x) * scale;
+  return x;
+}
+
+typedef struct contig_map {
+  u32Vec pos; // label positions, then the contig length
+  byteVec chan;
+  kvec_t(float) stdev;
+  kvec_t(uint16_t) coverage;
+  kvec_t(uint16_t) occurrence;
+} contig_map;
+
+typedef struct cons_ctx {
+  cmap* b;
+  placeVec* contigs;
+  contig_map* maps;
+  uint32_t n_contigs;
+  uint32_t next;
+  int min_coverage;
+} cons_ctx;
+
+/*
+ * Builds the consensus of one contig
+ *
+ * Each molecule is aligned by DTW to the consensus labels around its expected position; matched labels
+ * pile up, and the molecule's other labels are placed by interpolating between its matches (absorbing its
+ * stretch). Labels seen by at least min_coverage molecules, and by at least half of the molecules aligned
+ * across them, make the map
+ */
+static void build_consensus(cmap* b, placeVec* path, int min_coverage, contig_map* out) {
+  consVec cons, added;
+  kv_init(cons);
+  kv_init(added);
+  kvec_t(uint64_t) corr; // query label << 32 | consensus label
+  kv_init(corr);
+  kvec_t(double) px; // molecule positions of the matches
+  kv_init(px);
+  kvec_t(double) py; // consensus positions
+  kv_init(py);
+  u32Vec widx; // consensus labels in the window
+  kv_init(widx);
+  byteVec matched;
+  kv_init(matched);
+  size_t i, j, k, n;
+  double shift = 0; // consensus minus layout coordinates, as of the last molecule aligned
+  double start = 0, end = 0; // consensus span of the aligned molecules
+
+  for(i = 0; i < kv_size(*path); i++) {
+    placement* p = &kv_A(*path, i);
+    molecule* m = &b->molecules[p->mol];
+    mol_frags q;
+    get_mol_frags(m, p->rev, &q);
+    if(q.n < 2) {
+      free_mol_frags(&q);
+      continue;
+    }
+
+    if(kv_size(cons) == 0) { // seed the consensus with the first molecule
+      for(j = 0; j < q.n; j++) kv_push(cons_label, cons, cons_new((double)p->pos + q.pos[j], q.chan[j], i + 1));
+      start = p->pos;
+      end = p->pos + (double)m->length;
+      free_mol_frags(&q);
+      continue;
+    }
+
+    double expected = p->pos + shift, margin = m->length * ASM_WINDOW_FRAC > ASM_WINDOW_MIN ? m->length * ASM_WINDOW_FRAC : ASM_WINDOW_MIN;
+    size_t ws = cons_lower_bound(&cons, expected - margin), we = cons_lower_bound(&cons, expected + m->length + margin);
+    if(we - ws < 2) {
+      free_mol_frags(&q);
+      continue;
+    }
+
+    // window fragments, laid out as the molecule's, between the labels most molecules across them agree on
+    // (the false positives of each molecule would otherwise pile up into fragments too small to match)
+    widx.n = 0;
+    for(j = ws; j < we; j++) {
+      if(kv_A(cons, j).occurrence * 2 >= kv_A(cons, j).coverage) kv_push(uint32_t, widx, j);
+    }
+    if(kv_size(widx) < 2) {
+      free_mol_frags(&q);
+      continue;
+    }
+    uint32_t* tfrags = malloc(kv_size(widx) * sizeof(uint32_t));
+    uint8_t* tchan = malloc(kv_size(widx));
+    for(j = 0; j + 1 < kv_size(widx); j++) {
+      tfrags[j] = (uint32_t)(kv_A(cons, widx.a[j+1]).mean + 0.5) - (uint32_t)(kv_A(cons, widx.a[j]).mean + 0.5);
+      tchan[j] = kv_A(cons, widx.a[j+1]).chan;
+    }
+    result r = dtw(q.frags, tfrags, q.fchan, tchan, q.n - 1, kv_size(widx) - 1, -1, -1, 0.2, 0);
+    free(tfrags);
+    free(tchan);
+    if(r.failed) {
+      free_mol_frags(&q);
+      continue;
+    }
+
+    // matched labels, walking the path back from the end: counts (y, x) are label indices
+    corr.n = 0;
+    uint32_t y = r.qend, x = r.tend;
+    for(j = 0; j < kv_size(r.path); j++) {
+      uint8_t d = kv_A(r.path, j);
+      if(d == MATCH) {
+        kv_push(uint64_t, corr, (uint64_t)y << 32 | widx.a[x]);
+        y--;
+        x--;
+      } else if(d == INS) {
+        y--;
+      } else {
+        x--;
+      }
+    }
+    kv_push(uint64_t, corr, (uint64_t)r.qstart << 32 | widx.a[r.tstart]); // where the alignment starts, fragment starts meet
+    kv_destroy(r.path);
+
+    // into molecule order, with their positions
+    n = kv_size(corr);
+    for(j = 0; j < n / 2; j++) {
+      uint64_t c = kv_A(corr, j);
+      kv_A(corr, j) = kv_A(corr, n-1-j);
+      kv_A(corr, n-1-j) = c;
+    }
+    kv_resize(double, px, n);
+    kv_resize(double, py, n);
+    for(j = 0; j < n; j++) {
+      px.a[j] = q.pos[kv_A(corr, j) >> 32];
+      py.a[j] = kv_A(cons, (uint32_t)kv_A(corr, j)).mean;
+    }
+
+    // the DTW score sums over the whole overlap and so says little about a full-length alignment of noisy
+    // maps; instead most of the molecule's labels must match, each where its neighboring matches put it
+    // (the DTW tolerates enough size deviation to pair some labels with a neighbor of their true match)
+    double scale = fit_scale(px.a, py.a, n);
+    for(j = 0, k = 0; j < n; j++) {
+      if(fabs(place(px.a, py.a, n, px.a[j], j, scale) - py.a[j]) > ASM_MERGE_DIST) continue;
+      kv_A(corr, k) = kv_A(corr, j);
+      px.a[k] = px.a[j];
+      py.a[k] = py.a[j];
+      k++;
+    }
+    n = k;
+    if(n < ASM_MIN_MATCHED * q.n) {
+      free_mol_frags(&q);
+      continue;
+    }
+
+    // matched labels are observed where the matches around them put them
+    kv_resize(uint8_t, matched, q.n);
+    memset(matched.a, 0, q.n);
+    for(j = 0; j < n; j++) {
+      matched.a[kv_A(corr, j) >> 32] = 1;
+      cons_add(&kv_A(cons, (uint32_t)kv_A(corr, j)), place(px.a, py.a, n, px.a[j], j, scale), i + 1);
+    }
+    for(j = widx.a[r.tstart]; j <= widx.a[r.tend]; j++) kv_A(cons, j).coverage++;
+
+    // the molecule's other labels join a nearby consensus label it has not matched, or are new to the consensus
+    added.n = 0;
+    for(j = 0; j < q.n; j++) {
+      if(matched.a[j]) continue;
+      double cx = place(px.a, py.a, n, q.pos[j], n, scale);
+      size_t near = cons_lower_bound(&cons, cx);
+      if(near > 0 && (near == kv_size(cons) || cx - kv_A(cons, near-1).mean < kv_A(cons, near).mean - cx)) near--;
+      if(near < kv_size(cons) && fabs(kv_A(cons, near).mean - cx) < ASM_MERGE_DIST && kv_A(cons, near).last != i + 1 && kv_A(cons, near).chan == q.chan[j]) {
+        cons_add(&kv_A(cons, near), cx, i + 1);
+        if(near < widx.a[r.tstart] || near > widx.a[r.tend]) kv_A(cons, near).coverage++;
+      } else {
+        kv_push(cons_label, added, cons_new(cx, q.chan[j], i + 1));
+      }
+    }
+    if(kv_size(added) > 0) {
+      consVec merged;
+      kv_init(merged);
+      kv_resize(cons_label, merged, kv_size(cons) + kv_size(added));
+      for(j = 0, k = 0; j < kv_size(cons) || k < kv_size(added); ) {
+        if(k >= kv_size(added) || (j < kv_size(cons) && kv_A(cons, j).mean <= kv_A(added, k).mean)) kv_push(cons_label, merged, kv_A(cons, j++));
+        else kv_push(cons_label, merged, kv_A(added, k++));
+      }
+      kv_destroy(cons);
+      cons = merged;
+    }
+    // updated means can pass their neighbors, but not by much
+    for(j = 1; j < kv_size(cons); j++) {
+      cons_label l = kv_A(cons, j);
+      for(k = j; k > 0 && kv_A(cons, k-1).mean > l.mean; k--) kv_A(cons, k) = kv_A(cons, k-1);
+      kv_A(cons, k) = l;
+    }
+
+    double mstart = place(px.a, py.a, n, 0, n, scale), mend = place(px.a, py.a, n, m->length, n, scale);
+    shift = mstart - p->pos;
+    if(mstart < start) start = mstart;
+    if(mend > end) end = mend;
+    free_mol_frags(&q);
+  }
+
+  kv_init(out->pos);
+  kv_init(out->chan);
+  kv_init(out->stdev);
+  kv_init(out->coverage);
+  kv_init(out->occurrence);
+  for(j = 0; j < kv_size(cons); j++) {
+    cons_label* l = &kv_A(cons, j);
+    if(l->occurrence < min_coverage || l->occurrence * 2 < l->coverage) continue;
+    if(kv_size(out->pos) == 0 && l->mean < start) start = l->mean;
+    kv_push(uint32_t, out->pos, (uint32_t)(l->mean - start + 0.5));
+    kv_push(uint8_t, out->chan, l->chan);
+    kv_push(float, out->stdev, (float)sqrt(l->m2 / l->occurrence));
+    kv_push(uint16_t, out->coverage, l->coverage > UINT16_MAX ? UINT16_MAX : l->coverage);
+    kv_push(uint16_t, out->occurrence, l->occurrence > UINT16_MAX ? UINT16_MAX : l->occurrence);
+  }
+  if(kv_size(out->pos) > 0) {
+    uint32_t len = (uint32_t)(end - start + 0.5);
+    if(len < kv_A(out->pos, kv_size(out->pos) - 1)) len = kv_A(out->pos, kv_size(out->pos) - 1);
+    kv_push(uint32_t, out->pos, len); // the map end
+  }
+
+  kv_destroy(cons);
+  kv_destroy(added);
+  kv_destroy(corr);
+  kv_destroy(px);
+  kv_destroy(py);
+  kv_destroy(widx);
+  kv_destroy(matched);
+}
+
+static void* consensus_worker(void* arg) {
+  cons_ctx* ctx = (cons_ctx*)((worker_arg*)arg)->ctx;
+  uint32_t i;
+  while((i = __sync_fetch_and_add(&ctx->next, 1)) < ctx->n_contigs) {
+    build_consensus(ctx->b, &ctx->contigs[i], ctx->min_coverage, &ctx->maps[i]);
+  }
+  return NULL;
+}
+
+/*
+ * Assembles the molecules of b into consensus maps, added to out
+ *
+ * Overlaps and consensus maps are computed on threads threads; contigs are numbered from 1 in layout order,
+ * and those with fewer than two labels are dropped. placement and numa place the overlap index (see
+ * find_overlaps())
+ *
+ * returns: 0 if successful, else 1
+ */
+int assemble_cmap(cmap b, cmap* out, int seed_mode, int q, int bin_size, int max_qgrams, float repeat_frac, int chain_threshold, float dtw_threshold, int min_labels, int min_coverage, int threads, int placement, int numa) {
+  uint32_t i, j;
+  if(threads < 1) threads = 1;
+  time_t t0 = time(NULL);
+
+  mol_frags* mf = malloc((b.n_maps + 1) * sizeof(mol_frags));
+  for(i = 0; i < b.n_maps; i++) get_mol_frags(&b.molecules[i], 0, &mf[i]);
+
+  ovlVec ovls = find_overlaps(&b, mf, seed_mode, q, bin_size, max_qgrams, repeat_frac, chain_threshold, dtw_threshold, min_labels, threads, placement, numa);
+  time_t t1 = time(NULL);
+  fprintf(stderr, "# Found %zu overlaps in %d seconds\n", kv_size(ovls), (int)(t1-t0));
+  for(i = 0; i < b.n_maps; i++) free_mol_frags(&mf[i]);
+  free(mf);
+
+  contigVec contigs = layout(&b, &ovls);
+  kv_destroy(ovls);
+  fprintf(stderr, "# Laid out %zu contigs\n", kv_size(contigs));
+
+  cons_ctx ctx;
+  ctx.b = &b;
+  ctx.contigs = contigs.a;
+  ctx.n_contigs = kv_size(contigs);
+  ctx.maps = malloc((ctx.n_contigs + 1) * sizeof(contig_map));
+  ctx.next = 0;
+  ctx.min_coverage = min_coverage;
+  run_workers(consensus_worker, &ctx, threads);
+
+  out->n_rec_seqs = b.n_rec_seqs;
+  out->rec_seqs = b.rec_seqs;
+  int ret = 0;
+  uint32_t id = 1;
+  for(i = 0; i < ctx.n_contigs; i++) {
+    contig_map* cm = &ctx.maps[i];
+    if(kv_size(cm->pos) > 2) { // two labels and the end
+      molecule* mol;
+      ret |= add_map_channels(out, id++, cm->pos.a, cm->chan.a, kv_size(cm->pos), 1);
+      mol = &out->molecules[out->n_maps - 1];
+      for(j = 0; j + 1 < kv_size(cm->pos); j++) {
+        mol->labels[j].stdev = kv_A(cm->stdev, j);
+        mol->labels[j].coverage = kv_A(cm->coverage, j);
+        mol->labels[j].occurrence = kv_A(cm->occurrence, j);
+      }
+    }
+    kv_destroy(cm->pos);
+    kv_destroy(cm->chan);
+    kv_destroy(cm->stdev);
+    kv_destroy(cm->coverage);
+    kv_destroy(cm->occurrence);
+    kv_destroy(kv_A(contigs, i));
+  }
+  free(ctx.maps);
+  kv_destroy(contigs);
+  fprintf(stderr, "# Built %u consensus maps in %d seconds\n", out->n_maps, (int)(time(NULL)-t1));
+  return ret;
+}
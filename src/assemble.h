@@ -0,0 +1,50 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include "cmap.h"
+
+#ifndef __ASSEMBLE_H__
+#define __ASSEMBLE_H__
+
+// overlap kinds, from the point of view of the pair's lower-numbered molecule a
+#define OVL_DOVETAIL 0
+#define OVL_B_IN_A 1 // b is contained in a
+#define OVL_A_IN_B 2 // a is contained in b
+
+// one verified overlap between molecules a < b (indices into the input maps)
+typedef struct overlap {
+  uint32_t a;
+  uint32_t b;
+  int32_t offset; // start of b, in its aligned orientation, in a's forward coordinates (may be negative)
+  float score; // DTW score
+  uint8_t rev; // b is reversed against a
+  uint8_t type;
+} overlap;
+
+typedef kvec_t(overlap) ovlVec;
+
+int assemble_cmap(cmap b, cmap* out, int seed_mode, int q, int bin_size, int max_qgrams, float repeat_frac, int chain_threshold, float dtw_threshold, int min_labels, int min_coverage, int threads, int placement, int numa);
+
+#endif /* __ASSEMBLE_H__ */
@@ -25,7 +25,14 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "klib/ksort.h"
 #include "cmap.h"
+#include "bnx.h"
+
+#define bnx_entry_lt(a, b) ((a).id < (b).id)
+KSORT_INIT(bnx_entry_cmp, bnx_entry, bnx_entry_lt)
 
 /*
 ...
@@ -49,30 +56,23 @@ QX11  30.34 56.27 24.36 33.02 34.97 46.89 86.29 39.59 58.28 44.01 35.01 39.02 67
 QX12  349.10  647.47  280.27  379.94  402.39  539.51  992.92  455.53  670.65  506.39  402.88 ...
 */
 
-// it seems like "LabelChannel" is the first field and is always 0 for the header line and 1 (or higher, I've never seen it?) for the actual label line
+// "LabelChannel" is the first field: 0 for the header line, then 1, 2, ... for one label line per channel (multi-color data has several)
 
-int read_bnx_header(FILE *fp, cmap *c) {
-	char buf[10240];
-	int i, ch;
-	char *val;
-	while ((ch = getc(fp)) != EOF) {
-		if (ch != '#') {
-			ungetc(ch, fp);
-			break;
-		}
-		if(fgets(buf, sizeof(buf), fp) == NULL) break; // returns a NULL pointer if there was nothing to read
+int read_bnx_header(BGZF *fp, cmap *c) {
+  kstring_t line = {0, 0, NULL};
+	char *buf;
+	int i;
+	while (bgzf_peek(fp) == '#') {
+		if(bgzf_getline(fp, '\n', &line) < 0) break;
+		buf = line.s + 1; // skip the '#'
 		if(string_begins_with(buf, " BNX File Version:")) {
       assert(strcmp(get_val(buf), "1.3") == 0); // must be version 1.3
     }
 		if(string_begins_with(buf, " Label Channels:")) {
-      c->n_rec_seqs = atoi(get_val(buf));
-      c->rec_seqs = malloc(c->n_rec_seqs * sizeof(char*));
+      set_channels(c, atoi(get_val(buf)));
 		}
-		if(string_begins_with(buf, " Nickase Recognition Site 1:")) {
-      c->rec_seqs[0] = strdup(get_val(buf));
-		}
-		if(string_begins_with(buf, " Nickase Recognition Site 2:")) { // only supports up to 2 recog site right now
-      c->rec_seqs[1] = strdup(get_val(buf));
+		if(string_begins_with(buf, " Nickase Recognition Site ")) {
+      read_rec_site(buf, c);
 		}
 		if(string_begins_with(buf, " Number of Molecules:")) {
       c->n_maps = atoi(get_val(buf));
@@ -82,6 +82,7 @@ int read_bnx_header(FILE *fp, cmap *c) {
       }
     }
 	}
+  free(line.s);
   if(c->n_maps <= 0) {
     fprintf(stderr, "Number of molecules header line not found or 0\n");
     return 1;
@@ -89,20 +90,19 @@ int read_bnx_header(FILE *fp, cmap *c) {
 	return 0;
 }
 
-int read_bnx_molecule(FILE *fp, cmap *c, int idx) {
+int read_bnx_molecule(BGZF *fp, cmap *c, int idx) {
   char** parts;
-	char buf[16384];
-	char token_buf[256];
+  kstring_t line = {0, 0, NULL};
   int i;
   const char* delim = "\t";
   
   // ------ line 0 ------
-  if(fgets(buf, sizeof(buf), fp) == NULL) {
+  if(bgzf_getline(fp, '\n', &line) <= 0) { // end of file or an empty line
+    free(line.s);
     return 1;
   }
 
-  char* ln = strndup(buf, sizeof(buf));
-  if(strcmp(ln, "\n") == 0) return 1; // empty line
+  char* ln = strdup(line.s);
   parts = malloc(sizeof(char*) * 20); // always exactly 20 fields in a 0 header line (for version 1.3)
   i = 0;
   char* token;
@@ -113,75 +113,92 @@ int read_bnx_molecule(FILE *fp, cmap *c, int idx) {
     token = strtok(NULL, delim);
   }
   //fprintf(stderr, "\n");
-  int nfields = i;
-  //assert(nfields == 20);
 
   assert(strcmp(parts[0], "0") == 0);
 
   c->molecules[idx].id = atoi(parts[1]);
   c->molecules[idx].length = (size_t)atof(parts[2]);
-  c->molecules[idx].n_labels = (size_t)atof(parts[5]) + 1; // actual count is always 1 higher... maybe doesn't count end marker
-  c->molecules[idx].labels = malloc(c->molecules[idx].n_labels * sizeof(label));
-  
-  // ------ line 1 ------
-  if(fgets(buf, sizeof(buf), fp) == NULL) {
-    return 1;
-  }
-  token = strtok(buf, delim); // labelchannel
-  int channel = atoi(token);
-  token = strtok(NULL, delim); // first label pos
-  i = 0;
-  while(token != NULL) {
-    assert(i < c->molecules[idx].n_labels);
-    c->molecules[idx].labels[i].position = (uint32_t)atof(token);
-    c->molecules[idx].labels[i].channel = (uint8_t)channel;
-    c->molecules[idx].labels[i].occurrence = 0; // this is not used for molecule data, so it will always be 0
-    c->molecules[idx].labels[i].stdev = 0; // these will be set explicitly for all except the last label
-    c->molecules[idx].labels[i].coverage = 0;
-    token = strtok(NULL, delim);
-    i++;
-  }
-  // sscanf implicitly skips the newline
-
-  // ------ line 2 ------
-  if(fgets(buf, sizeof(buf), fp) == NULL) {
-    return 1;
-  }
-  token = strtok(buf, delim); // labelchannel
-  assert(strcmp(token, "QX11") == 0 || strcmp(token, "QX11\n") == 0);
-  token = strtok(NULL, delim); // first label pos
-  i = 0;
-  while(token != NULL) {
-    assert(i < c->molecules[idx].n_labels);
-    c->molecules[idx].labels[i].stdev = (uint32_t)atof(token); // THIS IS SNR, NOT stdev
-    token = strtok(NULL, delim);
-    i++;
-  }
 
-  // ------ line 3 ------
-  if(fgets(buf, sizeof(buf), fp) == NULL) {
-    return 1;
+  // ------ label lines (one per channel), then QX<channel>1/QX<channel>2 quality lines ------
+  // each label line ends with the molecule length, which becomes the single end marker (channel 0)
+  kvec_t(label) labels;
+  kv_init(labels);
+  size_t ch_start[MAX_CHANNELS+1] = {0}, ch_count[MAX_CHANNELS+1] = {0};
+  while((i = bgzf_peek(fp)) >= 0) {
+    if(i == '0' || i == '\n' || i == '#') break; // next molecule
+    if(bgzf_getline(fp, '\n', &line) < 0) break;
+    token = strtok(line.s, delim);
+    if(token[0] == 'Q') {
+      // QX<channel><1|2>: 1 is SNR (stored as stdev), 2 is intensity (stored as coverage)
+      int channel = token[2] - '0';
+      int field = token[3] - '0';
+      assert(channel >= 1 && channel <= MAX_CHANNELS);
+      size_t k = 0;
+      token = strtok(NULL, delim);
+      while(token != NULL && k < ch_count[channel]) {
+        if(field == 1) labels.a[ch_start[channel] + k].stdev = (uint32_t)atof(token); // THIS IS SNR, NOT stdev
+        else labels.a[ch_start[channel] + k].coverage = (uint32_t)atof(token); // THIS IS Intensity, NOT coverage
+        token = strtok(NULL, delim);
+        k++;
+      }
+      continue;
+    }
+    int channel = atoi(token);
+    assert(channel >= 1 && channel <= MAX_CHANNELS);
+    ch_start[channel] = kv_size(labels);
+    token = strtok(NULL, delim); // first label pos
+    if(token == NULL) {
+      fprintf(stderr, "Label line for channel %d of molecule %d has no molecule length\n", channel, c->molecules[idx].id);
+      kv_destroy(labels);
+      free(line.s);
+      free(ln);
+      free(parts);
+      return 1;
+    }
+    while(token != NULL) {
+      label l;
+      l.position = (uint32_t)atof(token);
+      l.channel = (uint8_t)channel;
+      l.occurrence = 0; // this is not used for molecule data, so it will always be 0
+      l.stdev = 0; // these will be set explicitly for all except the last label
+      l.coverage = 0;
+      kv_push(label, labels, l);
+      token = strtok(NULL, delim);
+    }
+    kv_size(labels)--; // drop the trailing length, re-added once as the end marker
+    ch_count[channel] = kv_size(labels) - ch_start[channel];
   }
-  token = strtok(buf, delim); // labelchannel
-  assert(strcmp(token, "QX12") == 0 || strcmp(token, "QX12\n") == 0);
-  token = strtok(NULL, delim); // first label pos
-  i = 0;
-  while(token != NULL) {
-    assert(i < c->molecules[idx].n_labels);
-    c->molecules[idx].labels[i].coverage = (uint32_t)atof(token); // THIS IS Intensity, NOT coverage
-    token = strtok(NULL, delim);
-    i++;
+  // merge the per-channel label lists by position (each is already sorted)
+  molecule *m = &c->molecules[idx];
+  m->n_labels = kv_size(labels) + 1;
+  m->labels = malloc(m->n_labels * sizeof(label));
+  size_t next[MAX_CHANNELS+1];
+  memcpy(next, ch_start, sizeof(next));
+  for(i = 0; i < kv_size(labels); i++) {
+    int best = 0, ch;
+    for(ch = 1; ch <= MAX_CHANNELS; ch++) {
+      if(next[ch] < ch_start[ch] + ch_count[ch] && (best == 0 || labels.a[next[ch]].position < labels.a[next[best]].position)) {
+        best = ch;
+      }
+    }
+    m->labels[i] = labels.a[next[best]++];
   }
+  m->labels[i].position = m->length;
+  m->labels[i].channel = 0;
+  m->labels[i].occurrence = 0;
+  m->labels[i].stdev = 0;
+  m->labels[i].coverage = 0;
 
+  kv_destroy(labels);
+  free(line.s);
   free(ln);
   free(parts);
-  free(token);
 
 	//next_line(fp, buf, sizeof(buf));
 	return 0;
 }
 
-int write_bnx(cmap *c, FILE* fp) {
+int write_bnx(cmap *c, BGZF* fp) {
   //FILE* fp = fopen(fn, "w");
   if(!fp) {
     fprintf(stderr, "Failed to write cmap (invalid file pointer)\n");
@@ -189,55 +206,173 @@ int write_bnx(cmap *c, FILE* fp) {
   }
 
   size_t i, j, k;
+  kstring_t out = {0, 0, NULL}; // formatted text, written out in large chunks
 
-  fprintf(fp, "# BNX File Version:\t1.3\n");
-  fprintf(fp, "# Label Channels:\t%d\n", c->n_rec_seqs);
+  ksprintf(&out, "# BNX File Version:\t1.3\n");
+  ksprintf(&out, "# Label Channels:\t%d\n", c->n_rec_seqs);
   for(j = 0; j < c->n_rec_seqs; j++) {
-    fprintf(fp, "# Nickase Recognition Site %u:\t%s\n", j+1, c->rec_seqs[j]);
+    ksprintf(&out, "# Nickase Recognition Site %u:\t%s\n", j+1, c->rec_seqs[j]);
+  }
+  ksprintf(&out, "#rh SourceFolder\tInstrumentSerial\tTime\tNanoChannelPixelsPerScan\tStretchFactor\tBasesPerPixel\tNumberofScans\tChipId\tFlowCell\tSNRFilterType\tMinMoleculeLength\tMinLabelSNR\tRunId\n");
+  ksprintf(&out, "# Run Data\t/fake_chip_path\t-\t1970-01-01 12:00:01 AM\t100000000\t1\t500\t1\tchips,fake_chip,Run_fake,0\t1\tdynamic\t15.00\t2.000000\t1\n");
+  ksprintf(&out, "# Bases per Pixel:\t%u\n", 500);
+  ksprintf(&out, "# Number of Molecules:\t%u\n", c->n_maps);
+  ksprintf(&out, "# Min Label SNR:\t%.2f\n", 0);
+  ksprintf(&out, "#0h LabelChannel  MoleculeID  Length  AvgIntensity  SNR NumberofLabels  OriginalMoleculeId  ScanNumber  ScanDirection ChipId  Flowcell  RunId Column  StartFOV  StartX  StartY  EndFOV  EndX  EndY  GlobalScanNumber\n");
+  ksprintf(&out, "#0f int  int   float  float float int int int int string  int int int int int int int int int int\n");
+  ksprintf(&out, "#1h LabelChannel  LabelPositions[N]\n");
+  ksprintf(&out, "#1f int float\n");
+  ksprintf(&out, "#Qh QualityScoreID  QualityScores[N]\n");
+  ksprintf(&out, "#Qf string  float[N]\n");
+  int ch, n_channels = c->n_rec_seqs > 0 ? c->n_rec_seqs : 1;
+  for(ch = 1; ch <= n_channels; ch++) {
+    ksprintf(&out, "# Quality Score QX%d1: Label SNR for channel %d\n", ch, ch);
+    ksprintf(&out, "# Quality Score QX%d2: Label Intensity for channel %d\n", ch, ch);
   }
-  fprintf(fp, "#rh SourceFolder\tInstrumentSerial\tTime\tNanoChannelPixelsPerScan\tStretchFactor\tBasesPerPixel\tNumberofScans\tChipId\tFlowCell\tSNRFilterType\tMinMoleculeLength\tMinLabelSNR\tRunId\n");
-  fprintf(fp, "# Run Data\t/fake_chip_path\t-\t1970-01-01 12:00:01 AM\t100000000\t1\t500\t1\tchips,fake_chip,Run_fake,0\t1\tdynamic\t15.00\t2.000000\t1\n");
-  fprintf(fp, "# Bases per Pixel:\t%u\n", 500);
-  fprintf(fp, "# Number of Molecules:\t%u\n", c->n_maps);
-  fprintf(fp, "# Min Label SNR:\t%.2f\n", 0);
-  fprintf(fp, "#0h LabelChannel  MoleculeID  Length  AvgIntensity  SNR NumberofLabels  OriginalMoleculeId  ScanNumber  ScanDirection ChipId  Flowcell  RunId Column  StartFOV  StartX  StartY  EndFOV  EndX  EndY  GlobalScanNumber\n");
-  fprintf(fp, "#0f int  int   float  float float int int int int string  int int int int int int int int int int\n");
-  fprintf(fp, "#1h LabelChannel  LabelPositions[N]\n");
-  fprintf(fp, "#1f int float\n");
-  fprintf(fp, "#Qh QualityScoreID  QualityScores[N]\n");
-  fprintf(fp, "#Qf string  float[N]\n");
-  fprintf(fp, "# Quality Score QX11: Label SNR for channel 1\n");
-  fprintf(fp, "# Quality Score QX12: Label Intensity for channel 1\n");
 
   // ScanNumber is always 1, ScanDirection is unknown (-1), GlobalScanNumber is always 1, RunId is always 1
   for(i = 0; i < c->n_maps; i++) {
-    fprintf(fp, "%d\t%d\t%.2f\t%.2f\t%.2f\t%d\t%d\t%d\t%d\tsim\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", 0, c->molecules[i].id, (float)c->molecules[i].length, 0.0, 0.0, c->molecules[i].n_labels-1, i+1, 1, -1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1);
-    fprintf(fp, "1");
-    for(k = 0; k < c->molecules[i].n_labels; k++) {
-      fprintf(fp, "\t%.2f", (float)c->molecules[i].labels[k].position);
+    ksprintf(&out, "%d\t%d\t%.2f\t%.2f\t%.2f\t%d\t%d\t%d\t%d\tsim\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", 0, c->molecules[i].id, (float)c->molecules[i].length, 0.0, 0.0, c->molecules[i].n_labels-1, i+1, 1, -1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1);
+    // one label line per channel, each ending with the molecule length
+    for(ch = 1; ch <= n_channels; ch++) {
+      ksprintf(&out, "%d", ch);
+      for(k = 0; k < c->molecules[i].n_labels - 1; k++) {
+        if(c->molecules[i].labels[k].channel == ch) ksprintf(&out, "\t%.2f", (float)c->molecules[i].labels[k].position);
+      }
+      ksprintf(&out, "\t%.2f\n", (float)c->molecules[i].length);
     }
     // qualities have one fewer than lengths because the end position has a position but no quality
-    fprintf(fp, "\nQX11");
-    for(k = 0; k < c->molecules[i].n_labels - 1; k++) {
-      fprintf(fp, "\t%.2f", 50.0); //(float)c->molecules[i].labels[k].stdev); // stdev is usually 0 for in silico digestions and simulations, but Refaligner uses this as SNR - 50 is an unambiguously good value
+    for(ch = 1; ch <= n_channels; ch++) {
+      ksprintf(&out, "QX%d1", ch);
+      for(k = 0; k < c->molecules[i].n_labels - 1; k++) {
+        if(c->molecules[i].labels[k].channel == ch) ksprintf(&out, "\t%.2f", 50.0); //(float)c->molecules[i].labels[k].stdev); // stdev is usually 0 for in silico digestions and simulations, but Refaligner uses this as SNR - 50 is an unambiguously good value
+      }
+      ksprintf(&out, "\nQX%d2", ch);
+      for(k = 0; k < c->molecules[i].n_labels - 1; k++) {
+        if(c->molecules[i].labels[k].channel == ch) ksprintf(&out, "\t%.2f", 5.0); //(float)c->molecules[i].labels[k].coverage); // same - 5 is a high Intensity value if Refaligner wants to filter on this
+      }
+      ksprintf(&out, "\n");
     }
-    fprintf(fp, "\nQX12");
-    for(k = 0; k < c->molecules[i].n_labels - 1; k++) {
-      fprintf(fp, "\t%.2f", 5.0); //(float)c->molecules[i].labels[k].coverage); // same - 5 is a high Intensity value if Refaligner wants to filter on this
+    if(flush_text(fp, &out, 1 << 16) != 0) {
+      free(out.s);
+      return 1;
     }
-    fprintf(fp, "\n");
   }
+  int ret = flush_text(fp, &out, 0);
+  free(out.s);
 
   //fclose(fp);
-  return 0;
+  return ret;
 }
 
-cmap read_bnx(const char *filename) {
-  cmap c;
+/*
+ * Molecule index (<bnx>.idx)
+ *
+ * One fixed-width line per molecule, in file order: the uncompressed byte offset of its "0" line and its
+ * molecule ID. Fixed-width lines put the entry for molecule i at byte i * BNX_IDX_LINE, so a shard
+ * reads exactly one entry no matter how large the file is
+ */
+#define BNX_IDX_LINE 32 // 20-digit offset, tab, 10-digit ID, newline
 
-	FILE *fp;
+static char* bnx_idx_name(const char* fn) {
+  char* idx = malloc(strlen(fn) + 5);
+  sprintf(idx, "%s.idx", fn);
+  return idx;
+}
+
+// the index is usable if it exists and is no older than the BNX
+static int bnx_idx_current(const char* fn, const char* idx) {
+  struct stat fs, is;
+  if(stat(fn, &fs) != 0 || stat(idx, &is) != 0) return 0;
+  return is.st_mtime >= fs.st_mtime;
+}
 
-	fp = fopen(filename, "r");
+// builds <fn>.idx (and <fn>.gzi if the BNX is BGZF) by scanning molecule header lines without parsing labels
+int index_bnx(const char* fn) {
+  BGZF* fp = open_map_file(fn, "r");
+  if(!fp) {
+    fprintf(stderr, "File '%s' not found\n", fn);
+    return 1;
+  }
+  int bgzf = bgzf_compression(fp) == 2;
+  if(bgzf && bgzf_index_build_init(fp) != 0) {
+    fprintf(stderr, "Failed to index '%s'\n", fn);
+    bgzf_close(fp);
+    return 1;
+  }
+
+  // written to a temporary file, then renamed, so concurrent shards never see a partial index
+  char* idx = bnx_idx_name(fn);
+  char* tmp = create_temp(idx);
+  FILE* o = tmp != NULL ? fopen(tmp, "w") : NULL;
+  if(!o) {
+    fprintf(stderr, "Failed to write index '%s'\n", idx);
+    if(tmp != NULL) commit_temp(tmp, idx, 1);
+    bgzf_close(fp);
+    free(idx);
+    return 1;
+  }
+
+  kstring_t line = {0, 0, NULL};
+  int64_t off = bgzf_utell(fp);
+  size_t n = 0;
+  while(bgzf_getline(fp, '\n', &line) >= 0) {
+    if(line.l > 1 && line.s[0] == '0' && line.s[1] == '\t') {
+      fprintf(o, "%020lld\t%010u\n", (long long)off, (uint32_t)atol(line.s + 2));
+      n++;
+    }
+    off = bgzf_utell(fp);
+  }
+  free(line.s);
+
+  int ret = fclose(o) != 0;
+  if(bgzf && !ret) ret = dump_bgzf_index(fp, fn);
+  ret = commit_temp(tmp, idx, ret);
+  if(ret) fprintf(stderr, "Failed to write index '%s'\n", idx);
+  else fprintf(stderr, "# Indexed %zu molecules in '%s'\n", n, idx);
+  bgzf_close(fp);
+  free(idx);
+  return ret;
+}
+
+// looks up the offset of molecule mol (0-based) in <fn>.idx, -1 if there is no such entry
+static int64_t bnx_idx_offset(const char* fn, int mol) {
+  char* idx = bnx_idx_name(fn);
+  FILE* fp = fopen(idx, "r");
+  free(idx);
+  if(!fp) return -1;
+  char buf[BNX_IDX_LINE + 1];
+  int64_t off = -1;
+  if(fseeko(fp, (off_t)mol * BNX_IDX_LINE, SEEK_SET) == 0 && fread(buf, 1, BNX_IDX_LINE, fp) == BNX_IDX_LINE) {
+    buf[BNX_IDX_LINE] = '\0';
+    off = atoll(buf);
+  }
+  fclose(fp);
+  return off;
+}
+
+// advances past n molecules by their "0" lines without parsing them
+static void skip_bnx_molecules(BGZF* fp, int n) {
+  kstring_t line = {0, 0, NULL};
+  int ch, seen = 0;
+  while((ch = bgzf_peek(fp)) >= 0) {
+    if(ch == '0' && seen++ == n) break;
+    if(bgzf_getline(fp, '\n', &line) < 0) break;
+  }
+  free(line.s);
+}
+
+/*
+ * Reads molecules start_mol..end_mol (0-based, inclusive; end_mol < 0 reads to the end of the file)
+ *
+ * A range starting past the first molecule seeks to it through <filename>.idx, building the index on first
+ * use; plain gzip input cannot be seeked and is skipped through instead
+ */
+cmap read_bnx_range(const char *filename, int start_mol, int end_mol) {
+  cmap c;
+  init_cmap(&c);
+
+	BGZF *fp = open_map_file(filename, "r");
 	if (!fp) {
     fprintf(stderr, "File '%s' not found\n", filename);
 		return c;
@@ -245,14 +380,184 @@ cmap read_bnx(const char *filename) {
 
 	if (read_bnx_header(fp, &c) != 0) {
     fprintf(stderr, "File '%s' header could not be read\n", filename);
-		fclose(fp);
+		bgzf_close(fp);
 		return c;
 	}
+  if(end_mol < 0 || end_mol >= c.n_maps) end_mol = c.n_maps - 1;
+  if(start_mol < 0) start_mol = 0;
+  int n = end_mol >= start_mol ? end_mol - start_mol + 1 : 0;
+
+  if(start_mol > 0) {
+    int64_t off = -1;
+    if(bgzf_compression(fp) != 1) { // plain gzip has no random access
+      char* idx = bnx_idx_name(filename);
+      if(!bnx_idx_current(filename, idx)) {
+        fprintf(stderr, "# Building molecule index '%s'\n", idx);
+        index_bnx(filename);
+        // reopen to pick up a freshly built .gzi
+        bgzf_close(fp);
+        fp = open_map_file(filename, "r");
+        if(!fp) {
+          fprintf(stderr, "File '%s' could not be reopened\n", filename);
+          free(idx);
+          c.n_maps = 0;
+          return c;
+        }
+      }
+      free(idx);
+      off = bnx_idx_offset(filename, start_mol);
+    }
+    if(off < 0 || bgzf_useek(fp, off, SEEK_SET) != 0) {
+      skip_bnx_molecules(fp, start_mol);
+    }
+  }
+
+  // only the requested range is kept
+  free(c.molecules);
+  c.molecules = malloc((n > 0 ? n : 1) * sizeof(molecule));
   int i = 0;
-	while (read_bnx_molecule(fp, &c, i++) == 0) {
-    // just looping through the file, reads 4 lines (1 molecule) each time
+	while (i < n && read_bnx_molecule(fp, &c, i) == 0) {
+    // just looping through the file, reads 1 molecule (1 + 3 lines per channel) each time
+    i++;
 	}
-	fclose(fp);
+  c.n_maps = i;
+	bgzf_close(fp);
 
 	return c;
 }
+
+cmap read_bnx(const char *filename) {
+  return read_bnx_range(filename, 0, -1);
+}
+
+// reads every entry of <fn>.idx, NULL if it can't be read
+static bnx_entry* read_bnx_idx(const char* fn, size_t* n) {
+  char* idx = bnx_idx_name(fn);
+  FILE* fp = fopen(idx, "r");
+  free(idx);
+  if(!fp) return NULL;
+  fseeko(fp, 0, SEEK_END);
+  *n = ftello(fp) / BNX_IDX_LINE;
+  rewind(fp);
+  bnx_entry* e = malloc((*n > 0 ? *n : 1) * sizeof(bnx_entry));
+  char buf[BNX_IDX_LINE + 1];
+  size_t i;
+  for(i = 0; i < *n && fread(buf, 1, BNX_IDX_LINE, fp) == BNX_IDX_LINE; i++) {
+    buf[BNX_IDX_LINE] = '\0';
+    e[i].off = atoll(buf);
+    e[i].id = (uint32_t)atol(buf + 21);
+  }
+  fclose(fp);
+  if(i < *n) {
+    free(e);
+    return NULL;
+  }
+  return e;
+}
+
+// entries of the molecules held in r->c
+static void index_molecules(bnxReader* r) {
+  uint32_t i;
+  r->n = r->c.n_maps;
+  r->entries = malloc((r->n > 0 ? r->n : 1) * sizeof(bnx_entry));
+  for(i = 0; i < r->c.n_maps; i++) {
+    r->entries[i].id = r->c.molecules[i].id;
+    r->entries[i].off = i;
+  }
+}
+
+/*
+ * Opens a BNX to look up molecules by ID: only its molecule index (<fn>.idx, built on first use) is held,
+ * and each molecule is read when it is asked for. Plain gzip and standard input can't be seeked, so those
+ * are read whole instead
+ */
+bnxReader* bnx_reader_open(const char* fn) {
+  bnxReader* r = malloc(sizeof(bnxReader));
+  init_cmap(&r->c);
+  r->n = 0;
+  r->entries = NULL;
+  r->fp = open_map_file(fn, "r");
+  if(!r->fp) {
+    fprintf(stderr, "File '%s' not found\n", fn);
+    free(r);
+    return NULL;
+  }
+  r->whole = strcmp(fn, "-") == 0 || bgzf_compression(r->fp) == 1;
+  if(!r->whole) {
+    char* idx = bnx_idx_name(fn);
+    if(!bnx_idx_current(fn, idx)) {
+      fprintf(stderr, "# Building molecule index '%s'\n", idx);
+      index_bnx(fn);
+      // reopen to pick up a freshly built .gzi
+      bgzf_close(r->fp);
+      r->fp = open_map_file(fn, "r");
+    }
+    free(idx);
+    if(r->fp) r->entries = read_bnx_idx(fn, &r->n);
+    if(r->entries == NULL) {
+      fprintf(stderr, "Molecule index of '%s' could not be read\n", fn);
+      bnx_reader_close(r);
+      return NULL;
+    }
+  }
+  if(read_bnx_header(r->fp, &r->c) != 0) {
+    fprintf(stderr, "File '%s' header could not be read\n", fn);
+    bnx_reader_close(r);
+    return NULL;
+  }
+
+  uint32_t i;
+  if(r->whole) {
+    for(i = 0; i < r->c.n_maps && read_bnx_molecule(r->fp, &r->c, i) == 0; i++);
+    r->c.n_maps = i;
+    index_molecules(r);
+  } else {
+    // room for the one molecule held at a time
+    free(r->c.molecules);
+    r->c.molecules = malloc(sizeof(molecule));
+    r->c.n_maps = 0;
+  }
+  ks_mergesort(bnx_entry_cmp, r->n, r->entries, 0);
+  return r;
+}
+
+// looks up the molecules of an already loaded BNX, which the reader takes over
+bnxReader* bnx_reader_wrap(cmap c) {
+  bnxReader* r = malloc(sizeof(bnxReader));
+  r->fp = NULL;
+  r->c = c;
+  r->whole = 1;
+  index_molecules(r);
+  ks_mergesort(bnx_entry_cmp, r->n, r->entries, 0);
+  return r;
+}
+
+// the molecule with this ID, NULL if there is none or it can't be read - valid until the next call
+molecule* bnx_reader_get(bnxReader* r, uint32_t id) {
+  size_t lo = 0, hi = r->n, mid;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(r->entries[mid].id < id) lo = mid + 1;
+    else hi = mid;
+  }
+  if(lo == r->n || r->entries[lo].id != id) return NULL;
+  if(r->whole) return &r->c.molecules[r->entries[lo].off];
+
+  if(r->c.n_maps == 1 && r->c.molecules[0].id == id) return &r->c.molecules[0];
+  if(r->c.n_maps == 1) free(r->c.molecules[0].labels);
+  r->c.n_maps = 0;
+  if(bgzf_useek(r->fp, r->entries[lo].off, SEEK_SET) != 0 || read_bnx_molecule(r->fp, &r->c, 0) != 0) return NULL;
+  r->c.n_maps = 1;
+  return &r->c.molecules[0];
+}
+
+void bnx_reader_close(bnxReader* r) {
+  uint32_t i;
+  for(i = 0; i < r->c.n_maps; i++) free(r->c.molecules[i].labels);
+  free(r->c.molecules);
+  for(i = 0; i < r->c.n_rec_seqs; i++) free(r->c.rec_seqs[i]);
+  free(r->c.rec_seqs);
+  free(r->entries);
+  if(r->fp) bgzf_close(r->fp);
+  free(r);
+}
@@ -28,8 +28,29 @@
 #define __BNX_H__
 
 cmap read_bnx(const char *filename);
-int write_bnx(cmap *c, FILE* fp);
-int read_bnx_molecule(FILE *fp, cmap *c);
-int read_bnx_header(FILE *fp, cmap *c);
+cmap read_bnx_range(const char *filename, int start_mol, int end_mol);
+int index_bnx(const char* fn);
+int write_bnx(cmap *c, BGZF* fp);
+int read_bnx_molecule(BGZF *fp, cmap *c, int idx);
+int read_bnx_header(BGZF *fp, cmap *c);
+
+typedef struct bnx_entry {
+  uint32_t id;
+  int64_t off; // uncompressed offset of the molecule's "0" line, or its index in c if the BNX is read whole
+} bnx_entry;
+
+// molecules of a BNX looked up by ID as they are needed (see bnx_reader_open())
+typedef struct bnx_reader {
+  BGZF* fp;
+  cmap c; // header, and the molecule last read - or every molecule, if whole
+  int whole;
+  size_t n;
+  bnx_entry* entries; // sorted by ID
+} bnxReader;
+
+bnxReader* bnx_reader_open(const char* fn);
+bnxReader* bnx_reader_wrap(cmap c);
+molecule* bnx_reader_get(bnxReader* r, uint32_t id);
+void bnx_reader_close(bnxReader* r);
 
 #endif /* __BNX_H__ */
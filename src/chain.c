@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "klib/ksort.h"
 #include "klib/khash.h"
@@ -8,144 +9,276 @@
 #include "hash.h"
 #include "chain.h"
 
-#define score_pos_gt(a,b) ((a).score > (b).score)
-KSORT_INIT(score_pos_cmp, score_pos, score_pos_gt)
+#define score_pos_lt(a,b) ((a).score < (b).score)
+KSORT_INIT(score_pos_cmp, score_pos, score_pos_lt)
 
-#define pos_pair_lt(a,b) ((a).tpos < (b).tpos)
-KSORT_INIT(pos_pair_cmp, posPair, pos_pair_lt)
+// inverted so that the heap root is the lowest-scoring chain
+#define chain_score_gt(a,b) ((a).score > (b).score)
+KSORT_INIT(chain_min, chain, chain_score_gt)
 
-// input anchors should be sorted by tpos increasing
-chain* do_chain(khash_t(matchHash) *hits, int max_chains, int match_score, int max_gap, int min_chain_length) {
+#define pos_pair_q_lt(a,b) ((a).qpos < (b).qpos || ((a).qpos == (b).qpos && (a).tpos < (b).tpos))
+KSORT_INIT(pos_pair_q_cmp, posPair, pos_pair_q_lt)
 
-  // assess hits for each target
-  pairVec anchors;
-  khint_t bin;
-  uint32_t target;
+/*
+ * Range-max tree over anchors ordered by query position
+ *
+ * Each leaf holds the index of an anchor currently inside the target window (or -1),
+ * internal nodes hold the index of the anchor with the highest key beneath them.
+ * Bottom-up (non-recursive) layout: leaves are at [n, 2n)
+ */
+typedef struct rmq_tree {
+  int n;
+  int* node; // anchor indices, -1 if empty
+  float* key; // per-anchor keys, indexed by anchor index
+} rmq_tree;
 
-  scoreVec scores;
-  kv_init(scores);
-  score_pos s;
+static inline int rmq_best(rmq_tree* t, int a, int b) {
+  if(a < 0) return b;
+  if(b < 0) return a;
+  return t->key[b] > t->key[a] ? b : a;
+}
+
+static void rmq_set(rmq_tree* t, int leaf, int anchor) {
+  int p = leaf + t->n;
+  t->node[p] = anchor;
+  for(p >>= 1; p >= 1; p >>= 1) {
+    t->node[p] = rmq_best(t, t->node[p<<1], t->node[(p<<1)|1]);
+  }
+}
 
-  int i, score, qdiff, tdiff, diffdiff, gap_cost, j, best_j;
-  int h = 50; // number of previous anchors to check
-  int ref_offset = 0; // offset into the scores vector of the current target - sets the backward limit for finding chained anchors
+// returns the anchor index with the maximum key among leaves [lo, hi), or -1 if all are empty
+static int rmq_query(rmq_tree* t, int lo, int hi) {
+  int best = -1;
+  for(lo += t->n, hi += t->n; lo < hi; lo >>= 1, hi >>= 1) {
+    if(lo & 1) best = rmq_best(t, best, t->node[lo++]);
+    if(hi & 1) best = rmq_best(t, best, t->node[--hi]);
+  }
+  return best;
+}
+
+// first index in the qpos-ordered anchors with qpos >= q
+static int q_lower_bound(posPair* qsorted, int n, int q) {
+  int lo = 0, hi = n, mid;
+  while(lo < hi) {
+    mid = (lo + hi) >> 1;
+    if((int)qsorted[mid].qpos < q) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-  // iterate through hits for each target, and append them to the same scores vector
-  for (bin = kh_begin(hits); bin != kh_end(hits); ++bin) {
-    if (!kh_exist(hits, bin)) continue;
-    target = kh_key(hits, bin);
-    anchors = kh_val(hits, bin);
-    //fprintf(stderr, "Ref %u has %u anchors\n", target, kv_size(anchors));
+// working space for chaining, reused (and grown as needed) across targets
+typedef struct chain_ws {
+  int cap;
+  posPair* qsorted; // (qpos, anchor index) ordered by qpos
+  int* leaf; // leaf (rank in qsorted) of each tpos-ordered anchor
+  rmq_tree tree;
+  scoreVec scores; // DP scores of the current target, in anchor order
+  scoreVec heap; // max-heap of the current target's scores, for extracting chains in score order
+} chain_ws;
 
-    //sort anchor pairs by target pos increasing
-    ks_mergesort(pos_pair_cmp, kv_size(anchors), anchors.a, 0);
+/*
+ * Sparse dynamic programming chaining
+ *
+ * Anchors are swept in target order, and an anchor may chain from any predecessor that is
+ * strictly smaller in both query and target and within max_gap labels in both. Predecessors
+ * within the target window are kept in a range-max tree keyed by query position, so the
+ * best predecessor is found exactly in O(log n) rather than by a fixed lookback.
+ *
+ * Scoring: each anchor adds match_score, and every label skipped between consecutive anchors
+ * (on either the query or the target) costs gap_cost:
+ *   f(i) = match_score + max(0, max_j f(j) - gap_cost * ((qdiff - 1) + (tdiff - 1)))
+ * which is separable, so the tree stores f(j) + gap_cost * (qpos(j) + tpos(j)) as the key
+ *
+ * anchors must be sorted by tpos increasing (packed anchor keys of one target are, see hash.h)
+ */
+static void score_anchors(uint64_t* anchors, int n, uint32_t target, int match_score, float gap_cost, int max_gap, chain_ws* ws) {
+  int i, j, best_j, lo, hi, win;
+  score_pos s;
+  rmq_tree* tree = &ws->tree;
 
-    s.score = match_score;
-    s.anchor_idx = 0;
-    s.score_idx = ref_offset;
-    s.prev = -1;
-    s.used = 0;
-    s.ref = target;
-    kv_push(score_pos, scores, s); // this actually copies the score_pos struct values, so we can reuse 's'
+  if(n > ws->cap) {
+    ws->cap = n;
+    ws->qsorted = realloc(ws->qsorted, n * sizeof(posPair));
+    ws->leaf = realloc(ws->leaf, n * sizeof(int));
+    tree->node = realloc(tree->node, 2 * n * sizeof(int));
+    tree->key = realloc(tree->key, n * sizeof(float));
+  }
 
-    int st = 0;
+  // rank anchors by query position - qsorted reuses the tpos field to hold each anchor's index in target order,
+  // which is monotonic in tpos, so ties on qpos are still ordered by target
+  for(i = 0; i < n; i++) {
+    ws->qsorted[i].qpos = anchor_qpos(anchors[i]);
+    ws->qsorted[i].tpos = i;
+  }
+  ks_mergesort(pos_pair_q_cmp, n, ws->qsorted, 0);
+  for(i = 0; i < n; i++) {
+    ws->leaf[ws->qsorted[i].tpos] = i;
+  }
+  tree->n = n;
+  for(i = 0; i < 2 * n; i++) tree->node[i] = -1;
 
-    for(i = 1; i < kv_size(anchors); i++) {
+  ws->scores.n = 0;
+  s.ref = target;
+  s.used = 0;
+  win = 0; // first anchor (in tpos order) still inside the target window
+  for(i = 0; i < n; i = j) {
+    // evict anchors that have fallen more than max_gap behind in the target
+    while(win < i && (int)anchor_tpos(anchors[win]) < (int)anchor_tpos(anchors[i]) - max_gap) {
+      rmq_set(tree, ws->leaf[win], -1);
+      win++;
+    }
 
-      //s.score = match_score;
-      s.score = 1;
-      s.anchor_idx = i;
-      s.score_idx = i + ref_offset;
+    // score every anchor at this tpos before any of them enter the tree, so anchors sharing a target position never chain with each other
+    for(j = i; j < n && anchor_tpos(anchors[j]) == anchor_tpos(anchors[i]); j++) {
+      s.score = match_score;
+      s.anchor_idx = j;
+      s.score_idx = j;
       s.prev = -1; // no predecessor
 
-      /*
-      while(st < i && kv_A(anchors, i).tpos - kv_A(anchors, st).tpos > 100000) st++;
-      s.score = i - st;
-      */
-
-      for(j = i < h ? 0 : i-h; j < i; j++) {
-        qdiff = (int)kv_A(anchors, i).qpos - (int)kv_A(anchors, j).qpos;
-        tdiff = (int)kv_A(anchors, i).tpos - (int)kv_A(anchors, j).tpos;
-        if(tdiff <= 0 || qdiff <= 0 || qdiff > max_gap || tdiff > max_gap) { // we often have multiple hits to the same target pos, so we can't let them chain with either other
-          continue;
-        }
-        /*
-        diffdiff = (qdiff > tdiff ? qdiff - tdiff : tdiff - qdiff);
-        gap_cost = (diffdiff == 0 ? 0 : 0.01 * match_score * diffdiff + 0.5 * log2(diffdiff)); // affine gap penalty a la minimap2
-        qdiff = (qdiff > tdiff ? tdiff : qdiff); // now not qdiff but the minimum difference
-        score = kv_A(scores, j + ref_offset).score + (qdiff > match_score ? match_score : qdiff) - gap_cost;
-        */
-        score = kv_A(scores, j + ref_offset).score + 1; // scores are now just the # of properly ordered anchors
+      lo = q_lower_bound(ws->qsorted, n, (int)anchor_qpos(anchors[j]) - max_gap);
+      hi = q_lower_bound(ws->qsorted, n, anchor_qpos(anchors[j]));
+      best_j = rmq_query(tree, lo, hi);
+      if(best_j >= 0) {
+        float score = tree->key[best_j] - gap_cost * ((int)anchor_qpos(anchors[j]) + (int)anchor_tpos(anchors[j]) - 2) + match_score;
         if(score > s.score) {
           s.score = score;
-          s.prev = j + ref_offset;
+          s.prev = best_j;
         }
       }
-
-      kv_push(score_pos, scores, s);
+      tree->key[j] = s.score + gap_cost * (anchor_qpos(anchors[j]) + anchor_tpos(anchors[j]));
+      kv_push(score_pos, ws->scores, s); // this actually copies the score_pos struct values, so we can reuse 's'
+    }
+    for(best_j = i; best_j < j; best_j++) {
+      rmq_set(tree, ws->leaf[best_j], best_j);
     }
-    ref_offset = kv_size(scores);
   }
+}
 
-  //fprintf(stderr, "%u scores\n", kv_size(scores));
-
-  min_chain_length = 1; // TODO: -- undo me unless we keep using the raw counts --
-
-  // copy unsorted scores:
-  score_pos* anchor_scores = malloc(sizeof(score_pos) * kv_size(scores));
-  memcpy(anchor_scores, scores.a, sizeof(score_pos) * kv_size(scores));
-  //sort scores decreasing
-  ks_mergesort(score_pos_cmp, kv_size(scores), scores.a, 0);
-
-  // build non-overlapping chains from highest to lowest score
-  chain* chains = malloc(sizeof(chain) * max_chains);
-  int c; // chain index
-  i = 0; // scores index
-  for(c = 0; c < max_chains && i < kv_size(scores); c++) {
-    //fprintf(stderr, "building chain %d\n", c);
-    int chain_len = 0;
-    int chain_pos = kv_A(scores, i).score_idx; // get the pos which should be index into the anchor_scores array
-    //fprintf(stderr, "chain pos: %d (of %u)\n", chain_pos, kv_size(scores));
-    // get anchors associated with this score/ref
-    bin = kh_get(matchHash, hits, kv_A(scores, i).ref);
-    if(bin == kh_end(hits)) { // key not found, *shouldn't* happen
-      fprintf(stderr, "something went very wrong with the chain computation!");
-      return (chain*)NULL;
-    }
-    anchors = kh_val(hits, bin);
-    //fprintf(stderr, "pos %d used: %u\n", chain_pos, anchor_scores[chain_pos].used);
+/*
+ * Pushes chain c onto the bounded min-heap of the best chains for this query
+ * returns 1 if it was kept
+ */
+static int keep_chain(chain* top, int* n_top, int max_chains, chain c) {
+  if(*n_top < max_chains) {
+    top[(*n_top)++] = c;
+    if(*n_top == max_chains) ks_heapmake(chain_min, *n_top, top);
+    return 1;
+  }
+  if(c.score <= top[0].score) return 0;
+  top[0] = c;
+  ks_heapadjust(chain_min, 0, *n_top, top);
+  return 1;
+}
+
+/*
+ * Pulls non-overlapping chains for one target from highest to lowest score
+ *
+ * Chain ends are popped lazily from a heap, so only as many scores are visited as it takes to
+ * fill max_ref_chains, or until scores fall below min_score or can no longer enter the query's top chains
+ */
+static void extract_chains(uint64_t* anchors, uint32_t target, int max_chains, int max_ref_chains, int min_chain_length, float min_score, chain_ws* ws, chain* top, int* n_top) {
+  score_pos* anchor_scores = ws->scores.a;
+  int n = kv_size(ws->scores);
+  int n_ref_chains = 0;
+  int chain_pos, chain_len;
+  chain c;
+
+  kv_copy(score_pos, ws->heap, ws->scores);
+  ks_heapmake(score_pos_cmp, n, ws->heap.a);
+
+  while(n > 0 && n_ref_chains < max_ref_chains) {
+    score_pos best = ws->heap.a[0];
+    if(best.score < min_score) break;
+    if(*n_top == max_chains && best.score <= top[0].score) break; // nothing left on this target can displace a kept chain
+    // pop the best remaining score off the heap
+    ws->heap.a[0] = ws->heap.a[--n];
+    ks_heapadjust(score_pos_cmp, 0, n, ws->heap.a);
+
+    chain_len = 0;
+    chain_pos = best.score_idx;
     while(anchor_scores[chain_pos].used == 0) {
-      //fprintf(stderr, "backtracking from %d (%d:%d) to %d\n", chain_pos, kv_A(anchors, anchor_scores[chain_pos].anchor_idx).qpos, kv_A(anchors, anchor_scores[chain_pos].anchor_idx).tpos, anchor_scores[chain_pos].prev);
       chain_len++;
       if(anchor_scores[chain_pos].prev == -1)
         break;
       chain_pos = anchor_scores[chain_pos].prev;
     }
-    if(chain_len < min_chain_length) {
-      c--;
-      i++;
-      continue;
-    }
-    kv_init(chains[c].anchors);
-    chains[c].ref = kv_A(scores, i).ref;
-    chains[c].score = kv_A(scores, i).score;
-    //fprintf(stderr, "chain %d (score %d, %d anchors) is from ref %u anchor %d\n", c, kv_A(scores, i).score, chain_len, chains[c].ref, kv_A(scores, i).anchor_idx);
-    kv_resize(posPair, chains[c].anchors, chain_len);
-    chains[c].anchors.n = chain_len; // set the size explicitly, then we'll set the values explicitly
-    //fprintf(stderr, "creating chain %d of length %d\n", c, kv_size(chains[c].anchors));
-    chain_pos = kv_A(scores, i).score_idx;
-    for(j = 0; j < chain_len; j++) {
+    if(chain_len == 0 || chain_len < min_chain_length) continue; // an empty chain would end the caller's list
+
+    c.ref = target;
+    c.score = best.score;
+    c.n_anchors = chain_len;
+    c.last = anchors[best.anchor_idx];
+    // mark the chain's anchors so they can't be reused, and find its first anchor
+    chain_pos = best.score_idx;
+    for(; chain_len > 0; chain_len--) {
       anchor_scores[chain_pos].used = 1;
-      kv_A(chains[c].anchors, chain_len-1-j) = kv_A(anchors, anchor_scores[chain_pos].anchor_idx);
+      c.first = anchors[anchor_scores[chain_pos].anchor_idx];
       chain_pos = anchor_scores[chain_pos].prev;
     }
-    i++;
+    if(keep_chain(top, n_top, max_chains, c))
+      n_ref_chains++;
   }
-  //fprintf(stderr, "made %d chains\n", c);
-  if(c < max_chains) kv_init(chains[c].anchors); // an empty vector will indicate the end of the chains array if there are fewer than max_chains results
+}
+
+/*
+ * Chains the hits of each target and adds their chains to the max_chains best non-overlapping chains of this
+ * query kept in top (n_top so far, a min-heap once there are max_chains), at most max_ref_chains of them from
+ * any one target
+ *
+ * hits are packed anchor keys as produced by lookup(): grouped by target and sorted by position, and chain
+ * refs are their targets plus ref_offset. Calls on the hits of consecutive runs of targets (index shards),
+ * in order, keep exactly the chains one call on all of them would. Chains scoring below
+ * min_chain_length * match_score (the score of that many gapless anchors) are never extracted.
+ */
+void add_chains(uint64_t* hits, size_t n_hits, uint32_t ref_offset, int max_chains, int max_ref_chains, int match_score, float gap_cost, int max_gap, int min_chain_length, chain* top, int* n_top) {
+  size_t st, en;
+  uint32_t target;
+  float min_score = (float)min_chain_length * match_score;
+
+  chain_ws ws;
+  ws.cap = 0;
+  ws.qsorted = NULL;
+  ws.leaf = NULL;
+  ws.tree.node = NULL;
+  ws.tree.key = NULL;
+  kv_init(ws.scores);
+  kv_init(ws.heap);
+
+  for(st = 0; st < n_hits; st = en) {
+    target = anchor_target(hits[st]);
+    for(en = st + 1; en < n_hits && anchor_target(hits[en]) == target; en++);
 
-  free(anchor_scores);
-  kv_destroy(scores);
-  return chains;
+    score_anchors(hits + st, en - st, target, match_score, gap_cost, max_gap, &ws);
+    extract_chains(hits + st, ref_offset + target, max_chains, max_ref_chains, min_chain_length, min_score, &ws, top, n_top);
+  }
+
+  free(ws.qsorted);
+  free(ws.leaf);
+  free(ws.tree.node);
+  free(ws.tree.key);
+  kv_destroy(ws.scores);
+  kv_destroy(ws.heap);
 }
 
+// sorts the n_top chains kept by add_chains() by score decreasing, and terminates them with a chain with n_anchors == 0 (top holds max_chains + 1)
+void sort_chains(chain* top, int n_top, int max_chains) {
+  // heapsort on the min-heap
+  if(n_top < max_chains) ks_heapmake(chain_min, n_top, top);
+  if(n_top > 1) ks_heapsort(chain_min, n_top, top);
+  top[n_top].n_anchors = 0; // an empty chain indicates the end of the chains array
+}
+
+/*
+ * Chains the hits of each target and keeps the max_chains best non-overlapping chains for this query,
+ * at most max_ref_chains of them from any one target (see add_chains())
+ *
+ * returns an array of max_chains + 1 chains, sorted by score decreasing and terminated by a chain with n_anchors == 0
+ */
+chain* do_chain(uint64_t* hits, size_t n_hits, int max_chains, int max_ref_chains, int match_score, float gap_cost, int max_gap, int min_chain_length) {
+  int n_top = 0;
+  chain* top = malloc(sizeof(chain) * (max_chains + 1));
+  add_chains(hits, n_hits, 0, max_chains, max_ref_chains, match_score, gap_cost, max_gap, min_chain_length, top, &n_top);
+  sort_chains(top, n_top, max_chains);
+  return top;
+}
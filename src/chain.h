@@ -29,7 +29,7 @@
 #define __CHAIN_H__
 
 typedef struct score_pos {
-  int score;
+  float score;
   int anchor_idx;
   int score_idx;
   uint32_t ref;
@@ -40,11 +40,15 @@ typedef struct score_pos {
 typedef kvec_t(score_pos) scoreVec;
 
 typedef struct chain {
-  int score;
-  pairVec anchors;
+  float score;
   uint32_t ref;
+  int n_anchors;
+  uint64_t first; // first chained anchor (packed)
+  uint64_t last; // last chained anchor (packed)
 } chain;
 
-chain* do_chain(khash_t(matchHash) *hits, int max_chains, int match_score, int max_gap, int min_chain_length);
+void add_chains(uint64_t* hits, size_t n_hits, uint32_t ref_offset, int max_chains, int max_ref_chains, int match_score, float gap_cost, int max_gap, int min_chain_length, chain* top, int* n_top);
+void sort_chains(chain* top, int n_top, int max_chains);
+chain* do_chain(uint64_t* hits, size_t n_hits, int max_chains, int max_ref_chains, int match_score, float gap_cost, int max_gap, int min_chain_length);
 
 #endif /* __CHAIN_H__ */
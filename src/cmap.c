@@ -28,6 +28,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "klib/khash.h"
 #include "cmap.h"
 
 /*
@@ -64,89 +70,347 @@ char* get_val(char* buf) {
   return val;
 }
 
-int read_cmap_header(FILE *fp, cmap *c) {
-	char buf[1024];
-	int i, ch;
-	char *val;
-	while ((ch = getc(fp)) != EOF) {
-		if (ch != '#') {
-			ungetc(ch, fp);
-			break;
-		}
-		if(fgets(buf, sizeof(buf), fp) == NULL) break; // returns a NULL pointer if there was nothing to read
-    //fprintf(stderr, "%s\n", buf);
-		if(string_begins_with(buf, " CMAP File Version:")) {
-      assert(strcmp(get_val(buf), "0.1") == 0); // must be version 0.1
-    }
-		if(string_begins_with(buf, " Label Channels:")) {
-      c->n_rec_seqs = atoi(get_val(buf));
-      c->rec_seqs = malloc(c->n_rec_seqs * sizeof(char*));
-		}
-		if(string_begins_with(buf, " Nickase Recognition Site 1:")) {
-      c->rec_seqs[0] = strdup(get_val(buf));
-		}
-		if(string_begins_with(buf, " Nickase Recognition Site 2:")) { // only supports up to 2 recog site right now
-      c->rec_seqs[1] = strdup(get_val(buf));
-		}
-		if(string_begins_with(buf, " Number of Consensus Nanomaps:")) {
-      c->n_maps = atoi(get_val(buf));
-      c->molecules = malloc(c->n_maps * sizeof(molecule));
-      for(i = 0; i < c->n_maps; i++) {
-        c->molecules[i].length = 0;
-      }
+// (re)sizes the recognition sequence list to n channels, new entries are NULL
+void set_channels(cmap *c, uint32_t n) {
+  uint32_t i;
+  c->rec_seqs = realloc(c->rec_seqs, n * sizeof(char*));
+  for(i = c->n_rec_seqs; i < n; i++) {
+    c->rec_seqs[i] = NULL;
+  }
+  c->n_rec_seqs = n;
+}
+
+// parses a "# Nickase Recognition Site <channel>:" header line (any number of channels)
+int read_rec_site(char* buf, cmap *c) {
+  int ch = atoi(buf + strlen(" Nickase Recognition Site "));
+  if(ch < 1 || ch > MAX_CHANNELS) {
+    fprintf(stderr, "Invalid label channel in header: %s\n", buf);
+    return 1;
+  }
+  if(ch > c->n_rec_seqs) set_channels(c, ch);
+  c->rec_seqs[ch-1] = strdup(get_val(buf));
+  return 0;
+}
+
+// worker threads used to (de)compress BGZF map files
+static int io_threads = 1;
+
+void set_io_threads(int n) {
+  io_threads = n;
+}
+
+/*
+ * Opens a BNX/CMAP file for reading ("r") or writing ("w" for BGZF-compressed, "wu" for plain text), "-" is stdin/stdout
+ *
+ * Reading takes plain, gzip and BGZF files alike; BGZF is decompressed on io_threads threads and is
+ * seekable by uncompressed offset if its block index (<fn>.gzi, see index_bgzf()) exists
+ */
+BGZF* open_map_file(const char* fn, const char* mode) {
+  int std = strcmp(fn, "-") == 0;
+  BGZF* fp = std ? bgzf_dopen(mode[0] == 'r' ? fileno(stdin) : fileno(stdout), mode) : bgzf_open(fn, mode);
+  if(!fp) {
+    return NULL;
+  }
+  if(io_threads > 1) {
+    bgzf_mt(fp, io_threads, 256);
+  }
+  if(mode[0] == 'r' && !std && bgzf_compression(fp) == 2) { // 2 is BGZF (0 is plain, 1 is gzip)
+    char* gzi = malloc(strlen(fn) + 5);
+    sprintf(gzi, "%s.gzi", fn);
+    if(access(gzi, R_OK) == 0 && bgzf_index_load(fp, fn, ".gzi") != 0) {
+      fprintf(stderr, "Failed to load BGZF index '%s'\n", gzi);
     }
-		//next_line(fp, buf, sizeof(buf));
-	}
-	return 0;
+    free(gzi);
+  }
+  return fp;
 }
 
-static int read_cmap_line(FILE *fp, cmap *c) {
-  char** parts;
-	char buf[1024];
-  int i;
-  const char* delim = "\t";
-  if(fgets(buf, sizeof(buf), fp) == NULL) {
+// writes out buffered text once there is at least min_len of it (0 writes everything)
+int flush_text(BGZF* fp, kstring_t* s, size_t min_len) {
+  if(s->l == 0 || s->l < min_len) return 0;
+  if(bgzf_write(fp, s->s, s->l) != s->l) {
+    fprintf(stderr, "Failed to write output\n");
     return 1;
   }
+  s->l = 0;
+  return 0;
+}
 
-  char* ln = strndup(buf, sizeof(buf));
-  parts = malloc(sizeof(char*) * 9); // always exactly 9 fields in a line (for version 0.1)
-  i = 0;
-  char* token;
-  token = strtok(ln, delim);
-  while(token != NULL) {
-    parts[i++] = token;
-    token = strtok(NULL, delim);
+/*
+ * Creates an empty file next to path, to be written and then moved into place by commit_temp(), so
+ * concurrent readers (and runs) never see a partial file
+ *
+ * returns its name (to be passed to commit_temp()), or NULL if it cannot be created
+ */
+char* create_temp(const char* path) {
+  char* tmp = malloc(strlen(path) + 24);
+  sprintf(tmp, "%s.tmp%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0) {
+    free(tmp);
+    return NULL;
   }
-  int nfields = i;
-  assert(nfields == 9);
+  close(fd);
+  return tmp;
+}
 
-  int mapid = atoi(parts[0]) - 1;
+/*
+ * Renames tmp (from create_temp()) to path if ret is 0 - writing it succeeded - and otherwise removes it; frees tmp
+ *
+ * returns 0 if path is in place, else 1
+ */
+int commit_temp(char* tmp, const char* path, int ret) {
+  if(ret == 0) ret = rename(tmp, path) != 0;
+  if(ret != 0) unlink(tmp);
+  free(tmp);
+  return ret;
+}
+
+/*
+ * Writes the block index built while reading fp to <fn>.gzi, through a temporary file (see create_temp())
+ *
+ * returns 0 if successful, else 1
+ */
+int dump_bgzf_index(BGZF* fp, const char* fn) {
+  char* gzi = malloc(strlen(fn) + 5);
+  sprintf(gzi, "%s.gzi", fn);
+  char* tmp = create_temp(gzi);
+  // bgzf_index_dump() writes <fn><suffix>, so the suffix is what the temporary name adds to fn
+  int ret = tmp == NULL || commit_temp(tmp, gzi, bgzf_index_dump(fp, fn, tmp + strlen(fn)) != 0);
+  free(gzi);
+  return ret;
+}
 
-  // if this is the first observed label for this ref/map, initialize it
-  if(c->molecules[mapid].length == 0) {
-    c->molecules[mapid].id = mapid+1;
-    c->molecules[mapid].length = (size_t)atof(parts[1]);
-    c->molecules[mapid].n_labels = (size_t)atoi(parts[2]) + 1; // actual count is always 1 higher... maybe doesn't count end marker
-    c->molecules[mapid].labels = malloc(c->molecules[mapid].n_labels * sizeof(label));
+// builds the block index (<fn>.gzi) of a BGZF file, which lets readers seek to any uncompressed offset
+int index_bgzf(const char* fn) {
+  BGZF* fp = bgzf_open(fn, "r");
+  if(!fp) {
+    fprintf(stderr, "File '%s' not found\n", fn);
+    return 1;
+  }
+  if(bgzf_compression(fp) != 2) {
+    fprintf(stderr, "File '%s' is not BGZF-compressed, no block index needed\n", fn);
+    bgzf_close(fp);
+    return 0;
   }
-  int site_id = atoi(parts[3]) - 1;
-  //printf("map %d, channel %d (%d labels), label %d\n", mapid, channel, c->map_lengths[mapid][channel], site_id);
-  assert(site_id < c->molecules[mapid].n_labels);
-  c->molecules[mapid].labels[site_id].position = (uint32_t)atof(parts[5]);
-  c->molecules[mapid].labels[site_id].stdev = (float)atof(parts[6]);
-  c->molecules[mapid].labels[site_id].coverage = (uint16_t)atoi(parts[7]);
-  c->molecules[mapid].labels[site_id].channel = (uint8_t)atoi(parts[4]); // nickase channels start numbering at 1, 0 indicates end of the map/chromosome
-  c->molecules[mapid].labels[site_id].occurrence = (uint16_t)atoi(parts[8]);
+  char buf[65536];
+  ssize_t n;
+  if(bgzf_index_build_init(fp) != 0) {
+    fprintf(stderr, "Failed to index '%s'\n", fn);
+    bgzf_close(fp);
+    return 1;
+  }
+  while((n = bgzf_read(fp, buf, sizeof(buf))) > 0); // the index is built as blocks are read
+  if(n < 0 || dump_bgzf_index(fp, fn) != 0) {
+    fprintf(stderr, "Failed to index '%s'\n", fn);
+    bgzf_close(fp);
+    return 1;
+  }
+  return bgzf_close(fp);
+}
+
+// parses one '#' header line (without the '#')
+static int read_cmap_header_line(char* buf, cmap *c) {
+  if(string_begins_with(buf, " CMAP File Version:")) {
+    assert(strcmp(get_val(buf), "0.1") == 0); // must be version 0.1
+  }
+  if(string_begins_with(buf, " Label Channels:")) {
+    set_channels(c, atoi(get_val(buf)));
+  }
+  if(string_begins_with(buf, " Nickase Recognition Site ")) {
+    return read_rec_site(buf, c);
+  }
+  // the map count (# Number of Consensus Nanomaps) is not needed - maps are keyed by their ID as they are read
+  return 0;
+}
+
+// a run of consecutive lines of one map within a chunk
+typedef struct map_run {
+  uint32_t id;
+  size_t length;
+  size_t n_sites;
+  const char* start; // first line
+  const char* end; // past the last line
+  uint32_t map; // index in cmap.molecules, once every chunk is scanned
+} map_run;
+
+typedef kvec_t(map_run) runVec;
+
+// a part of the file, split at line boundaries, parsed by one thread
+typedef struct cmap_chunk {
+  const char* start;
+  const char* end;
+  runVec runs;
+  molecule* molecules;
+  int err;
+} cmap_chunk;
 
-  free(ln);
-  free(parts);
+KHASH_MAP_INIT_INT(cmapIdx, uint32_t);
 
-	//next_line(fp, buf, sizeof(buf));
-	return 0;
+/*
+ * Parses a number (integer or decimal, as in all CMAP columns) ending at a tab or the end of the line,
+ * advancing *p past it and its tab - the input is not NUL-terminated, so it never reads past end
+ */
+static inline int next_num(const char** p, const char* end, double* v) {
+  const char* s = *p;
+  double x = 0, scale = 1;
+  int neg = 0, digits = 0;
+  if(s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+  for(; s < end && *s >= '0' && *s <= '9'; s++, digits++) x = x * 10 + (*s - '0');
+  if(s < end && *s == '.') {
+    for(s++; s < end && *s >= '0' && *s <= '9'; s++, digits++) x += (*s - '0') * (scale *= 0.1);
+  }
+  if(s < end && (*s == 'e' || *s == 'E')) {
+    // rare, so worth the copy to parse it in full
+    char buf[64];
+    const char* t = *p;
+    size_t n = 0;
+    while(t < end && *t != '\t' && *t != '\n' && *t != '\r' && n < sizeof(buf) - 1) buf[n++] = *t++;
+    buf[n] = '\0';
+    x = strtod(buf, NULL);
+    s = t;
+    neg = 0;
+  }
+  if(digits == 0) return 1;
+  *v = neg ? -x : x;
+  while(s < end && (*s == '\t' || *s == ' ')) s++;
+  *p = s;
+  return 0;
+}
+
+// the end of the line starting at p (the newline, or end)
+static inline const char* line_end(const char* p, const char* end) {
+  const char* nl = memchr(p, '\n', end - p);
+  return nl ? nl : end;
+}
+
+static inline int blank_line(const char* p, const char* e) {
+  return p == e || (p + 1 == e && *p == '\r') || *p == '#';
+}
+
+// first pass: the map of each line (CMapId, ContigLength and NumSites), as runs of consecutive lines
+static void scan_chunk(cmap_chunk* ch) {
+  const char* p = ch->start;
+  const char* e;
+  double v[3];
+  map_run* run = NULL;
+  int i;
+  for(; p < ch->end; p = e + 1) {
+    e = line_end(p, ch->end);
+    if(blank_line(p, e)) continue;
+    const char* f = p;
+    for(i = 0; i < 3; i++) {
+      if(next_num(&f, e, &v[i]) != 0) break;
+    }
+    if(i < 3 || v[0] < 0 || v[2] < 0) {
+      fprintf(stderr, "Malformed CMAP line: %.*s\n", (int)(e - p), p);
+      ch->err = 1;
+      return;
+    }
+    if(run == NULL || run->id != (uint32_t)v[0]) {
+      map_run r = {(uint32_t)v[0], (size_t)v[1], (size_t)v[2], p, e, 0};
+      kv_push(map_run, ch->runs, r);
+      run = &kv_A(ch->runs, kv_size(ch->runs) - 1);
+    }
+    run->end = e;
+  }
+}
+
+// second pass: each line's label, into the slot of its SiteID in its map (so runs never overlap)
+static void parse_chunk(cmap_chunk* ch) {
+  size_t r;
+  double v[9];
+  int i;
+  for(r = 0; r < kv_size(ch->runs); r++) {
+    map_run* run = &kv_A(ch->runs, r);
+    molecule* m = &ch->molecules[run->map];
+    const char* p = run->start;
+    const char* e;
+    for(; p < run->end; p = e + 1) {
+      e = line_end(p, run->end);
+      if(blank_line(p, e)) continue;
+      const char* f = p;
+      for(i = 0; i < 9; i++) {
+        if(next_num(&f, e, &v[i]) != 0) break;
+      }
+      if(f < e && *f == '\r') f++;
+      size_t site_id = (size_t)v[3]; // 1-based
+      if(i < 9 || f != e || (uint32_t)v[0] != run->id || v[3] < 1 || site_id > m->n_labels) {
+        fprintf(stderr, "Malformed CMAP line (or SiteID beyond NumSites+1): %.*s\n", (int)(e - p), p);
+        ch->err = 1;
+        return;
+      }
+      label* l = &m->labels[site_id - 1];
+      l->position = (uint32_t)v[5];
+      l->stdev = (float)v[6];
+      l->coverage = (uint16_t)v[7];
+      l->channel = (uint8_t)v[4]; // nickase channels start numbering at 1, 0 indicates end of the map/chromosome
+      l->occurrence = (uint16_t)v[8];
+    }
+  }
+}
+
+static void* scan_worker(void* arg) {
+  scan_chunk((cmap_chunk*)arg);
+  return NULL;
+}
+
+static void* parse_worker(void* arg) {
+  parse_chunk((cmap_chunk*)arg);
+  return NULL;
+}
+
+static void run_chunks(void* (*fn)(void*), cmap_chunk* chunks, int n) {
+  pthread_t* th = malloc(n * sizeof(pthread_t));
+  int i;
+  for(i = 1; i < n; i++) pthread_create(&th[i], NULL, fn, &chunks[i]);
+  fn(&chunks[0]);
+  for(i = 1; i < n; i++) pthread_join(th[i], NULL);
+  free(th);
+}
+
+/*
+ * The whole (decompressed) text of a map file: plain files are memory-mapped (*mapped is set), anything
+ * else - gzip, BGZF, stdin - is read into memory
+ */
+static char* load_map_text(const char* fn, size_t* len, int* mapped) {
+  BGZF* fp = open_map_file(fn, "r");
+  if(!fp) return NULL;
+  *mapped = 0;
+  if(strcmp(fn, "-") != 0 && bgzf_compression(fp) == 0) {
+    struct stat st;
+    int fd = open(fn, O_RDONLY);
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+      char* buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(buf != MAP_FAILED) {
+        madvise(buf, st.st_size, MADV_WILLNEED);
+        bgzf_close(fp);
+        *len = st.st_size;
+        *mapped = 1;
+        return buf;
+      }
+    } else if(fd >= 0) {
+      close(fd);
+    }
+  }
+  size_t cap = 1 << 20;
+  ssize_t n;
+  char* buf = malloc(cap);
+  *len = 0;
+  while((n = bgzf_read(fp, buf + *len, cap - *len)) > 0) {
+    *len += n;
+    if(*len == cap) buf = realloc(buf, cap *= 2);
+  }
+  bgzf_close(fp);
+  if(n < 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
 }
 
-int write_cmap(cmap *c, FILE* fp) {
+int write_cmap(cmap *c, BGZF* fp) {
   //FILE* fp = fopen(fn, "w");
   if(!fp) {
     fprintf(stderr, "Failed to write cmap (invalid file pointer)\n");
@@ -154,46 +418,131 @@ int write_cmap(cmap *c, FILE* fp) {
   }
 
   size_t i, j, k;
+  kstring_t out = {0, 0, NULL}; // formatted text, written out in large chunks
 
-  fprintf(fp, "# CMAP File Version:\t0.1\n");
-  fprintf(fp, "# Label Channels:\t%d\n", c->n_rec_seqs);
+  ksprintf(&out, "# CMAP File Version:\t0.1\n");
+  ksprintf(&out, "# Label Channels:\t%d\n", c->n_rec_seqs);
   for(j = 0; j < c->n_rec_seqs; j++) {
-    fprintf(fp, "# Nickase Recognition Site %u:\t%s\n", j+1, c->rec_seqs[j]);
+    ksprintf(&out, "# Nickase Recognition Site %u:\t%s\n", j+1, c->rec_seqs[j]);
   }
-  fprintf(fp, "# Number of Consensus Nanomaps:\t%u\n", c->n_maps);
-  fprintf(fp, "#h CMapId\tContigLength\tNumSites\tSiteID\tLabelChannel\tPosition\tStdDev\tCoverage\tOccurrence\n");
-  fprintf(fp, "#f int\tfloat\tint\tint\tint\tfloat\tfloat\tint\tint\n");
+  ksprintf(&out, "# Number of Consensus Nanomaps:\t%u\n", c->n_maps);
+  ksprintf(&out, "#h CMapId\tContigLength\tNumSites\tSiteID\tLabelChannel\tPosition\tStdDev\tCoverage\tOccurrence\n");
+  ksprintf(&out, "#f int\tfloat\tint\tint\tint\tfloat\tfloat\tint\tint\n");
 
   for(i = 0; i < c->n_maps; i++) {
     for(k = 0; k < c->molecules[i].n_labels; k++) {
       // very weird - if the parameters are not cast, they can be arbitrarily reordered in the output string (presumably to optimize type-matching)
-      fprintf(fp, "%u\t%.1f\t%u\t%u\t%u\t%.1f\t%.1f\t%u\t%u\n", c->molecules[i].id, (float)c->molecules[i].length, c->molecules[i].n_labels-1, k+1, c->molecules[i].labels[k].channel, (float)c->molecules[i].labels[k].position, (float)c->molecules[i].labels[k].stdev, c->molecules[i].labels[k].coverage, c->molecules[i].labels[k].occurrence);
+      // (positions are cast to double, not float, which would round those past 2^24 - 16.8Mb)
+      ksprintf(&out, "%u\t%.1f\t%u\t%u\t%u\t%.1f\t%.1f\t%u\t%u\n", c->molecules[i].id, (double)c->molecules[i].length, c->molecules[i].n_labels-1, k+1, c->molecules[i].labels[k].channel, (double)c->molecules[i].labels[k].position, (float)c->molecules[i].labels[k].stdev, c->molecules[i].labels[k].coverage, c->molecules[i].labels[k].occurrence);
+      if(flush_text(fp, &out, 1 << 16) != 0) {
+        free(out.s);
+        return 1;
+      }
     }
   }
+  int ret = flush_text(fp, &out, 0);
+  free(out.s);
 
   //fclose(fp);
-  return 0;
+  return ret;
 }
 
+/*
+ * Reads a CMAP (plain, gzip or BGZF) in parallel on io_threads threads: the text is split into chunks at
+ * line boundaries, each chunk is scanned for its maps, the maps are allocated (keyed by CMapId, in order of
+ * appearance), then each chunk parses its labels straight into them. Nothing is allocated per line
+ */
 cmap read_cmap(const char *fn) {
   cmap c;
+  init_cmap(&c);
 
-  FILE *fp = fopen(fn, "r");
-  if(!fp) {
+  size_t len;
+  int mapped;
+  char* text = load_map_text(fn, &len, &mapped);
+  if(!text) {
     fprintf(stderr, "File '%s' not found\n", fn);
     return c;
   }
 
-	if (read_cmap_header(fp, &c) != 0) {
+  // header, up to the first data line
+  const char* p = text;
+  const char* end = text + len;
+  const char* e;
+  kstring_t line = {0, 0, NULL};
+  int ret = 0;
+  for(; p < end && *p == '#' && ret == 0; p = e < end ? e + 1 : end) {
+    e = line_end(p, end);
+    line.l = 0;
+    kputsn(p + 1, e - p - 1, &line); // skip the '#'
+    ret = read_cmap_header_line(line.s, &c);
+  }
+  free(line.s);
+  if(ret != 0) {
     fprintf(stderr, "File '%s' header could not be read\n", fn);
-		fclose(fp);
-		return c;
-	}
-	while (read_cmap_line(fp, &c) == 0) {
-    // we're just looping through all the lines
-	}
+  }
+
+  // chunks of roughly equal size, ending at line boundaries
+  int n_chunks = io_threads > 1 && end - p > (1 << 20) ? io_threads : 1;
+  cmap_chunk* chunks = calloc(n_chunks, sizeof(cmap_chunk));
+  int i;
+  for(i = 0; i < n_chunks; i++) {
+    chunks[i].start = i == 0 ? p : chunks[i-1].end;
+    chunks[i].end = i == n_chunks - 1 ? end : p + (end - p) / n_chunks * (i + 1);
+    if(chunks[i].end < chunks[i].start) chunks[i].end = chunks[i].start;
+    if(chunks[i].end < end) {
+      chunks[i].end = line_end(chunks[i].end, end);
+      if(chunks[i].end < end) chunks[i].end++; // including the newline
+    }
+    kv_init(chunks[i].runs);
+  }
+  if(ret == 0) run_chunks(scan_worker, chunks, n_chunks);
+
+  // allocate the maps in order of appearance
+  khash_t(cmapIdx)* idx = kh_init(cmapIdx);
+  size_t cap = 0, r;
+  int absent;
+  for(i = 0; i < n_chunks && ret == 0; i++) {
+    ret = chunks[i].err;
+    for(r = 0; r < kv_size(chunks[i].runs) && ret == 0; r++) {
+      map_run* run = &kv_A(chunks[i].runs, r);
+      khiter_t k = kh_put(cmapIdx, idx, run->id, &absent);
+      if(absent) {
+        if(c.n_maps == cap) {
+          cap = cap ? cap * 2 : 64;
+          c.molecules = realloc(c.molecules, cap * sizeof(molecule));
+        }
+        molecule* m = &c.molecules[c.n_maps];
+        m->id = run->id;
+        m->length = run->length;
+        m->n_labels = run->n_sites + 1; // NumSites does not count the end marker
+        m->labels = calloc(m->n_labels, sizeof(label));
+        kh_val(idx, k) = c.n_maps++;
+      } else if(c.molecules[kh_val(idx, k)].n_labels != run->n_sites + 1) {
+        fprintf(stderr, "Map %u has conflicting NumSites in '%s'\n", run->id, fn);
+        ret = 1;
+      }
+      run->map = kh_val(idx, k);
+    }
+  }
+  kh_destroy(cmapIdx, idx);
+
+  if(ret == 0) {
+    for(i = 0; i < n_chunks; i++) chunks[i].molecules = c.molecules;
+    run_chunks(parse_worker, chunks, n_chunks);
+    for(i = 0; i < n_chunks; i++) ret |= chunks[i].err;
+  }
+  for(i = 0; i < n_chunks; i++) kv_destroy(chunks[i].runs);
+  free(chunks);
+  if(mapped) munmap(text, len);
+  else free(text);
 
-	fclose(fp);
+  if(ret != 0) {
+    fprintf(stderr, "Failed to read CMAP '%s'\n", fn);
+    for(i = 0; i < (int)c.n_maps; i++) free(c.molecules[i].labels);
+    free(c.molecules);
+    c.molecules = NULL;
+    c.n_maps = 0;
+  }
 	return c;
 }
 
@@ -207,6 +556,11 @@ void init_cmap(cmap* c) {
 
 // positions should include the end pos of the chromosome
 int add_map(cmap* c, uint32_t molid, uint32_t* positions, uint32_t n_pos, uint8_t channel) {
+  return add_map_channels(c, molid, positions, NULL, n_pos, channel);
+}
+
+// as add_map(), but channels (if not NULL) gives the channel of each label, otherwise all are the given channel
+int add_map_channels(cmap* c, uint32_t molid, uint32_t* positions, uint8_t* channels, uint32_t n_pos, uint8_t channel) {
   uint32_t idx = c->n_maps;
   c->n_maps++;
   c->molecules = realloc(c->molecules, c->n_maps * sizeof(molecule));
@@ -224,7 +578,7 @@ int add_map(cmap* c, uint32_t molid, uint32_t* positions, uint32_t n_pos, uint8_
     if(i < n_pos - 1) {
       c->molecules[idx].labels[i].stdev = 1.0;
       c->molecules[idx].labels[i].coverage = 1;
-      c->molecules[idx].labels[i].channel = channel;
+      c->molecules[idx].labels[i].channel = channels ? channels[i] : channel;
       c->molecules[idx].labels[i].occurrence = 1;
     } else {
       c->molecules[idx].labels[i].stdev = 0.0;
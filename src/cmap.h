@@ -4,12 +4,14 @@
 #include <stdint.h>
 #include "klib/kvec.h"
 #include "klib/kstring.h"
+#include "htslib/bgzf.h"
 
 // various vectors to handle fragment/label data
 typedef kvec_t(uint8_t) byteVec;
 
 typedef kvec_t(uint32_t) u32Vec;
 typedef kvec_t(u32Vec*) fragVec;
+typedef kvec_t(byteVec*) chanVec;
 
 typedef kvec_t(char*) seqVec;
 typedef kvec_t(char*) cstrVec;
@@ -35,6 +37,9 @@ typedef kvec_t(ref_pos) posVec;
 
 */
 
+// label channels are numbered from 1 (0 marks the end of a map), one per recognition sequence
+#define MAX_CHANNELS 3
+
 typedef struct label {
   uint32_t position;
   float stdev;
@@ -63,9 +68,20 @@ char* get_val(char* buf);
 void next_line(FILE *fp, char *buf, size_t bufsize);
 int string_begins_with(char* s, char* pre);
 
-int write_cmap(cmap *c, FILE* fp);
+BGZF* open_map_file(const char* fn, const char* mode);
+void set_io_threads(int n);
+int flush_text(BGZF* fp, kstring_t* s, size_t min_len);
+char* create_temp(const char* path);
+int commit_temp(char* tmp, const char* path, int ret);
+int dump_bgzf_index(BGZF* fp, const char* fn);
+int index_bgzf(const char* fn);
+
+int write_cmap(cmap *c, BGZF* fp);
 cmap read_cmap(const char* fn);
 int add_map(cmap* c, uint32_t molid, uint32_t* positions, uint32_t n_pos, uint8_t channel);
+int add_map_channels(cmap* c, uint32_t molid, uint32_t* positions, uint8_t* channels, uint32_t n_pos, uint8_t channel);
+void set_channels(cmap *c, uint32_t n);
+int read_rec_site(char* buf, cmap *c);
 void init_cmap(cmap* c);
 
 size_t filter_labels(label* labels, size_t n_labels, label* filtered_labels, int resolution_min);
@@ -0,0 +1,66 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cpu.h"
+
+static const char* level_names[] = {"generic", "sse4.2", "avx2", "avx512"};
+
+static int level = CPU_GENERIC;
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+
+// cpuid, once per process; REKIT_CPU (one of level_names) caps the level, to compare or work around a variant
+static void detect_level() {
+#if CPU_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) level = CPU_AVX512;
+  else if(__builtin_cpu_supports("avx2")) level = CPU_AVX2;
+  else if(__builtin_cpu_supports("sse4.2")) level = CPU_SSE42;
+#endif
+
+  char* cap = getenv("REKIT_CPU");
+  if(cap == NULL) return;
+  int i;
+  for(i = CPU_GENERIC; i <= CPU_AVX512; i++) {
+    if(strcmp(cap, level_names[i]) == 0) break;
+  }
+  if(i > CPU_AVX512) {
+    fprintf(stderr, "Unknown REKIT_CPU '%s' (expected generic, sse4.2, avx2 or avx512), ignoring it\n", cap);
+    return;
+  }
+  if(i < level) level = i;
+}
+
+// the highest CPU_* level this CPU supports
+int cpu_level() {
+  pthread_once(&level_once, detect_level);
+  return level;
+}
+
+const char* cpu_level_name(int l) {
+  return l >= CPU_GENERIC && l <= CPU_AVX512 ? level_names[l] : "unknown";
+}
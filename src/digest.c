@@ -27,7 +27,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "klib/kvec.h"
 #include "digest.h"
 #include "cmap.h"
@@ -42,7 +46,46 @@ KSEQ_INIT(gzFile, gzread)
 
 #endif
 
-int digest(char *seq, size_t seq_len, char **motifs, size_t n_motifs, float digest_rate, float shear_rate, int nlimit, u32Vec *positions) {
+/*
+ * Motif scan prefilter
+ *
+ * A position can only match a motif (or its reverse complement) if its first, second and last bytes do, so
+ * each block of positions is first marked by comparing just those bytes of every pattern - a branch-free
+ * byte loop the compiler vectorizes (at -O3) - and only the marked positions are compared in full
+ */
+#define SCAN_BLOCK 4096
+
+typedef struct {
+  char first;
+  char second; // the first again for 1-byte motifs
+  char last;
+  int len;
+} scan_pattern;
+
+static void mark_candidates(const char* restrict seq, size_t n, const scan_pattern* pats, int n_pats, uint8_t* restrict cand) {
+  size_t j;
+  int k;
+  memset(cand, 0, n);
+  for(k = 0; k < n_pats; k++) {
+    const char first = pats[k].first, second = pats[k].second, last = pats[k].last;
+    const char* restrict next = seq + (pats[k].len > 1);
+    const char* restrict tail = seq + pats[k].len - 1;
+    for(j = 0; j < n; j++) cand[j] |= (seq[j] == first) & (next[j] == second) & (tail[j] == last);
+  }
+}
+
+// 1-based channel of the first motif matching at seq+i, either strand, or 0
+static inline int match_motifs(char *seq, size_t i, char **motifs, char **rc_motifs, int *lens, size_t n_motifs) {
+  int m;
+  for(m = 0; m < n_motifs; m++) {
+    // do a perfect digestion - ignores FP and FN
+    if (strncmp(motifs[m], seq+i, lens[m]) == 0 || strncmp(rc_motifs[m], seq+i, lens[m]) == 0) return m + 1;
+  }
+  return 0;
+}
+
+int digest(char *seq, size_t seq_len, char **motifs, size_t n_motifs, float digest_rate, float shear_rate, int nlimit, u32Vec *positions, byteVec *channels) {
+  // channels (if not NULL) receives the label channel of each position: the 1-based index of the matching motif
 
   // go through sequence
   int i, j, m;
@@ -81,20 +124,48 @@ int digest(char *seq, size_t seq_len, char **motifs, size_t n_motifs, float dige
     }
   }
 
-  for(i = 0; i < seq_len; i++) {
+  // positions below n_scan have every pattern byte inside the sequence, so they go through the prefilter
+  scan_pattern* pats = malloc(2 * n_motifs * sizeof(scan_pattern));
+  int empty = 0, max_len = 0;
+  for(m = 0; m < n_motifs; m++) {
+    pats[2*m].first = motifs[m][0];
+    pats[2*m].second = lens[m] > 1 ? motifs[m][1] : motifs[m][0];
+    pats[2*m].last = lens[m] ? motifs[m][lens[m]-1] : 0;
+    pats[2*m].len = lens[m];
+    pats[2*m+1].first = rc_motifs[m][0];
+    pats[2*m+1].second = lens[m] > 1 ? rc_motifs[m][1] : rc_motifs[m][0];
+    pats[2*m+1].last = lens[m] ? rc_motifs[m][lens[m]-1] : 0;
+    pats[2*m+1].len = lens[m];
+    if(lens[m] == 0) empty = 1;
+    if(lens[m] > max_len) max_len = lens[m];
+  }
+  size_t b, n, n_scan = !empty && max_len <= seq_len ? seq_len - max_len + 1 : 0;
+  uint8_t* cand = malloc(SCAN_BLOCK);
 
-    // see if current locus matches any motifs
-    for(m = 0; m < n_motifs; m++) {
-      // do a perfect digestion - ignores FP and FN
-      if (strncmp(motifs[m], seq+i, lens[m]) == 0 || strncmp(rc_motifs[m], seq+i, lens[m]) == 0) {
-        kv_push(uint32_t, *positions, (uint32_t)i);
-        break;
-      }
+  for(b = 0; b < n_scan; b += SCAN_BLOCK) {
+    n = n_scan - b < SCAN_BLOCK ? n_scan - b : SCAN_BLOCK;
+    mark_candidates(seq + b, n, pats, 2 * n_motifs, cand);
+    for(j = 0; j < n; j++) {
+      if(!cand[j] || !(m = match_motifs(seq, b + j, motifs, rc_motifs, lens, n_motifs))) continue;
+      kv_push(uint32_t, *positions, (uint32_t)(b + j));
+      if(channels) kv_push(uint8_t, *channels, (uint8_t)m);
     }
   }
+  // the last few positions, where a motif may run off the end
+  for(i = n_scan; i < seq_len; i++) {
+    if(!(m = match_motifs(seq, i, motifs, rc_motifs, lens, n_motifs))) continue;
+    kv_push(uint32_t, *positions, (uint32_t)i);
+    if(channels) kv_push(uint8_t, *channels, (uint8_t)m);
+  }
 
   kv_push(uint32_t, *positions, (uint32_t)i);
 
+  for(m = 0; m < n_motifs; m++) free(rc_motifs[m]);
+  free(rc_motifs);
+  free(lens);
+  free(pats);
+  free(cand);
+
   return 0;
 }
 
@@ -117,13 +188,17 @@ cmap digest_fasta(char* fasta_file, char** motifs, size_t n_motifs) {
 
   int refid = 1;
   u32Vec labels;
+  byteVec channels;
   while ((l = kseq_read(seq)) >= 0) {
     // name: seq->name.s, seq: seq->seq.s, length: l
     //fprintf(stderr, "Reading %s (%i bp).\n", seq->name.s, l);
     kv_init(labels);
-    digest(seq->seq.s, l, motifs, n_motifs, 1.0, 0.0, 1000000000, &labels); // 1.0 true digest rate, 0.0 random shear rate (perfect)
+    kv_init(channels);
+    digest(seq->seq.s, l, motifs, n_motifs, 1.0, 0.0, 1000000000, &labels, &channels); // 1.0 true digest rate, 0.0 random shear rate (perfect)
     //fprintf(stderr, "Produced %d labels\n", kv_size(labels));
-    add_map(&c, refid++, labels.a, kv_size(labels), 1); // channel 1
+    add_map_channels(&c, refid++, labels.a, channels.a, kv_size(labels), 1); // one channel per motif
+    kv_destroy(labels);
+    kv_destroy(channels);
   }
 
   gzclose(gzfp);
@@ -131,3 +206,83 @@ cmap digest_fasta(char* fasta_file, char** motifs, size_t n_motifs) {
 
   return c;
 }
+
+/*
+ * Digest cache
+ *
+ * A digest is keyed by the CRC-32 and size of the FASTA file as stored (compressed or not) and by the
+ * recognition sequences, so a changed genome or motif set is never served a stale digest, and checksumming
+ * the file is much cheaper than parsing and scanning it
+ */
+
+// CRC-32 of a whole file, and its size, 0 if successful
+static int checksum_file(const char* fn, uint32_t* crc, uint64_t* size) {
+  int fd = open(fn, O_RDONLY);
+  if(fd < 0) return 1;
+  size_t bufsize = 1 << 20;
+  uint8_t* buf = malloc(bufsize);
+  ssize_t n;
+  uLong c = crc32(0L, Z_NULL, 0);
+  *size = 0;
+  while((n = read(fd, buf, bufsize)) > 0) {
+    c = crc32(c, buf, (uInt)n);
+    *size += n;
+  }
+  free(buf);
+  close(fd);
+  *crc = (uint32_t)c;
+  return n < 0;
+}
+
+// <cache_dir>/<crc>-<size>-<motif>[,<motif>...].cmap, or NULL if the FASTA cannot be read
+static char* digest_cache_path(const char* cache_dir, char* fasta_file, char** motifs, size_t n_motifs) {
+  uint32_t crc;
+  uint64_t size;
+  if(checksum_file(fasta_file, &crc, &size) != 0) return NULL;
+
+  kstring_t path = {0, 0, NULL};
+  ksprintf(&path, "%s/%08x-%llu-", cache_dir, crc, (unsigned long long)size);
+  size_t m, i;
+  for(m = 0; m < n_motifs; m++) {
+    if(m > 0) kputc(',', &path);
+    for(i = 0; motifs[m][i]; i++) kputc(isalnum((unsigned char)motifs[m][i]) ? motifs[m][i] : '_', &path);
+  }
+  kputs(".cmap", &path);
+  return path.s;
+}
+
+/*
+ * As digest_fasta(), but reads the digest from cache_dir if it holds one of the same FASTA and motifs, and
+ * otherwise stores it there (cache_dir is created if needed; a cache that cannot be written is only a warning)
+ */
+cmap digest_fasta_cached(char* fasta_file, char** motifs, size_t n_motifs, const char* cache_dir) {
+  char* path = cache_dir != NULL ? digest_cache_path(cache_dir, fasta_file, motifs, n_motifs) : NULL;
+  cmap c;
+  if(path != NULL && access(path, R_OK) == 0) {
+    fprintf(stderr, "# Reading cached digest '%s'\n", path);
+    c = read_cmap(path);
+    if(c.n_maps > 0) {
+      free(path);
+      return c;
+    }
+  }
+
+  c = digest_fasta(fasta_file, motifs, n_motifs);
+  if(path == NULL || c.n_maps == 0) {
+    free(path);
+    return c;
+  }
+
+  // written to a temporary file and renamed into place, so concurrent runs never read a partial digest
+  mkdir(cache_dir, 0777);
+  char* tmp = create_temp(path);
+  int ret = 1;
+  if(tmp != NULL) {
+    BGZF* out = open_map_file(tmp, "wu");
+    ret = commit_temp(tmp, path, out == NULL || (write_cmap(&c, out) | bgzf_close(out)));
+  }
+  if(ret != 0) fprintf(stderr, "Failed to cache the digest as '%s'\n", path);
+  else fprintf(stderr, "# Cached digest as '%s'\n", path);
+  free(path);
+  return c;
+}
@@ -25,4 +25,5 @@
 #include "cmap.h"
 
 cmap digest_fasta(char* fasta_file, char** motifs, size_t n_motifs);
-int digest(char *seq, size_t seq_len, char **motifs, size_t n_motifs, float digest_rate, float shear_rate, int nlimit, u32Vec *sizes);
+cmap digest_fasta_cached(char* fasta_file, char** motifs, size_t n_motifs, const char* cache_dir);
+int digest(char *seq, size_t seq_len, char **motifs, size_t n_motifs, float digest_rate, float shear_rate, int nlimit, u32Vec *sizes, byteVec *channels);
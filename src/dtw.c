@@ -44,7 +44,7 @@ v |
 #include <time.h>
 #include "klib/kvec.h" // C dynamic vector
 #include "dtw.h"
-#include <immintrin.h> // x86 intrinsics (SSE/AVX vector operations)
+#include "cpu.h"
 
 #define aln_gt(a,b) ((a).score > (b).score)
 KSORT_INIT(aln_cmp, result, aln_gt)
@@ -53,8 +53,11 @@ KSORT_INIT(aln_cmp, result, aln_gt)
  * Overlap dynamic programming (time warping) alignment
  *
  * First row and column are initialized to zero, and alignment must reach either the last row or column
+ *
+ * qchan/tchan (may be NULL) are the label channels of the fragment ends - fragment i ends at label i, or
+ * label i-1 when the query is walked in reverse - and matching fragments that end in different channels is penalized
  */
-result dtw(uint32_t* query, uint32_t* target, size_t qlen, size_t tlen, int8_t ins_score, int8_t del_score, float neutral_deviation, int rev) {
+static inline __attribute__((always_inline)) result dtw_k(uint32_t* query, uint32_t* target, uint8_t* qchan, uint8_t* tchan, size_t qlen, size_t tlen, int8_t ins_score, int8_t del_score, float neutral_deviation, int rev, const int relative) {
   result res;
   res.qrev = rev;
 
@@ -95,17 +98,28 @@ result dtw(uint32_t* query, uint32_t* target, size_t qlen, size_t tlen, int8_t i
   }
 
   float match, qmatch, tmatch, qtmatch, ins, del; // qmatch and tmatch are different kinds of matches were it accounts for only the extra q_size or t_size
+  float rm, rtc; // size_score() reciprocals for the target fragment alone and with the accumulated target size
+  uint8_t qc = 0; // channel of the label ending the current query fragment (0 if unknown)
+  float* rt = malloc(tlen * sizeof(float));
+  float* rtc_row = malloc(tlen * sizeof(float));
+  for(x = 0; x < tlen; x++) rt[x] = size_recip(target[x], neutral_deviation, relative);
 
   for(y = 0; y < qlen; y++) {
     qy = rev ? qlen-1-y : y;
+    if(qchan) qc = rev ? (qy > 0 ? qchan[qy-1] : 0) : qchan[qy];
+    // reciprocals with the target size accumulated in the row above, so the cell loop below does no divisions
+    for(x = 0; x < tlen; x++) rtc_row[x] = relative && t_cum_size[y][x] ? size_recip(t_cum_size[y][x] + target[x], neutral_deviation, relative) : rt[x];
     for(x = 0; x < tlen; x++) {
       // resetting any negative values to 0 is what makes this local alignment - if you don't do that it will be at least semi-global
-      qtmatch = score_matrix[y][x] + score(q_cum_size[y][x] + query[qy], t_cum_size[y][x] + target[x], neutral_deviation) + 0.2;
-      tmatch = score_matrix[y][x] + score(query[qy], t_cum_size[y][x] + target[x], neutral_deviation) + 0.1;
-      qmatch = score_matrix[y][x] + score(q_cum_size[y][x] + query[qy], target[x], neutral_deviation) + 0.1;
-      match = score_matrix[y][x] + score(query[qy], target[x], neutral_deviation);
+      rm = rt[x];
+      rtc = rtc_row[x];
+      qtmatch = score_matrix[y][x] + size_score(q_cum_size[y][x] + query[qy], t_cum_size[y][x] + target[x], rtc) + 0.2f;
+      tmatch = score_matrix[y][x] + size_score(query[qy], t_cum_size[y][x] + target[x], rtc) + 0.1f;
+      qmatch = score_matrix[y][x] + size_score(q_cum_size[y][x] + query[qy], target[x], rm) + 0.1f;
+      match = score_matrix[y][x] + size_score(query[qy], target[x], rm);
       // basically, you get a bonus for using the leftover size from skipped fragments, but you don't have to
       match = match > qmatch && match > tmatch && match > qtmatch ? match : (qtmatch > qmatch && qtmatch > tmatch ? qtmatch : (qmatch > tmatch ? qmatch : tmatch));
+      if(qc && tchan && tchan[x] && qc != tchan[x]) match += CHANNEL_MISMATCH;
       ins = score_matrix[y][x+1] + ins_score;
       del = score_matrix[y+1][x] + del_score;
 
@@ -117,13 +131,15 @@ result dtw(uint32_t* query, uint32_t* target, size_t qlen, size_t tlen, int8_t i
         direction_matrix[y+1][x+1] = MATCH;
         q_cum_size[y+1][x+1] = 0;
         t_cum_size[y+1][x+1] = 0;
-      } else if(ins >= del) {
+      } else if(ins >= del) { // indels carry both accumulated sizes along from the cell they came from
         score_matrix[y+1][x+1] = ins;
         direction_matrix[y+1][x+1] = INS;
         q_cum_size[y+1][x+1] = q_cum_size[y][x+1] + query[qy];
+        t_cum_size[y+1][x+1] = t_cum_size[y][x+1];
       } else {
         score_matrix[y+1][x+1] = del;
         direction_matrix[y+1][x+1] = DEL;
+        q_cum_size[y+1][x+1] = q_cum_size[y+1][x];
         t_cum_size[y+1][x+1] = t_cum_size[y+1][x] + target[x];
       }
     }
@@ -201,6 +217,275 @@ result dtw(uint32_t* query, uint32_t* target, size_t qlen, size_t tlen, int8_t i
     free(q_cum_size[i]);
     free(t_cum_size[i]);
   }
+  free(rt);
+  free(rtc_row);
 
   return res;
 }
+
+// each kernel is compiled once per deviation model, so neither branches on it per cell
+result dtw(uint32_t* query, uint32_t* target, uint8_t* qchan, uint8_t* tchan, size_t qlen, size_t tlen, int8_t ins_score, int8_t del_score, float neutral_deviation, int rev) {
+  if(RELATIVE_DEVIATION(neutral_deviation))
+    return dtw_k(query, target, qchan, tchan, qlen, tlen, ins_score, del_score, neutral_deviation, rev, 1);
+  return dtw_k(query, target, qchan, tchan, qlen, tlen, ins_score, del_score, neutral_deviation, rev, 0);
+}
+
+// headroom for float rounding when comparing the X-drop bound to a cutoff
+#define XDROP_SLACK 0.01f
+
+/*
+ * Score-only dtw(): the same recurrence and best end, but only two rows are kept and no directions are
+ * stored, so it needs O(tlen) memory - rerun dtw() on the alignments worth reporting to get their paths
+ *
+ * Sets t->score (-1 if the query or target is empty), t->qend and t->tend
+ *
+ * X-drop: after each row the best score still reachable is bounded by the best cell of the row (or of
+ * the last column so far) plus MAX_MATCH_SCORE for every row left, and the task is abandoned with a score
+ * of -1 once that falls below min_score (NO_CUTOFF to always finish). The bound needs indels to cost something
+ */
+static inline __attribute__((always_inline)) void dtw_score_k(dtw_task* t, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score, const int relative) {
+  uint32_t qlen = t->qlen, tlen = t->tlen;
+  t->qend = 0;
+  t->tend = 0;
+  if(tlen == 0 || qlen == 0) {
+    t->score = -1;
+    return;
+  }
+
+  float* s0 = malloc((tlen+1) * sizeof(float));
+  float* s1 = malloc((tlen+1) * sizeof(float));
+  size_t* qc0 = malloc((tlen+1) * sizeof(size_t));
+  size_t* qc1 = malloc((tlen+1) * sizeof(size_t));
+  size_t* tc0 = malloc((tlen+1) * sizeof(size_t));
+  size_t* tc1 = malloc((tlen+1) * sizeof(size_t));
+  float* sw;
+  size_t* cw;
+  uint32_t x, y, qy;
+  uint32_t* query = t->query;
+  uint32_t* target = t->target;
+
+  for(x = 0; x <= tlen; x++) {
+    s0[x] = 0;
+    qc0[x] = 0;
+    tc0[x] = 0;
+  }
+  s1[0] = 0;
+  qc1[0] = 0;
+  tc1[0] = 0;
+
+  float match, qmatch, tmatch, qtmatch, ins, del, row_max, rm, rtc;
+  uint8_t qc = 0;
+  float* rt = malloc(tlen * sizeof(float));
+  float* rtc_row = malloc(tlen * sizeof(float));
+  for(x = 0; x < tlen; x++) rt[x] = size_recip(target[x], neutral_deviation, relative);
+  float col_best = 0; // best of the last column, which is gone by the time the last row is done
+  uint32_t col_y = 0;
+  int prune = min_score > NO_CUTOFF && ins_score <= 0 && del_score <= 0;
+  int abandoned = 0;
+
+  for(y = 0; y < qlen; y++) {
+    qy = t->rev ? qlen-1-y : y;
+    if(t->qchan) qc = t->rev ? (qy > 0 ? t->qchan[qy-1] : 0) : t->qchan[qy];
+    row_max = 0;
+    for(x = 0; x < tlen; x++) rtc_row[x] = relative && tc0[x] ? size_recip(tc0[x] + target[x], neutral_deviation, relative) : rt[x];
+    for(x = 0; x < tlen; x++) {
+      rm = rt[x];
+      rtc = rtc_row[x];
+      qtmatch = s0[x] + size_score(qc0[x] + query[qy], tc0[x] + target[x], rtc) + 0.2f;
+      tmatch = s0[x] + size_score(query[qy], tc0[x] + target[x], rtc) + 0.1f;
+      qmatch = s0[x] + size_score(qc0[x] + query[qy], target[x], rm) + 0.1f;
+      match = s0[x] + size_score(query[qy], target[x], rm);
+      match = match > qmatch && match > tmatch && match > qtmatch ? match : (qtmatch > qmatch && qtmatch > tmatch ? qtmatch : (qmatch > tmatch ? qmatch : tmatch));
+      if(qc && t->tchan && t->tchan[x] && qc != t->tchan[x]) match += CHANNEL_MISMATCH;
+      ins = s0[x+1] + ins_score;
+      del = s1[x] + del_score;
+
+      if(match >= ins && match >= del) {
+        s1[x+1] = match;
+        qc1[x+1] = 0;
+        tc1[x+1] = 0;
+      } else if(ins >= del) {
+        s1[x+1] = ins;
+        qc1[x+1] = qc0[x+1] + query[qy];
+        tc1[x+1] = tc0[x+1];
+      } else {
+        s1[x+1] = del;
+        qc1[x+1] = qc1[x];
+        tc1[x+1] = tc1[x] + target[x];
+      }
+      if(s1[x+1] > row_max) row_max = s1[x+1];
+    }
+    if(s1[tlen] > col_best) {
+      col_best = s1[tlen];
+      col_y = y+1;
+    }
+    // the row max starts at the 0 of column 0, which also stands for the fresh starts of later rows
+    if(prune && y+1 < qlen && (row_max > col_best ? row_max : col_best) + MAX_MATCH_SCORE * (qlen-y-1) < min_score - XDROP_SLACK) {
+      abandoned = 1;
+      break;
+    }
+    sw = s0; s0 = s1; s1 = sw;
+    cw = qc0; qc0 = qc1; qc1 = cw;
+    cw = tc0; tc0 = tc1; tc1 = cw;
+  }
+
+  // same tie-breaking as dtw(): the last row is scanned first, and the column only wins if strictly better
+  t->score = abandoned ? -1 : 0;
+  for(x = 1; x <= tlen && !abandoned; x++) {
+    if(s0[x] > t->score) {
+      t->score = s0[x];
+      t->tend = x;
+      t->qend = qlen;
+    }
+  }
+  if(!abandoned && col_best > t->score) {
+    t->score = col_best;
+    t->tend = tlen;
+    t->qend = col_y;
+  }
+
+  free(rt);
+  free(rtc_row);
+  free(s0);
+  free(s1);
+  free(qc0);
+  free(qc1);
+  free(tc0);
+  free(tc1);
+}
+
+void dtw_score(dtw_task* t, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score) {
+  if(RELATIVE_DEVIATION(neutral_deviation))
+    dtw_score_k(t, ins_score, del_score, neutral_deviation, min_score, 1);
+  else
+    dtw_score_k(t, ins_score, del_score, neutral_deviation, min_score, 0);
+}
+
+/*
+ * Batched score-only DTW
+ *
+ * dtw() matrices are only tens by hundreds of cells, too small to vectorize within one alignment, so
+ * instead several alignments (as many as the widest vector unit of the CPU holds) run side by side,
+ * one per SIMD lane (inter-task, as in SWIPE). Tasks are
+ * sorted by size so that each group pads little, and target fragments are striped into a profile so
+ * that one load fetches fragment x of every lane. Only two rows are kept and no traceback is done -
+ * rerun dtw() on the tasks worth reporting to get their paths
+ */
+typedef dtw_task* task_ptr; // ksort needs a plain type name
+#define task_gt(a, b) ((a)->tlen > (b)->tlen || ((a)->tlen == (b)->tlen && (a)->qlen > (b)->qlen))
+KSORT_INIT(dtw_task_cmp, task_ptr, task_gt)
+
+/*
+ * The lane kernel (dtw_lanes.h) is compiled once per instruction set, with as many lanes as its
+ * vectors hold, and dtw_batch() runs the widest one the CPU supports (see cpu_level()). The generic
+ * variant is built for the baseline target - SSE2 on x86-64, whatever the compiler picks elsewhere
+ */
+#define DTW_NAME_(name, variant) name##_##variant
+#define DTW_NAME__(name, variant) DTW_NAME_(name, variant)
+#define DTW_NAME(name) DTW_NAME__(name, DTW_VARIANT)
+
+#define DTW_LANES 4
+#define DTW_VARIANT generic
+#include "dtw_lanes.h"
+
+#if CPU_X86
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#define DTW_LANES 4
+#define DTW_VARIANT sse42
+#include "dtw_lanes.h"
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define DTW_LANES 8
+#define DTW_VARIANT avx2
+#include "dtw_lanes.h"
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define DTW_LANES 16
+#define DTW_VARIANT avx512
+#include "dtw_lanes.h"
+#pragma GCC pop_options
+#endif
+
+typedef void (*dtw_lanes_fn)(dtw_task** t, int n_lanes, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score);
+
+typedef struct {
+  int level; // CPU_* needed to run it
+  int lanes;
+  dtw_lanes_fn run;
+} dtw_kernel;
+
+// widest first
+static const dtw_kernel dtw_kernels[] = {
+#if CPU_X86
+  {CPU_AVX512, 16, dtw_lanes_avx512},
+  {CPU_AVX2, 8, dtw_lanes_avx2},
+  {CPU_SSE42, 4, dtw_lanes_sse42},
+#endif
+  {CPU_GENERIC, 4, dtw_lanes_generic}
+};
+
+static const dtw_kernel* dtw_select() {
+  int i, level = cpu_level();
+  for(i = 0; dtw_kernels[i].level > level; i++);
+  return &dtw_kernels[i];
+}
+
+const char* dtw_variant() {
+  return cpu_level_name(dtw_select()->level);
+}
+
+int dtw_batch_lanes() {
+  return dtw_select()->lanes;
+}
+
+/*
+ * Scores every task (score, qend and tend are set), dtw_batch_lanes() at a time
+ *
+ * Tasks with an empty query or target get a score of -1, as a failed dtw(), and so do tasks abandoned
+ * because they cannot reach min_score or, if top_k > 0, the top_k-th best score of the tasks already done
+ */
+void dtw_batch(dtw_task* tasks, size_t n_tasks, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score, int top_k) {
+  size_t i, n = 0;
+  int j, l, n_lanes;
+  dtw_task** order = malloc((n_tasks + 1) * sizeof(dtw_task*));
+  for(i = 0; i < n_tasks; i++) {
+    if(tasks[i].qlen == 0 || tasks[i].tlen == 0) {
+      tasks[i].score = -1;
+      tasks[i].qend = 0;
+      tasks[i].tend = 0;
+    } else {
+      order[n++] = &tasks[i];
+    }
+  }
+
+  // best top_k scores so far, decreasing
+  float* top = malloc((top_k > 0 ? top_k : 1) * sizeof(float));
+  for(j = 0; j < top_k; j++) top[j] = NO_CUTOFF;
+
+  // similar sizes share a group, so little of each group's matrix is padding
+  const dtw_kernel* kernel = dtw_select();
+  ks_introsort(dtw_task_cmp, n, order);
+  for(i = 0; i < n; i += kernel->lanes) {
+    float cutoff = top_k > 0 && top[top_k-1] > min_score ? top[top_k-1] : min_score;
+    n_lanes = n - i < kernel->lanes ? n - i : kernel->lanes;
+    if(n_lanes == 1) // a lone task is cheaper without the lane padding
+      dtw_score(order[i], ins_score, del_score, neutral_deviation, cutoff);
+    else
+      kernel->run(order + i, n_lanes, ins_score, del_score, neutral_deviation, cutoff);
+
+    for(l = 0; l < n_lanes && top_k > 0; l++) {
+      float sc = order[i+l]->score;
+      for(j = top_k-1; j >= 0 && sc > top[j]; j--) {
+        if(j < top_k-1) top[j+1] = top[j];
+        top[j] = sc;
+      }
+    }
+  }
+  free(top);
+  free(order);
+}
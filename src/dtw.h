@@ -22,6 +22,7 @@
  * SOFTWARE.
  */
 
+#include <float.h>
 #include "klib/kvec.h" // C dynamic vector
 #include "klib/ksort.h"
 #include "cmap.h"
@@ -47,24 +48,54 @@ static uint8_t MATCH = 0, INS = 1, DEL = 2;
 
 static float LOW = -1e38; // the order of the lowest possible 4-byte (single-precision) float
 
+// added to a fragment match whose end labels are in different (nonzero) channels: the gap between a perfect and a 2x-deviation size score
+#define CHANNEL_MISMATCH -2.0
 
-static float score(uint32_t a, uint32_t b, float neutral_deviation) {
+
+/*
+ * Size score of query fragment a against target fragment b:
+ * 1 if fragments are the same size
+ * 0 if they differ by the neutral deviation - in bp when it is >= 1.0, otherwise as a fraction of b
+ * -1 if the difference is 2x neutral deviation
+ *
+ * r is the reciprocal of the deviation scale from size_recip(), computed once per target fragment so the
+ * DP kernels score a cell with a multiply-add rather than divisions
+ */
+#define RELATIVE_DEVIATION(neutral_deviation) ((neutral_deviation) < 1.0)
+
+static inline float size_recip(uint32_t b, float neutral_deviation, const int relative) {
+  return relative ? 1.0f / ((float)b * neutral_deviation) : 1.0f / neutral_deviation;
+}
+
+static inline float size_score(uint32_t a, uint32_t b, float r) {
   float diff = (a > b ? (a - b) : (b - a));
-  if(neutral_deviation >= 1.0) {
-    // score is:
-    // 1 if fragments are the same size
-    // 0 if fragments differ by neutral deviation
-    // -1 if size difference is 2x neutral deviation
-    return 1.0 - (diff / (float)neutral_deviation);
-  } else {
-    // score is:
-    // 1 if diff == 0
-    // 0 if diff / b == neutral deviation
-    // -1 if diff / b == 2 x neutral deviation
-    return 1.0 - (diff / (float)b / (float)neutral_deviation);
-  }
+  return 1.0f - diff * r;
 }
 
-result dtw(uint32_t* query, uint32_t* target, size_t qlen, size_t tlen, int8_t ins_score, int8_t del_score, float neutral_deviation, int rev);
+// the most one match can add: size_score() is at most 1, plus the largest leftover-size bonus
+#define MAX_MATCH_SCORE 1.2f
+
+// no score cutoff for dtw_score()/dtw_batch()
+#define NO_CUTOFF (-FLT_MAX)
+
+// one query/target pair for dtw_batch(): inputs as for dtw(), outputs the score and end (qend, tend) of the best alignment
+typedef struct dtw_task {
+  uint32_t* query;
+  uint32_t* target;
+  uint8_t* qchan;
+  uint8_t* tchan;
+  uint32_t qlen;
+  uint32_t tlen;
+  uint8_t rev;
+  float score;
+  uint32_t qend;
+  uint32_t tend;
+} dtw_task;
+
+result dtw(uint32_t* query, uint32_t* target, uint8_t* qchan, uint8_t* tchan, size_t qlen, size_t tlen, int8_t ins_score, int8_t del_score, float neutral_deviation, int rev);
+void dtw_score(dtw_task* t, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score);
+void dtw_batch(dtw_task* tasks, size_t n_tasks, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score, int top_k);
+const char* dtw_variant();
+int dtw_batch_lanes();
 
 #endif /* __DTW_H__ */
@@ -0,0 +1,252 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Batched score-only DTW kernel, included by dtw.c once per instruction set it is compiled for
+ *
+ * The includer defines DTW_LANES (tasks per vector) and DTW_VARIANT (a suffix for every name defined
+ * here) and wraps the include in the matching target pragma; see dtw_kernels in dtw.c
+ */
+
+#define vfloat DTW_NAME(vfloat)
+#define vint DTW_NAME(vint)
+#define valloc_lanes DTW_NAME(valloc_lanes)
+#define vblend DTW_NAME(vblend)
+#define vblendi DTW_NAME(vblendi)
+#define vmax DTW_NAME(vmax)
+#define vscore DTW_NAME(vscore)
+#define dtw_lanes_k DTW_NAME(dtw_lanes_k)
+#define dtw_lanes DTW_NAME(dtw_lanes)
+
+typedef float vfloat __attribute__((vector_size(DTW_LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(DTW_LANES * sizeof(int32_t))));
+
+// vectors need their natural alignment, which malloc does not promise for wide SIMD types
+static void* valloc_lanes(size_t n_vectors) {
+  void* p = NULL;
+  if(posix_memalign(&p, sizeof(vfloat), n_vectors * sizeof(vfloat)) != 0) return NULL;
+  return p;
+}
+
+// lane-wise m ? a : b
+static inline vfloat vblend(vint m, vfloat a, vfloat b) {
+  return (vfloat)(((vint)a & m) | ((vint)b & ~m));
+}
+
+static inline vint vblendi(vint m, vint a, vint b) {
+  return (a & m) | (b & ~m);
+}
+
+static inline vfloat vmax(vfloat a, vfloat b) {
+  return vblend(a > b, a, b);
+}
+
+// size_score() for every lane
+static inline vfloat vscore(vint a, vint b, vfloat r) {
+  vint d = a - b;
+  d = (d ^ (d >> 31)) - (d >> 31); // |a - b|
+  return 1.0f - __builtin_convertvector(d, vfloat) * r;
+}
+
+// aligns up to DTW_LANES tasks at once, the recurrence is exactly that of dtw(), and lanes are abandoned as in dtw_score()
+static inline __attribute__((always_inline)) void dtw_lanes_k(dtw_task** t, int n_lanes, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score, const int relative) {
+  uint32_t Q = 0, T = 0;
+  int l;
+  uint32_t x, y;
+  for(l = 0; l < n_lanes; l++) {
+    if(t[l]->qlen > Q) Q = t[l]->qlen;
+    if(t[l]->tlen > T) T = t[l]->tlen;
+  }
+
+  // striped target profile; cells beyond a lane's own matrix are computed but never read by it
+  vint* tprof = valloc_lanes(T);
+  vint* tcprof = valloc_lanes(T);
+  vfloat* rtprof = valloc_lanes(T); // size_recip() of each target fragment
+  vfloat* rtc_row = relative ? valloc_lanes(T) : rtprof;
+  for(x = 0; x < T; x++) {
+    for(l = 0; l < DTW_LANES; l++) {
+      int in = l < n_lanes && x < t[l]->tlen;
+      tprof[x][l] = in ? t[l]->target[x] : 1;
+      rtprof[x][l] = size_recip(tprof[x][l], neutral_deviation, relative);
+      tcprof[x][l] = in && t[l]->tchan ? t[l]->tchan[x] : 0;
+    }
+  }
+
+  // two rows of scores and accumulated indel sizes
+  vfloat* s0 = valloc_lanes(T+1);
+  vfloat* s1 = valloc_lanes(T+1);
+  vint* qc0 = valloc_lanes(T+1);
+  vint* qc1 = valloc_lanes(T+1);
+  vint* tc0 = valloc_lanes(T+1);
+  vint* tc1 = valloc_lanes(T+1);
+  vfloat* sw;
+  vint* cw;
+  const vint zero = {0};
+  const vfloat penalty = (vfloat){0} + (float)CHANNEL_MISMATCH;
+
+  // the last row and column of each lane, to pick the best end exactly as dtw() does
+  float* last_row[DTW_LANES];
+  float* last_col[DTW_LANES];
+  float col_best[DTW_LANES];
+  int dead[DTW_LANES]; // abandoned by X-drop
+  int live = n_lanes; // neither finished nor abandoned
+  int prune = min_score > NO_CUTOFF && ins_score <= 0 && del_score <= 0;
+  for(l = 0; l < n_lanes; l++) {
+    last_row[l] = malloc((t[l]->tlen + 1) * sizeof(float));
+    last_col[l] = malloc((t[l]->qlen + 1) * sizeof(float));
+    last_col[l][0] = 0;
+    col_best[l] = 0;
+    dead[l] = 0;
+  }
+
+  for(x = 0; x <= T; x++) {
+    s0[x] = (vfloat)zero;
+    qc0[x] = zero;
+    tc0[x] = zero;
+  }
+  s1[0] = (vfloat)zero;
+  qc1[0] = zero;
+  tc1[0] = zero;
+
+  for(y = 0; y < Q; y++) {
+    vint qv, qch;
+    for(l = 0; l < DTW_LANES; l++) {
+      int in = l < n_lanes && y < t[l]->qlen;
+      uint32_t qy = in && t[l]->rev ? t[l]->qlen-1-y : y;
+      qv[l] = in ? t[l]->query[qy] : 1;
+      qch[l] = in && t[l]->qchan ? (t[l]->rev ? (qy > 0 ? t[l]->qchan[qy-1] : 0) : t[l]->qchan[qy]) : 0;
+    }
+    vint qch_set = qch != 0;
+    // size_recip() with the target size accumulated in the row above (a lane with none gets exactly rtprof back),
+    // taken out of the cell loop below so its divisions stay off the recurrence
+    if(relative) {
+      for(x = 0; x < T; x++) rtc_row[x] = 1.0f / (__builtin_convertvector(tc0[x] + tprof[x], vfloat) * neutral_deviation);
+    }
+    vfloat row_max = (vfloat)zero;
+
+    for(x = 0; x < T; x++) {
+      vint tv = tprof[x];
+      vfloat diag = s0[x];
+      vfloat rm = rtprof[x];
+      vfloat rtc = rtc_row[x];
+      vfloat match = diag + vscore(qv, tv, rm);
+      match = vmax(match, diag + vscore(qc0[x] + qv, tc0[x] + tv, rtc) + 0.2f);
+      match = vmax(match, diag + vscore(qv, tc0[x] + tv, rtc) + 0.1f);
+      match = vmax(match, diag + vscore(qc0[x] + qv, tv, rm) + 0.1f);
+      vint mis = qch_set & (tcprof[x] != 0) & (tcprof[x] != qch);
+      match += (vfloat)((vint)penalty & mis);
+      vfloat ins = s0[x+1] + (float)ins_score;
+      vfloat del = s1[x] + (float)del_score;
+
+      vint is_match = (match >= ins) & (match >= del);
+      vint is_ins = ~is_match & (ins >= del);
+      vint is_del = ~is_match & ~is_ins;
+      s1[x+1] = vblend(is_match, match, vblend(is_ins, ins, del));
+      qc1[x+1] = vblendi(is_ins, qc0[x+1] + qv, qc1[x] & is_del);
+      tc1[x+1] = vblendi(is_ins, tc0[x+1], (tc1[x] + tv) & is_del);
+      row_max = vmax(row_max, s1[x+1]);
+    }
+
+    for(l = 0; l < n_lanes; l++) {
+      if(dead[l] || y >= t[l]->qlen) continue;
+      last_col[l][y+1] = s1[t[l]->tlen][l];
+      if(s1[t[l]->tlen][l] > col_best[l]) col_best[l] = s1[t[l]->tlen][l];
+      if(y + 1 == t[l]->qlen) {
+        for(x = 0; x <= t[l]->tlen; x++) last_row[l][x] = s1[x][l];
+        live--;
+      } else if(prune && (row_max[l] > col_best[l] ? row_max[l] : col_best[l]) + MAX_MATCH_SCORE * (t[l]->qlen-y-1) < min_score - XDROP_SLACK) {
+        // padding cells past a lane's target only loosen its row max
+        dead[l] = 1;
+        live--;
+      }
+    }
+    if(live == 0) break;
+    sw = s0; s0 = s1; s1 = sw;
+    cw = qc0; qc0 = qc1; qc1 = cw;
+    cw = tc0; tc0 = tc1; tc1 = cw;
+  }
+
+  // best end anywhere in the last row or column, first the row then the column as in dtw()
+  for(l = 0; l < n_lanes; l++) {
+    if(dead[l]) {
+      t[l]->score = -1;
+      t[l]->qend = 0;
+      t[l]->tend = 0;
+      free(last_row[l]);
+      free(last_col[l]);
+      continue;
+    }
+    float best = 0;
+    uint32_t bx = 0, by = 0;
+    for(x = 1; x <= t[l]->tlen; x++) {
+      if(last_row[l][x] > best) {
+        best = last_row[l][x];
+        bx = x;
+        by = t[l]->qlen;
+      }
+    }
+    for(y = 1; y <= t[l]->qlen; y++) {
+      if(last_col[l][y] > best) {
+        best = last_col[l][y];
+        bx = t[l]->tlen;
+        by = y;
+      }
+    }
+    t[l]->score = best;
+    t[l]->qend = by;
+    t[l]->tend = bx;
+    free(last_row[l]);
+    free(last_col[l]);
+  }
+
+  free(tprof);
+  free(tcprof);
+  free(rtprof);
+  if(relative) free(rtc_row);
+  free(s0);
+  free(s1);
+  free(qc0);
+  free(qc1);
+  free(tc0);
+  free(tc1);
+}
+
+static void dtw_lanes(dtw_task** t, int n_lanes, int8_t ins_score, int8_t del_score, float neutral_deviation, float min_score) {
+  if(RELATIVE_DEVIATION(neutral_deviation))
+    dtw_lanes_k(t, n_lanes, ins_score, del_score, neutral_deviation, min_score, 1);
+  else
+    dtw_lanes_k(t, n_lanes, ins_score, del_score, neutral_deviation, min_score, 0);
+}
+
+#undef vfloat
+#undef vint
+#undef valloc_lanes
+#undef vblend
+#undef vblendi
+#undef vmax
+#undef vscore
+#undef dtw_lanes_k
+#undef dtw_lanes
+#undef DTW_LANES
+#undef DTW_VARIANT
@@ -27,33 +27,34 @@
 #include <stdint.h>
 #include <string.h>
 #include <limits.h>
+#include <float.h>
 #include <time.h>
+#include <unistd.h>
 #include "klib/kvec.h" // C dynamic vector
 #include "klib/khash.h" // C hash table/dictionary
 #include "bnx.h"
 #include "hash.h"
 #include "dtw.h"
 #include "chain.h"
+#include "aln.h"
 #include "klib/ksort.h"
 
 //#define aln_gt(a,b) ((a).score > (b).score)
 //KSORT_INIT(aln_cmp, result, aln_gt)
 
-uint8_t* get_fragments(label* labels, size_t n_labels, int bin_size, int rev) {
-  uint8_t* frags = malloc(sizeof(uint8_t) * n_labels);
+// fragment size bins, saturating at max_bin (all larger fragments share the top bin)
+// the fragments of the reversed map are the same bins in reverse order, so only these are ever needed
+uint16_t* get_fragments(label* labels, size_t n_labels, int bin_size, uint16_t max_bin) {
+  uint16_t* frags = malloc(sizeof(uint16_t) * (n_labels + 1));
   if(n_labels == 0) {
     return frags;
   }
-  frags[0] = labels[0].position / bin_size; // this *may* overflow if a fragment is >255 * bin_size, but it will just hash to val % 256
+  uint32_t f = labels[0].position / bin_size;
+  frags[0] = f < max_bin ? f : max_bin;
   int i;
-  if(rev) {
-    for(i = n_labels-1; i >= 1; i--) {
-      frags[i] = (labels[i-1].position - labels[i].position) / bin_size;
-    }
-  } else {
-    for(i = 1; i < n_labels; i++) {
-      frags[i] = (labels[i].position - labels[i-1].position) / bin_size;
-    }
+  for(i = 1; i < n_labels; i++) {
+    f = (labels[i].position - labels[i-1].position) / bin_size;
+    frags[i] = f < max_bin ? f : max_bin;
   }
   return frags;
 }
@@ -77,6 +78,192 @@ uint32_t* u32_get_fragments(label* labels, size_t n_labels, int bin_size, int re
   return frags;
 }
 
+// the channel of every label, aligned with the fragments they end (for dtw())
+uint8_t* get_channels(label* labels, size_t n_labels) {
+  uint8_t* chans = malloc(sizeof(uint8_t) * (n_labels + 1));
+  size_t i;
+  for(i = 0; i < n_labels; i++) {
+    chans[i] = labels[i].channel;
+  }
+  return chans;
+}
+
+// channel signature of the q-gram at i: the codes of the k+1 labels bounding its fragments (labels i-1..i+k-1,
+// where label -1 is the start of the map and codes like the end marker), read in reverse if rev
+static inline uint32_t chan_sig(label* labels, int i, int k, int rev) {
+  uint32_t sig = 0;
+  int j, l;
+  for(j = -1; j < k; j++) {
+    l = rev ? i + k - 2 - j : i + j;
+    sig = (sig << 2) | (l >= 0 ? chan_code(labels[l].channel) : 0);
+  }
+  return sig;
+}
+
+// writes every jittered variant of the q-gram at query position i (with channel signatures sig forward and
+// rsig reversed) to out as canonical probes, returning how many
+static size_t jitter_bins(uint16_t *frags, int i, int k, uint32_t sig, uint32_t rsig, probe *out) {
+  uint32_t l, zero = 0;
+  uint32_t n_jitter = 1 << (k-1); // the last fragment is never jittered
+  uint64_t fkey, rkey;
+  size_t m = 0;
+  int j;
+  for(j = 0; j < k - 1; j++) zero |= (uint32_t)(frags[i+j] == 0) << j;
+
+  for(l = 0; l < n_jitter; l++) { // iterate through a bit vector representing whether each position should be floor'd
+    if(l & zero) continue; // no bin below 0
+    fkey = chan_key(qgram_key(frags+i, k, l), sig);
+    rkey = chan_key(qgram_rkey(frags+i, k, l), rsig);
+    out[m].key = canon_key(fkey, rkey);
+    out[m].strand = seed_strand(fkey, rkey);
+    out[m++].qpos = i;
+  }
+  return m;
+}
+
+/*
+ * Seed extraction kernels
+ *
+ * index kernels write the canonical keys and strands of the n q-grams starting at fragments 0..n-1
+ * (reference seeds, not jittered); query kernels write every jittered variant of them as probes (see
+ * jitter_bins()) and return how many - at most n << (k-1). The generic kernels take any k;
+ * SEED_KERNELS_INIT() generates kernels for a fixed q, where the forward and reverse keys, channel
+ * signatures and zero-bin mask roll along the molecule with constant shifts and each jitter variant is one
+ * subtraction of a precomputed delta per direction. The reverse key and signature take each new fragment
+ * and label code at the top and shift right; label -1 is the zero code that starts both signatures
+ */
+typedef void (*index_kernel)(uint16_t* frags, label* labels, int n, int k, uint64_t* keys, uint8_t* strands);
+typedef size_t (*query_kernel)(uint16_t* frags, label* labels, int n, int k, probe* out);
+
+typedef struct {
+  index_kernel index;
+  query_kernel query;
+} seed_kernels;
+
+static void index_seeds(uint16_t* frags, label* labels, int n, int k, uint64_t* keys, uint8_t* strands) {
+  uint64_t fkey, rkey;
+  int i;
+  for(i = 0; i < n; i++) {
+    fkey = chan_key(qgram_key(frags+i, k, 0), chan_sig(labels, i, k, 0));
+    rkey = chan_key(qgram_rkey(frags+i, k, 0), chan_sig(labels, i, k, 1));
+    keys[i] = canon_key(fkey, rkey);
+    strands[i] = seed_strand(fkey, rkey);
+  }
+}
+
+static size_t query_seeds(uint16_t* frags, label* labels, int n, int k, probe* out) {
+  size_t m = 0;
+  int i;
+  for(i = 0; i < n; i++) {
+    m += jitter_bins(frags, i, k, chan_sig(labels, i, k, 0), chan_sig(labels, i, k, 1), out + m);
+  }
+  return m;
+}
+
+#define SEED_KERNELS_INIT(Q) \
+  static void index_seeds_##Q(uint16_t* frags, label* labels, int n, int k, uint64_t* keys, uint8_t* strands) { \
+    const int bits = qgram_bits(Q); \
+    const uint64_t mask = ~(uint64_t)0 >> (64 - Q * bits); \
+    uint64_t key = 0, rkey = 0, fk, rk; \
+    uint32_t sig = 0, rsig = 0, code; \
+    int i; \
+    (void)k; \
+    for(i = 0; i < Q - 1; i++) { \
+      key = key << bits | frags[i]; \
+      rkey = rkey >> bits | (uint64_t)frags[i] << (bits * (Q - 1)); \
+      code = chan_code(labels[i].channel); \
+      sig = sig << 2 | code; \
+      rsig = rsig >> 2 | code << 2 * Q; \
+    } \
+    for(i = 0; i < n; i++) { \
+      key = (key << bits | frags[i + Q - 1]) & mask; \
+      rkey = rkey >> bits | (uint64_t)frags[i + Q - 1] << (bits * (Q - 1)); \
+      code = chan_code(labels[i + Q - 1].channel); \
+      sig = (sig << 2 | code) & ((1u << 2 * (Q + 1)) - 1); \
+      rsig = rsig >> 2 | code << 2 * Q; \
+      fk = chan_key(key, sig); \
+      rk = chan_key(rkey, rsig); \
+      keys[i] = canon_key(fk, rk); \
+      strands[i] = seed_strand(fk, rk); \
+    } \
+  } \
+  static size_t query_seeds_##Q(uint16_t* frags, label* labels, int n, int k, probe* out) { \
+    const int bits = qgram_bits(Q); \
+    const uint64_t mask = ~(uint64_t)0 >> (64 - Q * bits); \
+    uint64_t key = 0, rkey = 0, fk, rk, delta[1 << (Q - 1)], rdelta[1 << (Q - 1)]; \
+    uint32_t sig = 0, rsig = 0, code, zero = 0, l; \
+    size_t m = 0; \
+    int i, j; \
+    (void)k; \
+    for(l = 0; l < 1u << (Q - 1); l++) { \
+      delta[l] = rdelta[l] = 0; \
+      for(j = 0; j < Q - 1; j++) { \
+        delta[l] += (uint64_t)(l >> j & 1) << (bits * (Q - 1 - j)); \
+        rdelta[l] += (uint64_t)(l >> j & 1) << (bits * j); \
+      } \
+    } \
+    for(i = 0; i < Q - 1; i++) { \
+      key = key << bits | frags[i]; \
+      rkey = rkey >> bits | (uint64_t)frags[i] << (bits * (Q - 1)); \
+      code = chan_code(labels[i].channel); \
+      sig = sig << 2 | code; \
+      rsig = rsig >> 2 | code << 2 * Q; \
+      zero = zero >> 1 | (uint32_t)(frags[i] == 0) << (Q - 1); \
+    } \
+    for(i = 0; i < n; i++) { \
+      key = (key << bits | frags[i + Q - 1]) & mask; \
+      rkey = rkey >> bits | (uint64_t)frags[i + Q - 1] << (bits * (Q - 1)); \
+      code = chan_code(labels[i + Q - 1].channel); \
+      sig = (sig << 2 | code) & ((1u << 2 * (Q + 1)) - 1); \
+      rsig = rsig >> 2 | code << 2 * Q; \
+      zero = zero >> 1 | (uint32_t)(frags[i + Q - 1] == 0) << (Q - 1); \
+      for(l = 0; l < 1u << (Q - 1); l++) { \
+        if(l & zero) continue; /* no bin below 0 */ \
+        fk = chan_key(key - delta[l], sig); \
+        rk = chan_key(rkey - rdelta[l], rsig); \
+        out[m].key = canon_key(fk, rk); \
+        out[m].strand = seed_strand(fk, rk); \
+        out[m++].qpos = i; \
+      } \
+    } \
+    return m; \
+  }
+
+#define QGRAM_KERNEL_MIN 3
+#define QGRAM_KERNEL_MAX 8
+
+SEED_KERNELS_INIT(3)
+SEED_KERNELS_INIT(4)
+SEED_KERNELS_INIT(5)
+SEED_KERNELS_INIT(6)
+SEED_KERNELS_INIT(7)
+SEED_KERNELS_INIT(8)
+
+static const seed_kernels qgram_kernels[QGRAM_KERNEL_MAX - QGRAM_KERNEL_MIN + 1] = {
+  {index_seeds_3, query_seeds_3},
+  {index_seeds_4, query_seeds_4},
+  {index_seeds_5, query_seeds_5},
+  {index_seeds_6, query_seeds_6},
+  {index_seeds_7, query_seeds_7},
+  {index_seeds_8, query_seeds_8}
+};
+
+static seed_kernels get_seed_kernels(int k) {
+  seed_kernels generic = {index_seeds, query_seeds};
+  return k >= QGRAM_KERNEL_MIN && k <= QGRAM_KERNEL_MAX ? qgram_kernels[k - QGRAM_KERNEL_MIN] : generic;
+}
+
+// adds a reference seed position, on both strands if the seed is palindromic
+static inline void insert_pos(matchVec *v, uint32_t read_id, uint32_t pos, uint8_t strand) {
+  readPos r;
+  r.readNum = (read_id << 1) | (strand == STRAND_RV);
+  r.pos = pos;
+  kv_push(readPos, *v, r);
+  if(strand == STRAND_BOTH) {
+    r.readNum |= 1;
+    kv_push(readPos, *v, r);
+  }
+}
 
 /*
  * nicks: an array of nick positions as produced by bntools (bn_file.c)
@@ -85,54 +272,51 @@ uint32_t* u32_get_fragments(label* labels, size_t n_labels, int bin_size, int re
  *
  * returns: 0 if successful, else 1
  */
-int insert_rmap(label* labels, size_t n_labels, uint32_t read_id, int k, unsigned char reverse, khash_t(qgramHash) *db, int bin_size) {
-  int i, j, l, absent, skip;
+int insert_rmap(label* labels, size_t n_labels, uint32_t read_id, int k, unsigned char reverse, khash_t(qgramHash) *db, int bin_size, index_kernel kernel) {
+  int i, absent;
 
   // nick pos values are ints, rounded from the double in the bnx file, and may be 4 or 8 bytes long
   // they are related to the length of the whole fragment, so typically max out in the 100s of thousands (avg ~200k)
   // there is always a nick value given for the END of the fragment, but not one at 0
 
   khint_t bin; // hash bin (result of kh_put)
-  uint8_t* frags = get_fragments(labels, n_labels, bin_size, 0);
   if(n_labels < k) return 1;
-  for(i = 0; i <= n_labels-k; i++) {
-    khint_t qgram; // khint_t is probably u32
-    //for(skip = 1; skip < k; skip++) {
-      for(l = 0; l < pow(2, k-1); l++) { // iterate through a bit vector representing whether each position should be ceil'd
-      //for(l = 0; l < 1; l++) { // iterate through a bit vector representing whether each position should be ceil'd
-        //qgram = xratio_hash((labels+i), bin_size, skip);
-        qgram = qgram_hash((frags+i), k, skip, l);
-        //printf("# %dth %d-gram: %u\n", i, k, qgram);
-
-        // insert qgram:readId,i into db
-        bin = kh_put(qgramHash, db, qgram, &absent);
-        if(absent) { // bin is empty (unset)
-          kv_init(kh_value(db, bin));
-        }
-        // TODO: can reduce db memory usage by making this a pointer to a shared readPos among jittered hashes
-        readPos r;
-        r.readNum = (read_id << 1); // forward strand since its padded with a 0
-        r.pos = i;
-        kv_push(readPos, kh_value(db, bin), r);
-      }
-    //}
+  uint16_t* frags = get_fragments(labels, n_labels, bin_size, qgram_max_bin(k));
+  int n = (int)(n_labels - k + 1) < (1 << ANCHOR_TPOS_BITS) ? (int)(n_labels - k + 1) : (1 << ANCHOR_TPOS_BITS);
+  if(n < (int)(n_labels - k + 1))
+    fprintf(stderr, "Map %u has %zu labels, only seeds at the first %d are indexed\n", read_id + 1, n_labels, n);
+  uint64_t* keys = malloc(n * sizeof(uint64_t));
+  uint8_t* strands = malloc(n);
+  // the reference is not jittered - size binning tolerance is applied to the query instead, see jitter_bins()
+  kernel(frags, labels, n, k, keys, strands);
+  for(i = 0; i < n; i++) {
+    // insert qgram:readId,i into db
+    bin = kh_put(qgramHash, db, keys[i], &absent);
+    if(absent) { // bin is empty (unset)
+      kv_init(kh_value(db, bin));
+    }
+    insert_pos(&kh_value(db, bin), read_id, i, strands[i]);
   }
+  free(frags);
+  free(keys);
+  free(strands);
 
   return 0;
 }
 
-// if reverse is true (1), forward and reverse signatures will be adjacent such that
-// signature of read X forward is at index (2*X), and reverse is (2*X + 1)
+// seeds are canonical, with the strand they were read on in the low bit of readNum, such that
+// a seed read X has forward is stored as (2*X), and one it has reversed as (2*X + 1)
 void build_hash_db(cmap c, int k, khash_t(qgramHash) *db, int readLimit, int bin_size, int resolution_min) {
 
   label* filtered_labels;
   uint32_t f = 0;
+  index_kernel kernel = get_seed_kernels(k).index; // chosen once for the whole index
   while (f < c.n_maps) {
 
     filtered_labels = malloc(c.molecules[f].n_labels * sizeof(label));
     int n_filtered_labels = filter_labels(c.molecules[f].labels, c.molecules[f].n_labels, filtered_labels, resolution_min);
     //int res = insert_rmap(c.labels[f], c.map_lengths[f], f, k, 0, db, bin_size); // forward strand only right now
-    int res = insert_rmap(filtered_labels, n_filtered_labels, f, k, 0, db, bin_size); // forward strand only right now
+    int res = insert_rmap(filtered_labels, n_filtered_labels, f, k, 0, db, bin_size, kernel); // canonical seeds cover both strands
     free(filtered_labels);
     f++;
 
@@ -142,275 +326,1167 @@ void build_hash_db(cmap c, int k, khash_t(qgramHash) *db, int readLimit, int bin
   }
 }
 
-// floor: the index of the fragment to floor
-int jitter_bins(uint8_t *frags, int i, int k, int skip, khash_t(qgramHash) *db, khash_t(matchHash) *hits, int max_qgrams) {
-  int j, m, absent;
-  uint32_t l;
-  khint_t bin; // hash bin (result of kh_put)
+// frees the seed index along with the position list in every bucket
+void destroy_hash_db(khash_t(qgramHash) *db) {
+  khint_t bin;
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(kh_exist(db, bin)) kv_destroy(kh_val(db, bin));
+  }
+  kh_destroy(qgramHash, db);
+}
 
-  //qgram = xratio_hash((labels+i), bin_size, skip, floor);
-  //for(l = 0; l < pow(2, k-1); l++) { // iterate through a bit vector representing whether each position should be ceil'd
-  for(l = 0; l < 1; l++) { // iterate through a bit vector representing whether each position should be ceil'd
-    khint_t qgram = qgram_hash((frags+i), k, skip, l);
+/*
+ * Freezes a built (and masked) seed index into a seedIndex with the given MEM_* placement, and destroys db
+ * Returns NULL if the index is too large (more than 2^32 positions)
+ */
+seedIndex* freeze_hash_db(khash_t(qgramHash) *db, int placement) {
+  khint_t bin;
+  size_t n_keys = 0, n_pos = 0, n_slots = 2;
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(!kh_exist(db, bin)) continue;
+    n_keys++;
+    n_pos += kv_size(kh_val(db, bin));
+  }
+  if(n_pos > UINT32_MAX) {
+    fprintf(stderr, "Seed index has %zu positions, at most %u are supported\n", n_pos, UINT32_MAX);
+    destroy_hash_db(db);
+    return NULL;
+  }
+  while(n_slots < 2 * n_keys) n_slots <<= 1;
 
-    //fprintf(stderr, "# %dth %d-gram (%u): %u\n", i, k, l, qgram);
+  seedIndex* idx = malloc(sizeof(seedIndex));
+  idx->mask = n_slots - 1;
+  idx->n_pos = n_pos;
+  idx->placement = placement;
+  idx->slots = mem_alloc(n_slots * sizeof(seed_slot), placement);
+  idx->pos = mem_alloc(n_pos * sizeof(readPos), placement);
+  if(idx->slots == NULL || idx->pos == NULL) {
+    fprintf(stderr, "Failed to allocate the seed index (%zu keys, %zu positions)\n", n_keys, n_pos);
+    destroy_index(idx);
+    destroy_hash_db(db);
+    return NULL;
+  }
+  memset(idx->slots, 0, n_slots * sizeof(seed_slot));
 
-    khint_t size_close, close;
-    close = qgram;
-    /*
-    for(size_close = qgram > bin_size ? qgram-bin_size : qgram; size_close < qgram + bin_size + 1; size_close += bin_size) {
-      for(close = size_close > 0 ? size_close-1 : 0; close < size_close+2; close++) {
-    */
-        //fprintf(stderr, "adding hash val %u\n", close);
-        bin = kh_get(qgramHash, db, close);
-        if(bin == kh_end(db)) // key not found, IDK what happens if you don't test this
-          continue;
-        matchVec matches = kh_val(db, bin);
-        if(kv_size(matches) > max_qgrams) { // repetitive, ignore it
-          continue;
-        }
-        for(m = 0; m < kv_size(matches); m++) {
-          bin = kh_put(matchHash, hits, kv_A(matches, m).readNum>>1, &absent); // >>1 removes the fw/rv bit, which is always fw(0) right now
-          if(absent) { // bin is empty (unset)
-            kv_init(kh_value(hits, bin));
-          }
-          // check back to be sure we haven't already found this pair (this is possible now with the 4/5-mers)
-          char exists = 0;
-          for(j = kv_size(kh_value(hits, bin))-1; j > 0 && kv_A(kh_value(hits, bin), j).qpos == i; j--) {
-            if(kv_A(kh_value(hits, bin), j).tpos == kv_A(matches, m).pos) {
-              exists = 1;
-              break;
-            }
-          }
-          if(!exists) { // this pair was not already found
-            posPair ppair; // to store matching query/target positions
-            ppair.qpos = i;
-            ppair.tpos = kv_A(matches, m).pos;
-            kv_push(posPair, kh_value(hits, bin), ppair);
-          }
-        }
-    /*
+  uint64_t s;
+  n_pos = 0;
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(!kh_exist(db, bin)) continue;
+    for(s = seed_slot_of(idx, kh_key(db, bin)); idx->slots[s].n > 0; s = (s + 1) & idx->mask);
+    idx->slots[s].key = kh_key(db, bin);
+    idx->slots[s].start = n_pos;
+    idx->slots[s].n = kv_size(kh_val(db, bin));
+    memcpy(idx->pos + n_pos, kh_val(db, bin).a, kv_size(kh_val(db, bin)) * sizeof(readPos));
+    n_pos += kv_size(kh_val(db, bin));
+  }
+  destroy_hash_db(db);
+  return idx;
+}
+
+// a copy of idx, its pages placed by the calling thread's first touch (see pin_to_node())
+seedIndex* copy_index(const seedIndex *idx) {
+  seedIndex* c = malloc(sizeof(seedIndex));
+  *c = *idx;
+  c->slots = mem_alloc((idx->mask + 1) * sizeof(seed_slot), idx->placement);
+  c->pos = mem_alloc(idx->n_pos * sizeof(readPos), idx->placement);
+  if(c->slots == NULL || c->pos == NULL) {
+    fprintf(stderr, "Failed to allocate a copy of the seed index\n");
+    destroy_index(c);
+    return NULL;
+  }
+  memcpy(c->slots, idx->slots, (idx->mask + 1) * sizeof(seed_slot));
+  memcpy(c->pos, idx->pos, idx->n_pos * sizeof(readPos));
+  return c;
+}
+
+void destroy_index(seedIndex *idx) {
+  if(idx == NULL) return;
+  mem_free(idx->slots, (idx->mask + 1) * sizeof(seed_slot));
+  mem_free(idx->pos, idx->n_pos * sizeof(readPos));
+  free(idx);
+}
+
+#define INDEX_MAGIC 0x5845444e49544b52ull // "RKTINDEX"
+
+/*
+ * Writes the arrays of a frozen index to fp as they are in memory, after a header of the magic number, mask
+ * and number of positions - for this build to read back with load_index() (a temporary shard, not an
+ * interchange format)
+ * Returns 0 if successful, else 1
+ */
+int save_index(const seedIndex *idx, FILE* fp) {
+  uint64_t hdr[3] = {INDEX_MAGIC, idx->mask, idx->n_pos};
+  if(fwrite(hdr, sizeof(uint64_t), 3, fp) != 3) return 1;
+  if(fwrite(idx->slots, sizeof(seed_slot), idx->mask + 1, fp) != idx->mask + 1) return 1;
+  if(fwrite(idx->pos, sizeof(readPos), idx->n_pos, fp) != idx->n_pos) return 1;
+  return fflush(fp) != 0;
+}
+
+// reads an index written by save_index() from the current position of fp, onto pages of the given MEM_* placement; NULL if it cannot
+seedIndex* load_index(FILE* fp, int placement) {
+  uint64_t hdr[3];
+  if(fread(hdr, sizeof(uint64_t), 3, fp) != 3 || hdr[0] != INDEX_MAGIC) {
+    fprintf(stderr, "Failed to read a seed index: not written by this build\n");
+    return NULL;
+  }
+  seedIndex* idx = malloc(sizeof(seedIndex));
+  idx->mask = hdr[1];
+  idx->n_pos = hdr[2];
+  idx->placement = placement;
+  idx->slots = mem_alloc((idx->mask + 1) * sizeof(seed_slot), placement);
+  idx->pos = mem_alloc(idx->n_pos * sizeof(readPos), placement);
+  if(idx->slots == NULL || idx->pos == NULL) {
+    fprintf(stderr, "Failed to allocate the seed index (%llu slots, %zu positions)\n", (unsigned long long)idx->mask + 1, idx->n_pos);
+    destroy_index(idx);
+    return NULL;
+  }
+  if(fread(idx->slots, sizeof(seed_slot), idx->mask + 1, fp) != idx->mask + 1 || fread(idx->pos, sizeof(readPos), idx->n_pos, fp) != idx->n_pos) {
+    fprintf(stderr, "Failed to read a seed index: truncated\n");
+    destroy_index(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+/*
+ * Repeat cutoff of an index with n_keys distinct seeds, hist[c] of which have c positions (c <= max_occ):
+ * the most positions a seed may have once the most frequent frac of distinct seeds, and any with more
+ * than max_qgrams positions, are masked
+ */
+static uint32_t repeat_cutoff(size_t* hist, size_t max_occ, size_t n_keys, float frac, int max_qgrams) {
+  size_t n, c;
+  // lower the cutoff while no more than frac of the keys are above it
+  size_t allowed = (size_t)(frac * n_keys);
+  uint32_t cutoff = max_occ;
+  for(c = max_occ, n = 0; c > 1 && n + hist[c] <= allowed; c--) {
+    n += hist[c];
+    cutoff = c - 1;
+  }
+  if(max_qgrams > 0 && cutoff > (uint32_t)max_qgrams) cutoff = max_qgrams;
+  return cutoff;
+}
+
+/*
+ * Masks repetitive seeds: the buckets of the most frequent frac of distinct seeds (by their number of
+ * positions, from a histogram of bucket sizes), and any with more than max_qgrams positions, are removed,
+ * so lookups never walk them
+ * Returns the cutoff - the most positions a remaining seed has
+ */
+uint32_t mask_repeats(khash_t(qgramHash) *db, float frac, int max_qgrams) {
+  khint_t bin;
+  size_t max_occ = 0, n_keys = 0, n_masked = 0, masked_pos = 0;
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(!kh_exist(db, bin)) continue;
+    n_keys++;
+    if(kv_size(kh_val(db, bin)) > max_occ) max_occ = kv_size(kh_val(db, bin));
+  }
+  if(n_keys == 0) return 0;
+
+  size_t* hist = calloc(max_occ + 1, sizeof(size_t));
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(kh_exist(db, bin)) hist[kv_size(kh_val(db, bin))]++;
+  }
+  uint32_t cutoff = repeat_cutoff(hist, max_occ, n_keys, frac, max_qgrams);
+  free(hist);
+
+  for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+    if(kh_exist(db, bin) && kv_size(kh_val(db, bin)) > cutoff) {
+      n_masked++;
+      masked_pos += kv_size(kh_val(db, bin));
+      kv_destroy(kh_val(db, bin));
+      kh_del(qgramHash, db, bin);
+    }
+  }
+  fprintf(stderr, "# Masked %zu repetitive seeds (%zu positions) of %zu, occurring over %u times\n", n_masked, masked_pos, n_keys, cutoff);
+  return cutoff;
+}
+
+/*
+ * Cross-ratio bin edges
+ *
+ * edges[j] is the cross-ratio at which the CDF reaches (j+1)/bins, so binning a cross-ratio is a
+ * search over edges rather than a log per ratio; found by bisection since the CDF has no closed inverse
+ */
+float* xratio_edges(int bins) {
+  float* edges = malloc(bins * sizeof(float));
+  int j, it;
+  double lo, hi, mid;
+  for(j = 0; j < bins; j++) {
+    lo = 1.0 + 1e-9;
+    hi = 1e5; // the CDF is within 1e-5 of 1 here, and loses precision much beyond it
+    for(it = 0; it < 100; it++) {
+      mid = lo + (hi - lo) / 2;
+      if(xratio_cdf(mid) < (double)(j+1) / bins) lo = mid;
+      else hi = mid;
+    }
+    edges[j] = (float)hi;
+  }
+  edges[bins-1] = FLT_MAX;
+  return edges;
+}
+
+static inline uint16_t xratio_bin(float cr, float* edges, int bins) {
+  int lo = 0, hi = bins - 1, mid;
+  while(lo < hi) {
+    mid = (lo + hi) >> 1;
+    if(cr < edges[mid]) hi = mid;
+    else lo = mid + 1;
+  }
+  return (uint16_t)lo;
+}
+
+/*
+ * The label 4-tuples used by cross-ratio seeds, as offsets from the first label
+ *
+ * A seed is two consecutive cross-ratios over 5 labels. Reference seeds are also taken over 6 labels
+ * with one of the inner labels skipped, which tolerates one missing label in the molecule; every
+ * ratio those windows need is one of these four patterns at some start label
+ */
+#define XR_PATTERNS 4
+static const int xr_offsets[XR_PATTERNS][3] = {{1, 2, 3}, {2, 3, 4}, {1, 3, 4}, {1, 2, 4}};
+
+/*
+ * Computes the cross-ratio bin of every label tuple of every pattern for one map
+ *
+ * labels exclude the map end (it is not a label); returns pattern-major bins: bins[p * n_pts + j] is
+ * pattern p starting at label j (trailing tuples that run off the end are unset), and sets n_pts
+ */
+static uint16_t* xratio_bins(label* labels, size_t n_labels, float* edges, int bins, int* n_pts) {
+  int n = n_labels > 1 ? n_labels - 1 : 0; // skip the end marker
+  int i, p, o1, o2, o3;
+  float* pos = malloc((n + 1) * sizeof(float));
+  float* cr = malloc((n + 1) * sizeof(float));
+  uint16_t* out = malloc((XR_PATTERNS * n + 1) * sizeof(uint16_t));
+
+  for(i = 0; i < n; i++) pos[i] = (float)labels[i].position;
+
+  // one straight pass per pattern over contiguous floats (no branches, so the compiler can vectorize it)
+  for(p = 0; p < XR_PATTERNS; p++) {
+    o1 = xr_offsets[p][0];
+    o2 = xr_offsets[p][1];
+    o3 = xr_offsets[p][2];
+    for(i = 0; i < n - o3; i++) {
+      cr[i] = xratio(pos[i], pos[i+o1], pos[i+o2], pos[i+o3]);
+    }
+    for(i = 0; i < n - o3; i++) {
+      out[p * n + i] = xratio_bin(cr[i], edges, bins);
+    }
+  }
+
+  free(pos);
+  free(cr);
+  *n_pts = n;
+  return out;
+}
+
+// channel codes of the labels, excluding the end marker, as for xratio_bins()
+static uint8_t* xratio_codes(label* labels, size_t n_labels) {
+  int n = n_labels > 1 ? n_labels - 1 : 0;
+  int i;
+  uint8_t* codes = malloc(n + 1);
+  for(i = 0; i < n; i++) {
+    codes[i] = chan_code(labels[i].channel);
+  }
+  return codes;
+}
+
+// channel signature of the 5 labels of a cross-ratio window at i, skipping label i+skip (none if skip is 0),
+// read in reverse if rev
+static inline uint32_t xratio_sig(uint8_t* codes, int i, int skip, int rev) {
+  uint32_t sig = 0;
+  int j, w = skip ? 6 : 5;
+  for(j = 0; j < w; j++) {
+    if(skip && (rev ? w-1-j : j) == skip) continue;
+    sig = (sig << 2) | codes[i + (rev ? w-1-j : j)];
+  }
+  return sig;
+}
+
+// canonical key of a cross-ratio window with ratio bins b1, b2 (see canon_key()); reversed, the ratios swap
+static inline uint64_t xratio_canon(uint16_t b1, uint16_t b2, int bins, uint8_t* codes, int i, int skip, uint8_t* strand) {
+  uint64_t fkey = chan_key(xratio_key(b1, b2, bins), xratio_sig(codes, i, skip, 0));
+  uint64_t rkey = chan_key(xratio_key(b2, b1, bins), xratio_sig(codes, i, skip, 1));
+  *strand = seed_strand(fkey, rkey);
+  return canon_key(fkey, rkey);
+}
+
+/*
+ * Inserts cross-ratio seeds for one reference map
+ *
+ * For each start label i, the consecutive window (i..i+4) plus the four windows over (i..i+5) that skip
+ * one inner label; each pair of (pattern, start) below is (first ratio, second ratio) of a window
+ */
+static const int xr_windows[5][4] = {
+  {0, 0, 0, 1}, // no skip:  (i,i+1,i+2,i+3) (i+1,i+2,i+3,i+4)
+  {1, 0, 0, 2}, // skip i+1: (i,i+2,i+3,i+4) (i+2,i+3,i+4,i+5)
+  {2, 0, 1, 1}, // skip i+2: (i,i+1,i+3,i+4) (i+1,i+3,i+4,i+5)
+  {3, 0, 2, 1}, // skip i+3: (i,i+1,i+2,i+4) (i+1,i+2,i+4,i+5)
+  {0, 0, 3, 1}  // skip i+4: (i,i+1,i+2,i+3) (i+1,i+2,i+3,i+5)
+};
+
+int insert_xratio_rmap(label* labels, size_t n_labels, uint32_t read_id, khash_t(qgramHash) *db, int bins, float* edges) {
+  int i, w, n, absent;
+  khint_t bin;
+  uint64_t key;
+  uint8_t strand;
+  uint16_t* xb = xratio_bins(labels, n_labels, edges, bins, &n);
+  uint8_t* codes = xratio_codes(labels, n_labels);
+  if(n - 4 > (1 << ANCHOR_TPOS_BITS))
+    fprintf(stderr, "Map %u has %zu labels, only seeds at the first %d are indexed\n", read_id + 1, n_labels, 1 << ANCHOR_TPOS_BITS);
+
+  // the skip windows of a reversed map are those of the forward map skipping the mirrored label, so
+  // canonical keys of these windows also cover the reversed map
+  for(i = 0; i + 4 < n && i < (1 << ANCHOR_TPOS_BITS); i++) {
+    for(w = 0; w < 5; w++) {
+      if(w > 0 && i + 5 >= n) break; // skip windows need one more label
+      // window w skips label i+w
+      key = xratio_canon(xb[xr_windows[w][0] * n + i + xr_windows[w][1]], xb[xr_windows[w][2] * n + i + xr_windows[w][3]], bins, codes, i, w, &strand);
+      bin = kh_put(qgramHash, db, key, &absent);
+      if(absent) { // bin is empty (unset)
+        kv_init(kh_value(db, bin));
       }
+      insert_pos(&kh_value(db, bin), read_id, i, strand);
     }
-    */
-  } // </for l in range(2)>
+  }
+  free(xb);
+  free(codes);
   return 0;
 }
 
-khash_t(matchHash)* lookup(label* labels, size_t n_labels, uint32_t read_id, int k, uint8_t rev, khash_t(qgramHash) *db, int max_qgrams, int bin_size) {
-  int i;
+void build_xratio_db(cmap c, khash_t(qgramHash) *db, int readLimit, int bins, float* edges) {
+  uint32_t f;
+  for(f = 0; f < c.n_maps; f++) {
+    insert_xratio_rmap(c.molecules[f].labels, c.molecules[f].n_labels, f, db, bins, edges);
+    if(readLimit > 0 && f + 1 >= readLimit) {
+      break;
+    }
+  }
+}
+
+/*
+ * LSD radix sort on a 64-bit key, 8 bits per pass
+ *
+ * buf must hold n elements; passes over bytes on which all keys agree are skipped, so sorting
+ * anchors costs one pass per byte actually spanned by the target ids and positions. The sort is
+ * stable, so elements with equal keys keep their order
+ */
+#define RADIX_SORT_INIT(name, type_t, key_of) \
+  void radix_sort_##name(type_t* a, type_t* buf, size_t n) { \
+    size_t i, count[256]; \
+    uint64_t all_or = 0, all_and = ~(uint64_t)0; \
+    type_t *src = a, *dst = buf, *tmp; \
+    int shift, d; \
+    for(i = 0; i < n; i++) { \
+      all_or |= key_of(a[i]); \
+      all_and &= key_of(a[i]); \
+    } \
+    for(shift = 0; shift < 64; shift += 8) { \
+      if((((all_or ^ all_and) >> shift) & 0xff) == 0) continue; /* every key has the same byte here */ \
+      memset(count, 0, sizeof(count)); \
+      for(i = 0; i < n; i++) count[(key_of(src[i]) >> shift) & 0xff]++; \
+      size_t sum = 0, c; \
+      for(d = 0; d < 256; d++) { \
+        c = count[d]; \
+        count[d] = sum; \
+        sum += c; \
+      } \
+      for(i = 0; i < n; i++) dst[count[(key_of(src[i]) >> shift) & 0xff]++] = src[i]; \
+      tmp = src; src = dst; dst = tmp; \
+    } \
+    if(src != a) memcpy(a, src, n * sizeof(type_t)); \
+  }
+
+#define u64_key(x) (x)
+#define probe_key(x) ((x).key)
+RADIX_SORT_INIT(u64, uint64_t, u64_key)
+RADIX_SORT_INIT(probe, probe, probe_key)
+
+// how many distinct q-grams ahead to prefetch hash buckets
+#define PROBE_PREFETCH 8
+
+static inline void prefetch_slot(seedIndex *idx, uint64_t key) {
+  __builtin_prefetch(&idx->slots[seed_slot_of(idx, key)]);
+}
+
+/*
+ * Looks up a batch of probes sorted by key and appends the resulting anchors to lb->hits
+ *
+ * Each distinct seed is probed once no matter how many query positions share it, and the buckets of
+ * upcoming seeds are prefetched while the current one is resolved. A position matches the forward
+ * molecule if it holds the key on the same strand as the probe, else the reversed molecule, where the seed
+ * starts at label qmirror - qpos; palindromic probes match both
+ */
+static void probe_db(probe *probes, size_t n, uint32_t qmirror, seedIndex *idx, int max_qgrams, lookupBuf *lb) {
+  size_t i, j, ahead = 0;
+  int m, o;
+  uint32_t qpos;
+  uint64_t s, qgram;
+  struct timespec t0, t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < n; i = j) {
+    qgram = probes[i].key;
+    for(j = i + 1; j < n && probes[j].key == qgram; j++);
+
+    // keep the prefetch window PROBE_PREFETCH distinct q-grams ahead
+    if(ahead < j) ahead = j;
+    for(m = 0; m < PROBE_PREFETCH && ahead < n; m++) {
+      prefetch_slot(idx, probes[ahead].key);
+      for(ahead++; ahead < n && probes[ahead].key == probes[ahead-1].key; ahead++);
+    }
+    lb->n_probes++;
+
+    for(s = seed_slot_of(idx, qgram); idx->slots[s].n > 0 && idx->slots[s].key != qgram; s = (s + 1) & idx->mask);
+    if(idx->slots[s].n == 0) // key not found
+      continue;
+    if(idx->slots[s].n > max_qgrams) { // repetitive, ignore it
+      continue;
+    }
+    readPos* matches = idx->pos + idx->slots[s].start;
+    for(; i < j; i++) {
+      for(m = 0; m < idx->slots[s].n; m++) {
+        for(o = 0; o <= 1; o++) {
+          if(probes[i].strand != STRAND_BOTH && o != ((probes[i].strand ^ matches[m].readNum) & 1)) continue;
+          qpos = o ? qmirror - probes[i].qpos : probes[i].qpos;
+          if(qpos > ANCHOR_MAX_QPOS) continue;
+          kv_push(uint64_t, lb->hits[o], anchor_key(matches[m].readNum>>1, matches[m].pos, qpos)); // >>1 removes the strand bit
+        }
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  lb->probe_secs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+// sorts packed keys and drops adjacent duplicates
+static void sort_unique(anchorVec *v, anchorVec *buf) {
+  size_t i, j, n = kv_size(*v);
+  if(n == 0) return;
+  if(buf->m < n) kv_resize(uint64_t, *buf, n);
+  radix_sort_u64(v->a, buf->a, n);
+  for(i = 0, j = 1; j < n; j++) {
+    if(v->a[j] != v->a[i]) v->a[++i] = v->a[j];
+  }
+  v->n = i + 1;
+}
+
+// sorts probes by key (stable, so each key's query positions stay in order)
+static void sort_probes(probeVec *v, probeVec *buf) {
+  if(kv_size(*v) == 0) return;
+  if(buf->m < kv_size(*v)) kv_resize(probe, *buf, kv_size(*v));
+  radix_sort_probe(v->a, buf->a, kv_size(*v));
+}
 
+void init_lookup_buf(lookupBuf *lb) {
+  kv_init(lb->hits[0]);
+  kv_init(lb->hits[1]);
+  kv_init(lb->probes);
+  kv_init(lb->buf);
+  kv_init(lb->probe_buf);
+  lb->n_probes = 0;
+  lb->probe_secs = 0;
+}
+
+void free_lookup_buf(lookupBuf *lb) {
+  kv_destroy(lb->hits[0]);
+  kv_destroy(lb->hits[1]);
+  kv_destroy(lb->probes);
+  kv_destroy(lb->buf);
+  kv_destroy(lb->probe_buf);
+}
+
+/*
+ * Collects all query/target anchors for one molecule, in both orientations, into lb->hits
+ *
+ * All 2^(k-1) jittered q-grams of the whole molecule are generated up front, sorted by key, then probed
+ * as one batch. The buffers in lb are cleared and reused; on return lb->hits[0] holds the anchors of the
+ * molecule as given and lb->hits[1] those of the reversed molecule (query positions counted from its other
+ * end), each sorted (grouped by target, then by target and query position) with duplicates removed
+ */
+void lookup(label* labels, size_t n_labels, uint32_t read_id, int k, seedIndex *idx, int max_qgrams, int bin_size, lookupBuf *lb) {
   // nick pos values are ints, rounded from the double in the bnx file, and may be 4 or 8 bytes long
   // they are related to the length of the whole fragment, so typically max out in the 100s of thousands (avg ~200k)
   // there is always a nick value given for the END of the fragment, but not one at 0
 
-  khash_t(matchHash) *hits = kh_init(matchHash); // allocate hash table
-  uint8_t* frags = get_fragments(labels, n_labels, bin_size, rev);
-  if(n_labels < k) return hits;
-  for(i = 0; i <= n_labels-k; i++) {
-    int skip;
-    //for(skip = 1; skip < k; skip++) {
-    //for(skip = 1; skip <= 1; skip++) {
-      int res = jitter_bins(frags, i, k, skip, db, hits, max_qgrams);
-    //}
+  lb->hits[0].n = 0;
+  lb->hits[1].n = 0;
+  lb->probes.n = 0;
+  if(n_labels < k) return;
+  uint16_t* frags = get_fragments(labels, n_labels, bin_size, qgram_max_bin(k));
+  int n = n_labels - k + 1; // seeds past ANCHOR_MAX_QPOS in either orientation are dropped by probe_db()
+  if(kv_max(lb->probes) < (size_t)n << (k-1)) kv_resize(probe, lb->probes, (size_t)n << (k-1));
+  lb->probes.n = get_seed_kernels(k).query(frags, labels, n, k, lb->probes.a);
+  free(frags);
+
+  sort_probes(&lb->probes, &lb->probe_buf);
+  probe_db(lb->probes.a, kv_size(lb->probes), n_labels - k, idx, max_qgrams, lb);
+  sort_unique(&lb->hits[0], &lb->buf);
+  sort_unique(&lb->hits[1], &lb->buf);
+}
+
+/*
+ * Collects all query/target anchors for one molecule from a cross-ratio index into lb->hits, as lookup()
+ *
+ * Query seeds are consecutive 5-label windows only (the reference carries the skip variants), and each
+ * ratio is also probed one bin lower so that ratios near a bin edge still meet; qpos is the window's first
+ * label, counted in the reversed molecule in lb->hits[1]
+ */
+void lookup_xratio(label* labels, size_t n_labels, seedIndex *idx, int max_qgrams, int bins, float* edges, lookupBuf *lb) {
+  int i, n, l;
+  uint16_t b1, b2;
+  probe p;
+
+  lb->hits[0].n = 0;
+  lb->hits[1].n = 0;
+  lb->probes.n = 0;
+  uint16_t* xb = xratio_bins(labels, n_labels, edges, bins, &n);
+  uint8_t* codes = xratio_codes(labels, n_labels);
+  for(i = 0; i + 4 < n; i++) {
+    for(l = 0; l < 4; l++) { // bit vector of which ratio to floor
+      b1 = xb[i];
+      b2 = xb[i+1];
+      if(((l & 1) && b1 == 0) || ((l & 2) && b2 == 0)) continue;
+      p.key = xratio_canon(b1 - (l & 1), b2 - (l >> 1 & 1), bins, codes, i, 0, &p.strand);
+      p.qpos = i;
+      kv_push(probe, lb->probes, p);
+    }
   }
+  free(xb);
+  free(codes);
 
-  return hits;
+  sort_probes(&lb->probes, &lb->probe_buf);
+  probe_db(lb->probes.a, kv_size(lb->probes), n - 5, idx, max_qgrams, lb);
+  sort_unique(&lb->hits[0], &lb->buf);
+  sort_unique(&lb->hits[1], &lb->buf);
 }
 
-void query_db(cmap b, int k, khash_t(qgramHash) *db, cmap c, FILE* o, int readLimit, int max_qgrams, int chain_threshold, float dtw_threshold, int bin_size, int min_labels, int start_mol, int end_mol) {
-  int i, j, l, a;
-  uint32_t target;
-  int max_chains = 10000000; // this can be a parameter
-  int max_alignments = 3; // this can be a parameter
+// position of label i of molecule m, or of label i of the reversed molecule (whose end marker is also last)
+static inline int oriented_pos(molecule* m, uint32_t i, int rev) {
+  int len = m->labels[m->n_labels-1].position;
+  if(!rev) return m->labels[i].position;
+  return i + 1 < m->n_labels ? len - (int)m->labels[m->n_labels-2-i].position : len;
+}
+
+#define MAX_ALIGNMENTS 3 // reported per molecule, this can be a parameter
+#define MAX_CHAINS 100 // best chains kept per query (and orientation) - each costs a DTW
+
+/*
+ * Seeds molecule f (m) against the index db, of the maps of a reference numbered from ref_offset, and adds
+ * the chains of each orientation qrev to top[qrev] (n_top[qrev] so far, see add_chains())
+ */
+static void seed_molecule(molecule* m, uint32_t f, int seed_mode, int k, seedIndex *db, float* xr_edges, uint32_t ref_offset, int max_qgrams, int chain_threshold, int bin_size, lookupBuf *lb, chain** top, int* n_top) {
+  int max_ref_chains = 20; // best chains kept per target
   int match_score = 4; // ? idk what to do with this
+  float gap_cost = 0.25; // per label skipped between chained anchors, on either query or target
   int max_gap = 50; // need to test/refine this
-  int min_chain_length = 3; // need to test/refine this
+  uint8_t qrev;
 
-  uint32_t f = start_mol;
-  //label* filtered_labels;
-  while (f <= end_mol) {
-    if(b.molecules[f].n_labels < min_labels) {f++; continue;}; // enforce minimum number of labels to attempt alignment
+  // ------ we do this kind of filtering in the simulation now ------
+  //filtered_labels = malloc(b.map_lengths[f] * sizeof(label));
+  //int n_filtered_labels = filter_labels(b.labels[f], b.map_lengths[f], filtered_labels, 500);
+  // one lookup finds the anchors of both orientations (seeds are canonical)
+  if(seed_mode == SEED_XRATIO)
+    lookup_xratio(m->labels, m->n_labels, db, max_qgrams, bin_size, xr_edges, lb);
+  else
+    lookup(m->labels, m->n_labels, f, k, db, max_qgrams, bin_size, lb);
+  //free(filtered_labels);
 
-    uint8_t qrev;
+  for(qrev = 0; qrev <= 1; qrev++) {
+    add_chains(lb->hits[qrev].a, kv_size(lb->hits[qrev]), ref_offset, MAX_CHAINS, max_ref_chains, match_score, gap_cost, max_gap, chain_threshold, top[qrev], &n_top[qrev]);
+  }
+}
 
-    kvec_t(result) alignments;
-    kv_init(alignments);
-    //result* alignments = malloc(max_chains * 2 * sizeof(result)); // we can actually get n_chains from each direction (fw/rv)
-    //a = 0;
+/*
+ * Scores the windows of the chains of molecule m found by seed_molecule() against the maps of c, and traces back the best
+ *
+ * top[qrev] holds MAX_CHAINS + 1 chains, n_top[qrev] of them kept. out gets up to MAX_ALIGNMENTS results, best
+ * first: each is an alignment to map aln.ref of c or, if its window scored below dtw_threshold, failed (with the
+ * window's score and an empty path) - one per candidate window, up to MAX_ALIGNMENTS. Returns how many
+ */
+static int align_chains(molecule* m, cmap c, chain** top, int* n_top, float dtw_threshold, result* out) {
+  int i, j, l, a;
+  uint32_t target;
+  uint8_t qrev;
+
+  // candidate windows from both orientations are scored (without traceback) before any is reported
+  kvec_t(dtw_task) tasks;
+  kv_init(tasks);
+  u32Vec win_ref, win_start; // target and first target label of each task's window
+  kv_init(win_ref);
+  kv_init(win_start);
+  // get fragment distances for DTW (no discretization)
+  uint32_t* qfrags = u32_get_fragments(m->labels, m->n_labels, 1, 0); // get the fw ordered fragments, the reversal will be handled by the DTW
+  uint8_t* qchan = get_channels(m->labels, m->n_labels);
+
+  fprintf(stderr, "# Hashing fragment of size %d with %d nicks\n", m->length, m->n_labels);
+
+  for(qrev = 0; qrev <= 1; qrev++) {
+
+    chain* chains = top[qrev];
+    sort_chains(chains, n_top[qrev], MAX_CHAINS);
+    int n_chains = n_top[qrev];
 
-    for(qrev = 0; qrev <= 1; qrev++) {
+    int* starts = malloc(n_chains * sizeof(int));
+    int* ends = malloc(n_chains * sizeof(int));
+    uint32_t* refs = malloc(n_chains * sizeof(uint32_t));
 
-      // ------ we do this kind of filtering in the simulation now ------
-      //filtered_labels = malloc(b.map_lengths[f] * sizeof(label));
-      //int n_filtered_labels = filter_labels(b.labels[f], b.map_lengths[f], filtered_labels, 500);
-      fprintf(stderr, "# Hashing fragment of size %d with %d nicks\n", b.molecules[f].length, b.molecules[f].n_labels);
-      khash_t(matchHash) *hits = lookup(b.molecules[f].labels, b.molecules[f].n_labels, f, k, qrev, db, max_qgrams, bin_size); // forward strand only right now
-      //khash_t(matchHash) *hits = lookup(filtered_labels, n_filtered_labels, f, k, qrev, db, max_qgrams, bin_size); // forward strand only right now
-      //free(filtered_labels);
+    /*
+    fprintf(stderr, "%d chains found with anchor sizes: ", n_chains);
+    for(i = 0; i < n_chains; i++) {
+      fprintf(stderr, "%d, ", chains[i].n_anchors);
+    }
+    fprintf(stderr, "\n");
+    */
 
-      chain* chains = do_chain(hits, max_chains, match_score, max_gap, min_chain_length);
-      int n_chains = 0;
-      // count chains (if fewer than max_chains, the chains array is terminated by an empty chain vector)
-      for(n_chains = 0; n_chains < max_chains && kv_size(chains[n_chains].anchors) > 0; n_chains++);
+    l = 0; // count of non-overlapping chains
+    int last; // index of the last range that was merged
+    for(j = 0; j < n_chains; j++) {
+      target = chains[j].ref; // the target is encoded in the chained score struct, do_chain() should have enforced that all chained anchors are from the same target
 
-      int* starts = malloc(n_chains * sizeof(int));
-      int* ends = malloc(n_chains * sizeof(int));
-      uint32_t* refs = malloc(n_chains * sizeof(uint32_t));
+      // dynamic time warping
+      // extract ref labels - expand bounds to encompass unmatched labels within query range
+      uint64_t first = chains[j].first;
+      uint64_t last_anchor = chains[j].last;
+      int rst = anchor_tpos(first);
+      // esimated start position on ref is (anchor[0]_ref_pos - anchor[0]_query_pos)
+      int est_rst = c.molecules[target].labels[rst].position - oriented_pos(m, anchor_qpos(first), qrev);
+      while(rst > 0 && c.molecules[target].labels[rst].position > est_rst)
+        rst--;
+      int ren = anchor_tpos(last_anchor);
+      // estimated end position on ref is (anchor[n]_ref_pos + (query_length - anchor[n]_query_pos))
+      int est_ren = c.molecules[target].labels[ren].position + (m->labels[m->n_labels-1].position - oriented_pos(m, anchor_qpos(last_anchor), qrev));
+      while(ren < c.molecules[target].n_labels-1 && c.molecules[target].labels[ren].position < est_ren)
+        ren++;
 
       /*
-      fprintf(stderr, "%d chains found with anchor sizes: ", n_chains);
-      for(i = 0; i < n_chains; i++) {
-        fprintf(stderr, "%d, ", kv_size(chains[i].anchors));
-      }
-      fprintf(stderr, "\n");
+      fprintf(stderr, "chain %d\n", j);
+      fprintf(stderr, "score %f\n", chains[j].score);
+      fprintf(stderr, "est ref pos %d - %d\n", est_rst, est_ren);
+      fprintf(stderr, "r indices %d - %d\n", rst, ren);
       */
 
-      l = 0; // count of non-overlapping chains
-      int last; // index of the last range that was merged
-      for(j = 0; j < n_chains; j++) {
-        if(kv_size(chains[j].anchors) < chain_threshold) continue;
-        target = chains[j].ref; // the target is encoded in the chained score struct, do_chain() should have enforced that all chained anchors are from the same target
-
-        // dynamic time warping
-        // extract ref labels - expand bounds to encompass unmatched labels within query range
-        int rst = kv_A(chains[j].anchors, 0).tpos;
-        // esimated start position on ref is (anchor[0]_ref_pos - anchor[0]_query_pos)
-        int est_rst = c.molecules[target].labels[rst].position - b.molecules[f].labels[kv_A(chains[j].anchors, 0).qpos].position;
-        while(rst > 0 && c.molecules[target].labels[rst].position > est_rst)
-          rst--;
-        int ren = kv_A(chains[j].anchors, kv_size(chains[j].anchors)-1).tpos;
-        // estimated end position on ref is (anchor[n]_ref_pos + (query_length - anchor[n]_query_pos))
-        int est_ren = c.molecules[target].labels[kv_A(chains[j].anchors, kv_size(chains[j].anchors)-1).tpos].position + (b.molecules[f].labels[b.molecules[f].n_labels-1].position - b.molecules[f].labels[kv_A(chains[j].anchors, kv_size(chains[j].anchors)-1).qpos].position);
-        while(ren < c.molecules[target].n_labels-1 && c.molecules[target].labels[ren].position < est_ren)
-          ren++;
-
-        /*
-        fprintf(stderr, "chain %d\n", j);
-        fprintf(stderr, "score %d\n", chains[j].score);
-        fprintf(stderr, "est ref pos %d - %d\n", est_rst, est_ren);
-        fprintf(stderr, "r indices %d - %d\n", rst, ren);
-        */
-
-        // loop through previous chain bounds and merge if they overlap
-        last = -1;
-        for(i = 0; i < l; i++) {
-          if(target == refs[i] && ((last > -1 && starts[last] <= ends[i] && ends[last] >= starts[i]) || (last == -1 && rst <= ends[i] && ren >= starts[i]))) {
-            if(last > -1) {
-              refs[last] = -1; // unset this one since it was merged down
-              starts[i] = starts[last] < starts[i] ? starts[last] : starts[i];
-              ends[i] = ends[last] > ends[i] ? ends[last] : ends[i];
-            } else {
-              starts[i] = rst < starts[i] ? rst : starts[i];
-              ends[i] = ren > ends[i] ? ren : ends[i];
-            }
-            // we can't stop here, we have to keep merging down
-            last = i;
-            //fprintf(stderr, "overlaps %d: %d-%d\n", refs[i], starts[i], ends[i]);
+      // loop through previous chain bounds and merge if they overlap
+      last = -1;
+      for(i = 0; i < l; i++) {
+        if(target == refs[i] && ((last > -1 && starts[last] <= ends[i] && ends[last] >= starts[i]) || (last == -1 && rst <= ends[i] && ren >= starts[i]))) {
+          if(last > -1) {
+            refs[last] = -1; // unset this one since it was merged down
+            starts[i] = starts[last] < starts[i] ? starts[last] : starts[i];
+            ends[i] = ends[last] > ends[i] ? ends[last] : ends[i];
+          } else {
+            starts[i] = rst < starts[i] ? rst : starts[i];
+            ends[i] = ren > ends[i] ? ren : ends[i];
           }
-        }
-        // didn't overlap any
-        if(last == -1) {
-          starts[i] = rst;
-          ends[i] = ren;
-          refs[i] = target;
-          l++;
-          //fprintf(stderr, "new %d: %d-%d\n", refs[i], starts[i], ends[i]);
+          // we can't stop here, we have to keep merging down
+          last = i;
+          //fprintf(stderr, "overlaps %d: %d-%d\n", refs[i], starts[i], ends[i]);
         }
       }
-      n_chains = l; // includes those that were merged overlaps (ref == -1)
-
-      for(j = 0; j < n_chains; j++) {
-        if(refs[j] == -1) continue; // merged down
-        // get fragment distances for DTW (no discretization)
-        uint32_t* qfrags = u32_get_fragments(b.molecules[f].labels, b.molecules[f].n_labels, 1, 0); // get the fw ordered fragments, the reversal will be handled by the DTW
-        uint32_t* rfrags = u32_get_fragments(c.molecules[refs[j]].labels+starts[j], ends[j]-starts[j]+1, 1, 0);
-        //fprintf(stderr, "running dtw for read %d to ref %u %u-%u (of %u)\n", f, refs[j], starts[j], ends[j], c.map_lengths[refs[j]]);
-        result aln = dtw(qfrags, rfrags, b.molecules[f].n_labels, ends[j]-starts[j]+1, -1, -1, 0.2, qrev); // ins_score, del_score, neutral_deviation
-        aln.tstart += starts[j];
-        aln.tend += starts[j];
-        aln.ref = refs[j];
-        //alignments[a++] = aln;
-        kv_push(result, alignments, aln);
-        free(qfrags);
-        free(rfrags);
-        if(aln.failed) {
-          //fprintf(stderr, "q %d : ref %d DTW failed -- this should never happen\n", f, refs[j]);
-          aln.score = -1; // to make sure it's sorted to the bottom
-          continue;
-        }
+      // didn't overlap any
+      if(last == -1) {
+        starts[i] = rst;
+        ends[i] = ren;
+        refs[i] = target;
+        l++;
+        //fprintf(stderr, "new %d: %d-%d\n", refs[i], starts[i], ends[i]);
       }
+    }
+    n_chains = l; // includes those that were merged overlaps (ref == -1)
 
-      free(starts);
-      free(ends);
-      free(refs);
-    } // </qrev>
-
+    for(j = 0; j < n_chains; j++) {
+      if(refs[j] == -1) continue; // merged down
+      dtw_task t;
+      t.query = qfrags;
+      t.qchan = qchan;
+      t.qlen = m->n_labels;
+      t.tlen = ends[j]-starts[j]+1;
+      t.target = u32_get_fragments(c.molecules[refs[j]].labels+starts[j], t.tlen, 1, 0);
+      t.tchan = get_channels(c.molecules[refs[j]].labels+starts[j], t.tlen);
+      t.rev = qrev;
+      kv_push(dtw_task, tasks, t);
+      kv_push(uint32_t, win_ref, refs[j]);
+      kv_push(uint32_t, win_start, starts[j]);
+    }
 
-    // sort alignments by (DTW) score decreasing
-    ks_mergesort(aln_cmp, kv_size(alignments), alignments.a, 0);
+    free(starts);
+    free(ends);
+    free(refs);
+  } // </qrev>
 
-    for(j = 0; j < (max_alignments < kv_size(alignments) ? max_alignments : kv_size(alignments)); j++) {
-      if(kv_A(alignments, j).failed || kv_A(alignments, j).score < dtw_threshold) {
-        fprintf(o, "%u\t-\t-\t-\t-\t%u\t-\t-\t%u\t-\t-\t-\t-\t-\t-\t-\t-\n", b.molecules[f].id, b.molecules[f].n_labels, b.molecules[f].length);
-        continue;
-      }
+  // windows that can reach neither the threshold nor the last reported score are abandoned early
+  dtw_batch(tasks.a, kv_size(tasks), -1, -1, 0.2, dtw_threshold, MAX_ALIGNMENTS); // ins_score, del_score, neutral_deviation, min_score, top_k
 
-      // print chain output only
-      /*
-      printf("%d,%d,%d,%d", f, qrev, target, kv_size(chains[j].anchors));
-      for(i = 0; i < kv_size(chains[j].anchors); i++)
-        printf(",%u(%u):%u(%u)", kv_A(chains[j].anchors, i).qpos, b.labels[f][kv_A(chains[j].anchors, i).qpos].position, kv_A(chains[j].anchors, i).tpos, c.labels[target][kv_A(chains[j].anchors, i).tpos].position);
-      printf("\n");
-      */
+  for(a = 0; a < MAX_ALIGNMENTS && a < kv_size(tasks); a++) {
+    // next best window, taking the earliest on ties
+    l = 0;
+    for(j = 1; j < kv_size(tasks); j++) {
+      if(kv_A(tasks, j).score > kv_A(tasks, l).score)
+        l = j;
+    }
+    dtw_task t = kv_A(tasks, l);
+    kv_A(tasks, l).score = -FLT_MAX; // taken
 
-      fprintf(o, "%u\t", b.molecules[f].id); // query id
-      fprintf(o, "%u\t", c.molecules[kv_A(alignments, j).ref].id); // target id
-      fprintf(o, "%u\t", qrev); // query reverse?
-      fprintf(o, "%u\t", kv_A(alignments, j).qstart); // query start idx
-      fprintf(o, "%u\t", kv_A(alignments, j).qend); // query end idx
-      fprintf(o, "%u\t", b.molecules[f].n_labels); // query len idx
-      fprintf(o, "%u\t", b.molecules[f].labels[kv_A(alignments, j).qstart].position); // query start
-      fprintf(o, "%u\t", b.molecules[f].labels[kv_A(alignments, j).qend-1].position); // query end
-      fprintf(o, "%u\t", b.molecules[f].length); // query len
-      fprintf(o, "%u\t", kv_A(alignments, j).tstart); // ref start idx
-      fprintf(o, "%u\t", kv_A(alignments, j).tend); // ref end idx
-      fprintf(o, "%u\t", c.molecules[kv_A(alignments, j).ref].n_labels); // ref len idx
-      fprintf(o, "%u\t", c.molecules[kv_A(alignments, j).ref].labels[kv_A(alignments, j).tstart].position); // ref start
-      fprintf(o, "%u\t", c.molecules[kv_A(alignments, j).ref].labels[kv_A(alignments, j).tend-1].position); // ref end
-      fprintf(o, "%u\t", c.molecules[kv_A(alignments, j).ref].length); // ref len
-      fprintf(o, "%f\t", kv_A(alignments, j).score); // dtw score
-      // dtw path
-      for(i = 0; i < kv_size(kv_A(alignments, j).path); i++) {
-        fprintf(o, "%c", kv_A(kv_A(alignments, j).path, i) == 0 ? '.' : (kv_A(kv_A(alignments, j).path, i) == 1 ? 'I' : 'D'));
-      }
-      fprintf(o, "\n");
+    if(t.score < dtw_threshold || t.qlen == 0 || t.tlen == 0) {
+      out[a].score = t.score;
+      out[a].failed = 1;
+      kv_init(out[a].path);
+      continue;
     }
 
+    // only reported alignments need the full matrices for a traceback
+    result aln = dtw(t.query, t.target, t.qchan, t.tchan, t.qlen, t.tlen, -1, -1, 0.2, t.rev);
+    aln.tstart += kv_A(win_start, l);
+    aln.tend += kv_A(win_start, l);
+    aln.ref = kv_A(win_ref, l);
+
+    // print chain output only
+    /*
+    printf("%d,%d,%d,%d", f, qrev, target, kv_size(chains[j].anchors));
+    for(i = 0; i < kv_size(chains[j].anchors); i++)
+      printf(",%u(%u):%u(%u)", kv_A(chains[j].anchors, i).qpos, b.labels[f][kv_A(chains[j].anchors, i).qpos].position, kv_A(chains[j].anchors, i).tpos, c.labels[target][kv_A(chains[j].anchors, i).tpos].position);
+    printf("\n");
+    */
+
+    out[a] = aln;
+  }
+
+  for(j = 0; j < kv_size(tasks); j++) {
+    free(kv_A(tasks, j).target);
+    free(kv_A(tasks, j).tchan);
+  }
+  kv_destroy(tasks);
+  kv_destroy(win_ref);
+  kv_destroy(win_start);
+  free(qfrags);
+  free(qchan);
+  return a;
+}
+
+/*
+ * Seeds, chains and scores molecule f (m) against the index db of the maps of c, and traces back its best
+ * windows into out (see align_chains()). Returns how many
+ */
+static int align_molecule(molecule* m, uint32_t f, int seed_mode, int k, seedIndex *db, float* xr_edges, cmap c, int max_qgrams, int chain_threshold, float dtw_threshold, int bin_size, lookupBuf *lb, result* out) {
+  chain* top[2] = {malloc((MAX_CHAINS + 1) * sizeof(chain)), malloc((MAX_CHAINS + 1) * sizeof(chain))};
+  int n_top[2] = {0, 0};
+  seed_molecule(m, f, seed_mode, k, db, xr_edges, 0, max_qgrams, chain_threshold, bin_size, lb, top, n_top);
+  int n = align_chains(m, c, top, n_top, dtw_threshold, out);
+  free(top[0]);
+  free(top[1]);
+  return n;
+}
+
+// writes a molecule's results from align_molecule() (failed ones as unaligned records) and frees them
+static void write_alignments(alnFile* o, molecule* m, cmap c, result* alns, int n) {
+  aln_rec rec; // output record, pointing into the reported alignment
+  int a;
+  for(a = 0; a < n; a++) {
+    if(alns[a].failed)
+      aln_set_unaligned(&rec, m);
+    else
+      aln_set(&rec, m, &c.molecules[alns[a].ref], &alns[a]);
+    aln_write(o, &rec);
+    kv_destroy(alns[a].path);
+  }
+}
+
+void query_db(cmap b, int seed_mode, int k, seedIndex *db, float* xr_edges, cmap c, alnFile* o, int readLimit, int max_qgrams, int chain_threshold, float dtw_threshold, int bin_size, int min_labels, int start_mol, int end_mol) {
+  lookupBuf lb; // reused across molecules
+  result alns[MAX_ALIGNMENTS];
+  int n;
+  init_lookup_buf(&lb);
+
+  uint32_t f = start_mol;
+  //label* filtered_labels;
+  while (f <= end_mol) {
+    if(b.molecules[f].n_labels < min_labels) {f++; continue;}; // enforce minimum number of labels to attempt alignment
+
+    n = align_molecule(&b.molecules[f], f, seed_mode, k, db, xr_edges, c, max_qgrams, chain_threshold, dtw_threshold, bin_size, &lb, alns);
+    write_alignments(o, &b.molecules[f], c, alns, n);
+
     if(readLimit > 0 && f >= readLimit) {
       break;
     }
 
     f++;
   }
+  fprintf(stderr, "# Probed %llu seeds in %.2f seconds (%.0f probes/s)\n", (unsigned long long)lb.n_probes, lb.probe_secs, lb.probe_secs > 0 ? lb.n_probes / lb.probe_secs : 0);
+  free_lookup_buf(&lb);
+}
+
+// builds the (unmasked) seed hash of the maps of c
+static khash_t(qgramHash)* build_db(cmap c, int seed_mode, int q, float* xr_edges, int readLimit, int bin_size, int resolution_min) {
+  khash_t(qgramHash) *db = kh_init(qgramHash);
+  if(seed_mode == SEED_XRATIO)
+    build_xratio_db(c, db, readLimit, bin_size, xr_edges);
+  else
+    build_hash_db(c, q, db, readLimit, bin_size, resolution_min);
+  return db;
+}
+
+/*
+ * Builds, masks and freezes the seed index of the maps of c, and sets cutoff to the most positions a
+ * remaining seed has (the max_qgrams to look it up with); NULL if it cannot be allocated
+ */
+static seedIndex* build_index(cmap c, int seed_mode, int q, float* xr_edges, int max_qgrams, float repeat_frac, int readLimit, int bin_size, int resolution_min, int placement, int* cutoff) {
+  khash_t(qgramHash) *db = build_db(c, seed_mode, q, xr_edges, readLimit, bin_size, resolution_min);
+  *cutoff = mask_repeats(db, repeat_frac, max_qgrams);
+  return freeze_hash_db(db, placement);
+}
+
+// estimated bytes of seed index per seed while it is built: khash buckets and position vectors, then the frozen arrays
+#define INDEX_SEED_BYTES 128
+
+// molecules aligned to every shard in turn before the next are (see query_shards())
+#define SHARD_BATCH 65536
+
+/*
+ * Splits the reference maps into runs whose seed index is estimated to fit in index_mem bytes, as shard
+ * boundaries: shard s is maps [bounds[s], bounds[s+1]). A map over the limit on its own is a shard by itself,
+ * and index_mem 0 is no limit; either way a shard has at most ANCHOR_MAX_TARGETS maps, as many as anchors
+ * can tell apart
+ */
+static void plan_shards(cmap c, int seed_mode, int q, int readLimit, size_t index_mem, u32Vec* bounds) {
+  uint32_t f, n_maps = readLimit > 0 && readLimit < c.n_maps ? readLimit : c.n_maps;
+  size_t seeds, bytes = 0;
+  kv_push(uint32_t, *bounds, 0);
+  for(f = 0; f < n_maps; f++) {
+    if(seed_mode == SEED_XRATIO)
+      seeds = c.molecules[f].n_labels * 5; // a consecutive and four skip windows per label
+    else
+      seeds = c.molecules[f].n_labels >= q ? c.molecules[f].n_labels - q + 1 : 0;
+    if((index_mem > 0 && bytes > 0 && bytes + seeds * INDEX_SEED_BYTES > index_mem) || f - kv_A(*bounds, kv_size(*bounds) - 1) == ANCHOR_MAX_TARGETS) {
+      kv_push(uint32_t, *bounds, f);
+      bytes = 0;
+    }
+    bytes += seeds * INDEX_SEED_BYTES;
+  }
+  kv_push(uint32_t, *bounds, n_maps);
+}
+
+// the maps of shard s (see plan_shards()), as a cmap of their own - targets in its index count from its first map
+static cmap shard_maps(cmap c, u32Vec* bounds, int s) {
+  cmap shard = c;
+  shard.molecules = c.molecules + kv_A(*bounds, s);
+  shard.n_maps = kv_A(*bounds, s+1) - kv_A(*bounds, s);
+  return shard;
+}
+
+// an unnamed temporary file under $TMPDIR (else /tmp), removed once it is closed; NULL if it cannot be created
+static FILE* temp_file() {
+  const char* tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+  char* path = malloc(strlen(tmpdir) + 24);
+  sprintf(path, "%s/rekit.XXXXXX", tmpdir);
+  FILE* fp = NULL;
+  int fd = mkstemp(path);
+  if(fd >= 0) {
+    unlink(path);
+    fp = fdopen(fd, "w+b");
+    if(fp == NULL) close(fd);
+  }
+  if(fp == NULL) fprintf(stderr, "Failed to create a temporary file in '%s'\n", tmpdir);
+  free(path);
+  return fp;
+}
+
+// a seed and its number of positions in one shard
+typedef struct {
+  uint64_t key;
+  uint32_t n;
+} seed_count;
+
+#define seed_count_key(x) ((x).key)
+RADIX_SORT_INIT(seed_count, seed_count, seed_count_key)
+
+// the next seed count of a shard's run, in a min-heap by key while the runs are merged
+typedef struct {
+  seed_count c;
+  int run;
+} count_head;
+
+#define count_head_gt(a,b) ((a).c.key > (b).c.key)
+KSORT_INIT(count_head, count_head, count_head_gt)
+
+typedef kvec_t(uint64_t) u64Vec;
+
+// seeds counted over all shards (see shard_repeats())
+typedef struct {
+  size_t* hist; // hist[c]: seeds with c positions
+  size_t max_occ, n_keys;
+  uint32_t cutoff;
+  u64Vec masked; // seeds with more than cutoff positions, in key order
+  size_t masked_pos;
+} seed_totals;
+
+static void count_total(uint64_t key, size_t n, seed_totals* t) {
+  if(n > t->max_occ) {
+    t->hist = realloc(t->hist, (n + 1) * sizeof(size_t));
+    memset(t->hist + t->max_occ + 1, 0, (n - t->max_occ) * sizeof(size_t));
+    t->max_occ = n;
+  }
+  t->hist[n]++;
+  t->n_keys++;
+}
+
+static void mask_total(uint64_t key, size_t n, seed_totals* t) {
+  if(n <= t->cutoff) return;
+  kv_push(uint64_t, t->masked, key);
+  t->masked_pos += n;
+}
+
+/*
+ * Merges the shards' runs of seed counts (each sorted by key) from their start, calling fn on the total
+ * positions of each seed, in key order
+ * Returns 0 if successful, else 1
+ */
+static int merge_counts(FILE** runs, int n_runs, void (*fn)(uint64_t, size_t, seed_totals*), seed_totals* t) {
+  count_head* heap = malloc(n_runs * sizeof(count_head));
+  int r, n = 0;
+  for(r = 0; r < n_runs; r++) {
+    rewind(runs[r]);
+    heap[n].run = r;
+    if(fread(&heap[n].c, sizeof(seed_count), 1, runs[r]) == 1) n++;
+  }
+  ks_heapmake(count_head, n, heap);
+
+  while(n > 0) {
+    uint64_t key = heap[0].c.key;
+    size_t total = 0;
+    while(n > 0 && heap[0].c.key == key) {
+      total += heap[0].c.n;
+      if(fread(&heap[0].c, sizeof(seed_count), 1, runs[heap[0].run]) != 1) heap[0] = heap[--n]; // run exhausted
+      ks_heapadjust(count_head, 0, n, heap);
+    }
+    fn(key, total, t);
+  }
+  free(heap);
+  for(r = 0; r < n_runs; r++) {
+    if(ferror(runs[r])) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Finds the repetitive seeds of a reference split into shards, exactly as mask_repeats() would in the index
+ * of all of it, without holding more than one shard's seeds: the seeds of each shard are counted into a
+ * temporary file, sorted by key, and these runs are merged once for the histogram of the seeds' total
+ * positions and again for the seeds over its cutoff, which go into masked
+ * Returns the cutoff (the max_qgrams to look seeds up with), or -1 if the counts could not be written
+ */
+static int shard_repeats(cmap c, u32Vec* bounds, int seed_mode, int q, float* xr_edges, float repeat_frac, int max_qgrams, int bin_size, int resolution_min, u64Vec* masked) {
+  int n_shards = kv_size(*bounds) - 1, s, ret = 0;
+  FILE** runs = calloc(n_shards, sizeof(FILE*));
+  kvec_t(seed_count) counts, buf;
+  kv_init(counts);
+  kv_init(buf);
+  seed_totals t;
+  memset(&t, 0, sizeof(seed_totals));
+  t.hist = calloc(1, sizeof(size_t));
+  khint_t bin;
+
+  for(s = 0; s < n_shards && ret == 0; s++) {
+    fprintf(stderr, "# Counting the seeds of shard %d of %d\n", s + 1, n_shards);
+    khash_t(qgramHash) *db = build_db(shard_maps(c, bounds, s), seed_mode, q, xr_edges, -1, bin_size, resolution_min);
+    kv_resize(seed_count, counts, kh_size(db));
+    kv_resize(seed_count, buf, kh_size(db));
+    counts.n = 0;
+    for(bin = kh_begin(db); bin != kh_end(db); bin++) {
+      if(!kh_exist(db, bin)) continue;
+      counts.a[counts.n].key = kh_key(db, bin);
+      counts.a[counts.n++].n = kv_size(kh_val(db, bin));
+    }
+    destroy_hash_db(db);
+    radix_sort_seed_count(counts.a, buf.a, counts.n);
+
+    runs[s] = temp_file();
+    if(runs[s] == NULL || fwrite(counts.a, sizeof(seed_count), counts.n, runs[s]) != counts.n || fflush(runs[s]) != 0) {
+      fprintf(stderr, "Failed to write the seed counts of shard %d to a temporary file\n", s + 1);
+      ret = 1;
+    }
+  }
+  kv_destroy(counts);
+  kv_destroy(buf);
+
+  if(ret == 0) ret = merge_counts(runs, n_shards, count_total, &t);
+  if(ret == 0) {
+    t.cutoff = t.n_keys > 0 ? repeat_cutoff(t.hist, t.max_occ, t.n_keys, repeat_frac, max_qgrams) : 0;
+    ret = merge_counts(runs, n_shards, mask_total, &t);
+  }
+  if(ret == 0 && t.n_keys > 0)
+    fprintf(stderr, "# Masked %zu repetitive seeds (%zu positions) of %zu, occurring over %u times\n", kv_size(t.masked), t.masked_pos, t.n_keys, t.cutoff);
+  else if(ret != 0)
+    fprintf(stderr, "Failed to read back the seed counts of the index shards\n");
+
+  for(s = 0; s < n_shards; s++) {
+    if(runs[s] != NULL) fclose(runs[s]);
+  }
+  free(runs);
+  free(t.hist);
+  *masked = t.masked;
+  return ret == 0 ? (int)t.cutoff : -1;
+}
+
+// removes the seeds of masked (from shard_repeats()) from db
+static void drop_seeds(khash_t(qgramHash) *db, u64Vec* masked) {
+  size_t i;
+  khint_t bin;
+  for(i = 0; i < kv_size(*masked); i++) {
+    bin = kh_get(qgramHash, db, kv_A(*masked, i));
+    if(bin == kh_end(db)) continue;
+    kv_destroy(kh_val(db, bin));
+    kh_del(qgramHash, db, bin);
+  }
+}
+
+/*
+ * Aligns molecules [start_mol, end_mol] to a reference whose index is split by map into shards (see
+ * plan_shards()), only one of which is in memory at a time, with the same results as the whole index
+ *
+ * Repeats are masked by their counts over all shards (see shard_repeats()). Molecules are then taken
+ * SHARD_BATCH at a time: each batch is seeded against every shard in turn, carrying each molecule's best
+ * chains from one shard to the next as chaining against the whole index would, and its windows are scored
+ * and written once all shards are done. The shard indexes are built for the first batch and, if there are
+ * more, written to temporary files and read back for each of them
+ * Returns 0 if successful, else 1
+ */
+static int query_shards(cmap b, cmap c, alnFile* o, int seed_mode, int q, float* xr_edges, u32Vec* bounds, int chain_threshold, float dtw_threshold, int max_qgrams, float repeat_frac, int bin_size, int resolution_min, int min_labels, uint32_t start_mol, uint32_t end_mol, int placement) {
+  int n_shards = kv_size(*bounds) - 1, s, n, r, ret = 0;
+  uint32_t f, batch, batch_end;
+  u64Vec masked;
+  int cutoff = shard_repeats(c, bounds, seed_mode, q, xr_edges, repeat_frac, max_qgrams, bin_size, resolution_min, &masked);
+  if(cutoff < 0) {
+    kv_destroy(masked);
+    return 1;
+  }
+
+  FILE** files = calloc(n_shards, sizeof(FILE*));
+  // the chains kept so far of each molecule of the batch in each orientation, exactly as many as there are
+  chain** kept = calloc((size_t)SHARD_BATCH * 2, sizeof(chain*));
+  int* n_kept = malloc((size_t)SHARD_BATCH * 2 * sizeof(int));
+  chain* top[2] = {malloc((MAX_CHAINS + 1) * sizeof(chain)), malloc((MAX_CHAINS + 1) * sizeof(chain))};
+  result alns[MAX_ALIGNMENTS];
+  lookupBuf lb; // reused across molecules and shards
+  init_lookup_buf(&lb);
+
+  for(batch = start_mol; batch <= end_mol && ret == 0; batch = batch_end + 1) {
+    batch_end = end_mol - batch >= SHARD_BATCH ? batch + SHARD_BATCH - 1 : end_mol;
+    memset(n_kept, 0, (size_t)SHARD_BATCH * 2 * sizeof(int));
+
+    for(s = 0; s < n_shards && ret == 0; s++) {
+      cmap shard = shard_maps(c, bounds, s);
+
+      seedIndex* idx;
+      if(batch == start_mol) {
+        fprintf(stderr, "# Hashing shard %d of %d: cmap fragments %u-%u\n", s + 1, n_shards, kv_A(*bounds, s) + 1, kv_A(*bounds, s+1));
+        khash_t(qgramHash) *db = build_db(shard, seed_mode, q, xr_edges, -1, bin_size, resolution_min);
+        drop_seeds(db, &masked);
+        idx = freeze_hash_db(db, placement);
+        if(idx != NULL && batch_end < end_mol) { // kept for the next batches
+          files[s] = temp_file();
+          if(files[s] == NULL || save_index(idx, files[s]) != 0) {
+            fprintf(stderr, "Failed to write index shard %d to a temporary file\n", s + 1);
+            ret = 1;
+          }
+        }
+      } else {
+        rewind(files[s]);
+        idx = load_index(files[s], placement);
+      }
+      if(idx == NULL) ret = 1;
+      if(ret != 0) {
+        destroy_index(idx);
+        break;
+      }
+
+      fprintf(stderr, "# Querying bnx fragments %u-%u against shard %d of %d\n", batch + 1, batch_end + 1, s + 1, n_shards);
+      for(f = batch; f <= batch_end; f++) {
+        if(b.molecules[f].n_labels < min_labels) continue;
+        chain** mk = kept + (size_t)(f - batch) * 2;
+        int* mn = n_kept + (size_t)(f - batch) * 2;
+        for(r = 0; r < 2; r++) memcpy(top[r], mk[r], mn[r] * sizeof(chain));
+        seed_molecule(&b.molecules[f], f, seed_mode, q, idx, xr_edges, kv_A(*bounds, s), cutoff, chain_threshold, bin_size, &lb, top, mn);
+        for(r = 0; r < 2; r++) {
+          mk[r] = realloc(mk[r], mn[r] * sizeof(chain));
+          memcpy(mk[r], top[r], mn[r] * sizeof(chain));
+        }
+      }
+      destroy_index(idx);
+    }
+
+    for(f = batch; f <= batch_end; f++) {
+      chain** mk = kept + (size_t)(f - batch) * 2;
+      int* mn = n_kept + (size_t)(f - batch) * 2;
+      if(ret == 0 && b.molecules[f].n_labels >= min_labels) {
+        for(r = 0; r < 2; r++) memcpy(top[r], mk[r], mn[r] * sizeof(chain));
+        n = align_chains(&b.molecules[f], c, top, mn, dtw_threshold, alns);
+        write_alignments(o, &b.molecules[f], c, alns, n);
+      }
+      for(r = 0; r < 2; r++) {
+        free(mk[r]);
+        mk[r] = NULL;
+      }
+    }
+  }
+  fprintf(stderr, "# Probed %llu seeds in %.2f seconds (%.0f probes/s)\n", (unsigned long long)lb.n_probes, lb.probe_secs, lb.probe_secs > 0 ? lb.n_probes / lb.probe_secs : 0);
+
+  for(s = 0; s < n_shards; s++) {
+    if(files[s] != NULL) fclose(files[s]);
+  }
+  free(files);
+  free(kept);
+  free(n_kept);
+  free(top[0]);
+  free(top[1]);
+  kv_destroy(masked);
+  free_lookup_buf(&lb);
+  return ret;
 }
 
 
 /*
  * readLimit: maximum reads to process for BOTH database and query
+ * index_mem: bytes the reference index may take, beyond which it is split into shards (see query_shards()); 0 for no limit
  */
-int hash_cmap(cmap b, cmap c, FILE* o, int q, int chain_threshold, float dtw_threshold, int max_qgrams, int readLimit, int bin_size, int resolution_min, int min_labels, int start_mol, int end_mol) {
+int hash_cmap(cmap b, cmap c, alnFile* o, int seed_mode, int q, int chain_threshold, float dtw_threshold, int max_qgrams, float repeat_frac, int readLimit, int bin_size, int resolution_min, int min_labels, int start_mol, int end_mol, int placement, size_t index_mem) {
 
   // ------------------------- Create hash database -----------------------------
 
   time_t t0 = time(NULL);
 
+  float* xr_edges = NULL;
+  if(seed_mode == SEED_XRATIO) {
+    xr_edges = xratio_edges(bin_size); // bin_size is the number of cross-ratio CDF bins in this mode
+  }
+
+  u32Vec bounds;
+  kv_init(bounds);
+  plan_shards(c, seed_mode, q, readLimit, index_mem, &bounds);
+  if(kv_size(bounds) > 2) {
+    if(index_mem > 0)
+      fprintf(stderr, "# Splitting %d cmap fragments into %zu index shards of up to ~%zu MB\n", c.n_maps, kv_size(bounds) - 1, index_mem >> 20);
+    else
+      fprintf(stderr, "# Splitting %d cmap fragments into %zu index shards of up to %d fragments\n", c.n_maps, kv_size(bounds) - 1, ANCHOR_MAX_TARGETS);
+    if(readLimit > 0 && readLimit < end_mol) end_mol = readLimit;
+    int ret = query_shards(b, c, o, seed_mode, q, xr_edges, &bounds, chain_threshold, dtw_threshold, max_qgrams, repeat_frac, bin_size, resolution_min, min_labels, start_mol, end_mol, placement);
+    fprintf(stderr, "# Hashed and queried in %d seconds\n", (int)(time(NULL)-t0));
+    kv_destroy(bounds);
+    free(xr_edges);
+    return ret;
+  }
+  kv_destroy(bounds);
+
   // read BNX file, construct hash, including only forward direction
   // -- maybe assess doing this the opposite way at a later date, I'm not sure which will be faster
-  khash_t(qgramHash) *db = kh_init(qgramHash);
-
-  fprintf(stderr, "# Hashing %d cmap fragments\n", c.n_maps);
-  build_hash_db(c, q, db, readLimit, bin_size, resolution_min);
+  if(seed_mode == SEED_XRATIO) {
+    fprintf(stderr, "# Hashing %d cmap fragments by cross-ratio (%d bins)\n", c.n_maps, bin_size);
+  } else {
+    fprintf(stderr, "# Hashing %d cmap fragments\n", c.n_maps);
+  }
+  seedIndex* idx = build_index(c, seed_mode, q, xr_edges, max_qgrams, repeat_frac, readLimit, bin_size, resolution_min, placement, &max_qgrams);
+  if(idx == NULL) {
+    free(xr_edges);
+    return 1;
+  }
 
   time_t t1 = time(NULL);
   fprintf(stderr, "# Hashed rmaps in %d seconds\n", (t1-t0));
@@ -419,13 +1495,13 @@ int hash_cmap(cmap b, cmap c, FILE* o, int q, int chain_threshold, float dtw_thr
 
   // ---------------------------- Look up queries in db ------------------------------
   fprintf(stderr, "# Querying %d bnx fragments\n", b.n_maps);
-  query_db(b, q, db, c, o, readLimit, max_qgrams, chain_threshold, dtw_threshold, bin_size, min_labels, start_mol, end_mol);
+  query_db(b, seed_mode, q, idx, xr_edges, c, o, readLimit, max_qgrams, chain_threshold, dtw_threshold, bin_size, min_labels, start_mol, end_mol);
 
   t1 = time(NULL);
   fprintf(stderr, "# Queried and output in %d seconds\n", (t1-t0));
   // ----------------------------------------------------------------------------------------
 
-  // TODO: clean up vectors in each hash bin
-  kh_destroy(qgramHash, db);
+  destroy_index(idx);
+  free(xr_edges);
   return 0;
 }
@@ -27,6 +27,8 @@
 #include "klib/khash.h" // C hash table/dictionary
 #include "klib/ksort.h"
 #include "cmap.h"
+#include "aln.h"
+#include "mem.h"
 
 #ifndef __HASH_H__
 #define __HASH_H__
@@ -34,7 +36,7 @@
 // MAXIMUM # READS = 2^31 (~2bn)
 typedef struct {
   uint32_t readNum; // last bit 0 if fw, 1 if rv (same as alternating fw/rv) [fw read n = n*2, rv read n = n*2+1]
-  // in practice, we only hash the fw strand, and do lookup by fw and rv, so right now these will always end in 0 (readNum%2 == 0)
+  // seeds are canonical, so this is the strand (STRAND_*) on which the read has the stored key
   uint32_t pos;
 } readPos;
 
@@ -47,31 +49,88 @@ typedef kvec_t(readPos) matchVec;
 
 typedef kvec_t(posPair) pairVec;
 
-// creates uint32(qgram hash):kvec<readNum,pos> hash
-KHASH_MAP_INIT_INT(qgramHash, matchVec);
+// packed query/target hit: target id (24 bits) | target label pos (24 bits) | query label pos (16 bits)
+// sorting these as plain integers groups anchors by target, then orders them by target and query position
+typedef kvec_t(uint64_t) anchorVec;
+
+#define ANCHOR_TPOS_BITS 24
+#define ANCHOR_QPOS_BITS 16
+#define ANCHOR_MAX_QPOS ((1 << ANCHOR_QPOS_BITS) - 1)
+#define ANCHOR_MAX_TARGETS (1 << (64 - ANCHOR_TPOS_BITS - ANCHOR_QPOS_BITS)) // targets one index can hold
+#define anchor_key(target, tpos, qpos) (((uint64_t)(target) << (ANCHOR_TPOS_BITS + ANCHOR_QPOS_BITS)) | ((uint64_t)(tpos) << ANCHOR_QPOS_BITS) | (uint64_t)(qpos))
+#define anchor_target(a) ((uint32_t)((a) >> (ANCHOR_TPOS_BITS + ANCHOR_QPOS_BITS)))
+#define anchor_tpos(a) ((uint32_t)((a) >> ANCHOR_QPOS_BITS) & ((1 << ANCHOR_TPOS_BITS) - 1))
+#define anchor_qpos(a) ((uint32_t)(a) & ANCHOR_MAX_QPOS)
+
+// creates uint64(seed key):kvec<readNum,pos> hash
+KHASH_MAP_INIT_INT64(qgramHash, matchVec);
+
+/*
+ * Read-only seed index, frozen from a qgramHash once it is built and masked (freeze_hash_db())
+ *
+ * An open-addressing table of seeds (linear probing, at most half full), each pointing at its run of
+ * positions in one shared array, in the order they were inserted. Both arrays are single mem_alloc() blocks,
+ * so they can be placed on huge pages and copied whole to another NUMA node (copy_index())
+ */
+typedef struct {
+  uint64_t key;
+  uint32_t start; // first position in seedIndex.pos
+  uint32_t n; // positions, 0 if the slot is empty
+} seed_slot;
+
+typedef struct {
+  seed_slot* slots;
+  uint64_t mask; // slots - 1, a power of 2 minus 1
+  readPos* pos;
+  size_t n_pos;
+  int placement; // MEM_* the arrays were allocated with
+} seedIndex;
+
+// slot a key is looked up from
+static inline uint64_t seed_slot_of(const seedIndex* idx, uint64_t key) {
+  key ^= key >> 33; // murmur3 finalizer - keys are not uniform (packed bins, see qgram_key())
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return key & idx->mask;
+}
+
+/*
+ * Seeds are canonical: the lesser of the key read forward and reversed is stored and looked up, with the
+ * strand it came from, so one lookup of a molecule finds anchors for both of its orientations
+ */
+#define STRAND_FW 0
+#define STRAND_RV 1
+#define STRAND_BOTH 2 // palindromic, the key is the same both ways
+
+#define canon_key(fkey, rkey) ((fkey) < (rkey) ? (fkey) : (rkey))
+
+static inline uint8_t seed_strand(uint64_t fkey, uint64_t rkey) {
+  return fkey < rkey ? STRAND_FW : (fkey > rkey ? STRAND_RV : STRAND_BOTH);
+}
 
 // creates uint32(target read id):kvec<qpos,tpos> hash
 KHASH_MAP_INIT_INT(matchHash, pairVec);
 
-static kh_inline khint_t xratio_hash(label* labels, int bins, int skip) {
-  //fprintf(stderr, "%d %d %d %d\n", labels[0].position, labels[1].position, labels[2].position, labels[3].position);
-  float cr;
-  if(skip == 1)
-    cr = (((float)labels[3].position - labels[0].position) * ((float)labels[4].position - labels[2].position)) / (((float)labels[3].position - labels[2].position) * ((float)labels[4].position - labels[0].position)); // cross-ratio
-  else if(skip == 2)
-    cr = (((float)labels[3].position - labels[0].position) * ((float)labels[4].position - labels[1].position)) / (((float)labels[3].position - labels[1].position) * ((float)labels[4].position - labels[0].position)); // cross-ratio
-  else if(skip == 3)
-    cr = (((float)labels[2].position - labels[0].position) * ((float)labels[4].position - labels[1].position)) / (((float)labels[2].position - labels[1].position) * ((float)labels[4].position - labels[0].position)); // cross-ratio
-  else if(skip == 4)
-    cr = (((float)labels[2].position - labels[0].position) * ((float)labels[3].position - labels[1].position)) / (((float)labels[2].position - labels[1].position) * ((float)labels[3].position - labels[0].position)); // cross-ratio
-  //fprintf(stderr, "x-ratio: %f\n", cr);
-  // cross-ratio CDF (per https://hal.inria.fr/inria-00590012/document), with some modifications
-  // since all of our points are in increasing order, they are actually modeled by only the F1 portion of the CDF
-  float crcdf = (1.0/2 + (cr*(1-cr)*log((cr-1)/cr) - cr + 1.0/2)) * 2;
-  khint_t h = (khint_t)(crcdf * bins + bins * (labels[skip < 4 ? 4 : 3].position - labels[0].position)/2000); // the number of bins used here will impact the accuracy signficantly
-  return h;
+// seed index modes
+#define SEED_QGRAM 0
+#define SEED_XRATIO 1
+
+// cross-ratio of four ordered positions a < b < c < d, always > 1 and invariant to uniform stretch (and to reversal,
+// so a window's two ratios simply swap when the map is reversed)
+static inline float xratio(float a, float b, float c, float d) {
+  return ((c - a) * (d - b)) / ((c - b) * (d - a));
+}
+
+// cross-ratio CDF (per https://hal.inria.fr/inria-00590012/document), with some modifications
+// since all of our points are in increasing order, they are actually modeled by only the F1 portion of the CDF
+// maps (1, inf) -> (0, 1)
+static inline double xratio_cdf(double cr) {
+  return (1.0/2 + (cr*(1-cr)*log1p(-1/cr) - cr + 1.0/2)) * 2; // log1p(-1/cr) == log((cr-1)/cr)
 }
 
+// cross-ratio seed key from the CDF bins of two consecutive cross-ratios
+#define xratio_key(b1, b2, bins) ((uint64_t)(b1) * (uint64_t)(bins) + (uint64_t)(b2))
+
 // similar to klib's khash.h, except we explicitly limit the length - it doesn't have to be null-terminated
 static kh_inline khint_t qgram_hash(uint8_t *s, int k, int skip, uint32_t l) {
   int i, j = 0;
@@ -87,8 +146,80 @@ static kh_inline khint_t qgram_hash(uint8_t *s, int k, int skip, uint32_t l) {
   return h;
 }
 
-int hash_cmap(cmap b, cmap c, FILE* o, int q, int chain_threshold, float dtw_threshold, int max_qgrams, int readLimit, int bin_size, int resolution_min, int min_labels, int start_mol, int end_mol);
+// q-gram seed keys are exact: k fragment size bins of qgram_bits(k) bits each (at most 12), packed into 64 bits
+#define QGRAM_MAX_BITS 12
+#define qgram_bits(k) (64 / (k) < QGRAM_MAX_BITS ? 64 / (k) : QGRAM_MAX_BITS)
+#define qgram_max_bin(k) ((1 << qgram_bits(k)) - 1)
+
+// packs k fragment bins (already saturated at qgram_max_bin(k), see get_fragments()) into a seed key
+// query-side jitter: l is a bit vector of the (first k-1) fragment sizes to floor by one bin, so that one
+// of the 2^(k-1) variants of a query q-gram meets the un-jittered reference q-gram; bins of 0 are not floored
+static kh_inline uint64_t qgram_key(uint16_t *s, int k, uint32_t l) {
+  int i, bits = qgram_bits(k);
+  uint64_t key = 0;
+  for (i = 0; i < k; i++) {
+    key = (key << bits) | (uint64_t)(s[i] - (l>>i & 1));
+  }
+  return key;
+}
+
+// qgram_key() of the same q-gram read in reverse, with the same jitter (l still indexes the forward fragments)
+static kh_inline uint64_t qgram_rkey(uint16_t *s, int k, uint32_t l) {
+  int i, bits = qgram_bits(k);
+  uint64_t key = 0;
+  for (i = k - 1; i >= 0; i--) {
+    key = (key << bits) | (uint64_t)(s[i] - (l>>i & 1));
+  }
+  return key;
+}
+
+// 2-bit code of a label channel for seed keys (the map end, channel 0, codes like channel 1)
+#define chan_code(ch) ((uint32_t)((ch) ? (ch) - 1 : 0) & 3)
+
+// mixes the channel codes of a seed's labels into its key; all-channel-1 seeds (single-channel data) keep
+// their exact key, others are a 64-bit mix of key and channels (there are no bits left to pack them)
+#define chan_key(key, sig) ((uint64_t)(key) + (uint64_t)(sig) * 0x9e3779b97f4a7c15ull)
+
+// a query seed to look up: its canonical key, the query label it starts at and the strand the key is read on
+typedef struct {
+  uint64_t key;
+  uint32_t qpos;
+  uint8_t strand;
+} probe;
+
+typedef kvec_t(probe) probeVec;
+
+// reusable per-molecule lookup buffers
+typedef struct {
+  anchorVec hits[2]; // packed anchors of the forward (0) and reversed (1) molecule, sorted and unique after lookup()
+  probeVec probes; // every jittered seed of the molecule, sorted by key after lookup()
+  anchorVec buf; // radix sort scratch
+  probeVec probe_buf; // radix sort scratch for probes
+  uint64_t n_probes; // distinct seeds looked up, across calls
+  double probe_secs; // time spent looking them up
+} lookupBuf;
+
+void build_hash_db(cmap c, int k, khash_t(qgramHash) *db, int readLimit, int bin_size, int resolution_min);
+void build_xratio_db(cmap c, khash_t(qgramHash) *db, int readLimit, int bins, float* edges);
+float* xratio_edges(int bins);
+void destroy_hash_db(khash_t(qgramHash) *db);
+uint32_t mask_repeats(khash_t(qgramHash) *db, float frac, int max_qgrams);
+seedIndex* freeze_hash_db(khash_t(qgramHash) *db, int placement);
+seedIndex* copy_index(const seedIndex *idx);
+void destroy_index(seedIndex *idx);
+int save_index(const seedIndex *idx, FILE* fp);
+seedIndex* load_index(FILE* fp, int placement);
+void lookup(label* labels, size_t n_labels, uint32_t read_id, int k, seedIndex *idx, int max_qgrams, int bin_size, lookupBuf *lb);
+void lookup_xratio(label* labels, size_t n_labels, seedIndex *idx, int max_qgrams, int bins, float* edges, lookupBuf *lb);
+void init_lookup_buf(lookupBuf *lb);
+void free_lookup_buf(lookupBuf *lb);
+
+int hash_cmap(cmap b, cmap c, alnFile* o, int seed_mode, int q, int chain_threshold, float dtw_threshold, int max_qgrams, float repeat_frac, int readLimit, int bin_size, int resolution_min, int min_labels, int start_mol, int end_mol, int placement, size_t index_mem);
+
+void radix_sort_u64(uint64_t* a, uint64_t* buf, size_t n);
+void radix_sort_probe(probe* a, probe* buf, size_t n);
 
 uint32_t* u32_get_fragments(label* labels, size_t n_labels, int bin_size, int rev);
+uint8_t* get_channels(label* labels, size_t n_labels);
 
 #endif /* __HASH_H__ */
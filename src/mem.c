@@ -0,0 +1,147 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE // pthread_setaffinity_np, CPU_SET
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "mem.h"
+
+static size_t round_huge(size_t size) {
+  return (size + MEM_HUGE_PAGE - 1) & ~(MEM_HUGE_PAGE - 1);
+}
+
+/*
+ * Anonymous memory of at least size bytes, starting on a huge page boundary, or NULL
+ * Pages are not touched here, so with MEM_THP the first touch of each 2Mb can fault in a huge page directly
+ */
+void* mem_alloc(size_t size, int placement) {
+  size_t len = round_huge(size > 0 ? size : 1);
+  void* p;
+
+#ifdef MAP_HUGETLB
+  if(placement == MEM_HUGETLB) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED) return p;
+    placement = MEM_THP; // no reserved huge pages (see /proc/sys/vm/nr_hugepages)
+  }
+#endif
+
+  // over-map by a huge page and trim both ends to align the start
+  uint8_t* raw = mmap(NULL, len + MEM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(raw == MAP_FAILED) return NULL;
+  uint8_t* start = (uint8_t*)(((uintptr_t)raw + MEM_HUGE_PAGE - 1) & ~(uintptr_t)(MEM_HUGE_PAGE - 1));
+  if(start > raw) munmap(raw, start - raw);
+  munmap(start + len, raw + MEM_HUGE_PAGE - start);
+
+#ifdef MADV_HUGEPAGE
+  if(placement == MEM_THP) madvise(start, len, MADV_HUGEPAGE); // advisory, THP may be disabled
+#endif
+  return start;
+}
+
+// frees a mem_alloc() block of the same size
+void mem_free(void* p, size_t size) {
+  if(p != NULL) munmap(p, round_huge(size > 0 ? size : 1));
+}
+
+// MEM_* from its option value (none, thp or hugetlb), -1 if unknown
+int parse_placement(const char* s) {
+  if(strcmp(s, "none") == 0) return MEM_PLAIN;
+  if(strcmp(s, "thp") == 0) return MEM_THP;
+  if(strcmp(s, "hugetlb") == 0) return MEM_HUGETLB;
+  return -1;
+}
+
+/*
+ * Reads a sysfs list of ranges like 0-15,32-47 from path, calling add(id, arg) for each ID in it
+ * Returns the number of IDs
+ */
+static int read_id_list(const char* path, void (*add)(int, void*), void* arg) {
+  char list[4096];
+  FILE* fp = fopen(path, "r");
+  if(fp == NULL) return 0;
+  if(fgets(list, sizeof(list), fp) == NULL) list[0] = '\0';
+  fclose(fp);
+
+  char* s = list;
+  int a, b, n = 0;
+  while(sscanf(s, "%d", &a) == 1) {
+    b = a;
+    while(*s >= '0' && *s <= '9') s++;
+    if(*s == '-') {
+      s++;
+      if(sscanf(s, "%d", &b) != 1) break;
+      while(*s >= '0' && *s <= '9') s++;
+    }
+    for(; a <= b; a++, n++) add(a, arg);
+    if(*s != ',') break;
+    s++;
+  }
+  return n;
+}
+
+// online node IDs, which need not be consecutive (nodes can be offline or absent)
+#define MAX_NUMA_NODES 1024
+static int node_ids[MAX_NUMA_NODES];
+static int n_node_ids = 0;
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+static void add_node(int id, void* arg) {
+  if(n_node_ids < MAX_NUMA_NODES) node_ids[n_node_ids++] = id;
+}
+
+static void read_nodes() {
+  read_id_list("/sys/devices/system/node/online", add_node, NULL);
+}
+
+int numa_nodes() {
+  pthread_once(&nodes_once, read_nodes);
+  return n_node_ids > 0 ? n_node_ids : 1;
+}
+
+static void add_cpu(int id, void* arg) {
+  if(id < CPU_SETSIZE) CPU_SET(id, (cpu_set_t*)arg);
+}
+
+/*
+ * Restricts the calling thread to the CPUs of the node-th online NUMA node (0 <= node < numa_nodes())
+ * Returns 0 if successful, else 1 (the thread is left as it was)
+ */
+int pin_to_node(int node) {
+  char path[64];
+  pthread_once(&nodes_once, read_nodes);
+  if(node < 0 || node >= n_node_ids) return 1;
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node_ids[node]);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int n_cpus = read_id_list(path, add_cpu, &set);
+  if(n_cpus == 0) return 1;
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0;
+}
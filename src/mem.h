@@ -0,0 +1,54 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stddef.h>
+
+#ifndef __MEM_H__
+#define __MEM_H__
+
+/*
+ * Placement of large read-only structures (the seed index)
+ *
+ * Random probes into an index much larger than the TLB reach of 4Kb pages spend much of their time in page
+ * walks, so index arrays are mapped on 2Mb boundaries and backed by huge pages where the system allows
+ */
+#define MEM_PLAIN 0 // ordinary pages
+#define MEM_THP 1 // transparent huge pages, requested with madvise(MADV_HUGEPAGE) (default)
+#define MEM_HUGETLB 2 // explicit huge pages (MAP_HUGETLB) from the reserved pool, falling back to THP if it is empty
+
+#define MEM_HUGE_PAGE (2UL << 20)
+
+void* mem_alloc(size_t size, int placement);
+void mem_free(void* p, size_t size);
+int parse_placement(const char* s);
+
+/*
+ * Online NUMA nodes, as listed in /sys/devices/system/node/online (1 if it cannot be read), and thread
+ * pinning to the CPUs of one, numbered 0..numa_nodes()-1 in that list - pages are placed on the node of the
+ * thread that first touches them, so a copy made by a pinned thread is local to its node
+ */
+int numa_nodes();
+int pin_to_node(int node);
+
+#endif /* __MEM_H__ */
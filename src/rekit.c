@@ -30,6 +30,7 @@
 #include <string.h>
 #include <time.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include "cmap.h"
 #include "bnx.h"
@@ -39,6 +40,10 @@
 #include "digest.h"
 #include "bam.h"
 #include "dtw.h"
+#include "cpu.h"
+#include "assemble.h"
+#include "aln.h"
+#include "sv.h"
 
 void usage() {
   printf("Usage: rekit [command] [options]\n");
@@ -48,24 +53,38 @@ void usage() {
   printf("  simulate: simulate molecules\n");
   printf("  digest:   in silico digestion\n");
   printf("  label:    produce alignment-based reference CMAP\n");
+  printf("  assemble: assemble BNX molecules into consensus CMAP\n");
+  printf("  sv:       call structural variants from alignments of BNX molecules to reference CMAP\n");
+  printf("  sort:     sort alignments by reference and position\n");
+  printf("  view:     convert alignments between text and binary, optionally only those in a region\n");
+  printf("  index:    build the molecule index (.idx) of a BNX or region index (.idx) of sorted alignments, and the block index (.gzi) if it is BGZF-compressed\n");
   printf("Options:\n");
-  printf("  align    -bc\n");
-  printf("  dtw      -bc\n");
-  printf("  simulate -frx --break-rate --fn --fp --min-frag --stretch-mean --stretch-std --source-output\n");
-  printf("  digest   -fr\n");
+  printf("  align    -bc --binary\n");
+  printf("  dtw      -bc --binary\n");
+  printf("  simulate -frx or -cx, --break-rate --fn --fp --min-frag --stretch-mean --stretch-std --source-output --digest-cache\n");
+  printf("  digest   -fr --digest-cache\n");
   printf("  label    -a\n");
+  printf("  assemble -b\n");
+  printf("  sv       -bc --alignments\n");
+  printf("  sort     --alignments --binary\n");
+  printf("  view     --alignments --region --binary\n");
+  printf("  index    -b, -c or --alignments\n");
+  printf("  --version: Print the build and the SIMD kernel variants chosen for this CPU\n");
   printf("    -b: bnx: A single BNX file containing molecules\n");
   printf("    -c: cmap: A single CMAP file\n");
   printf("    -f: fasta: Reference sequence to simulate from\n");
   printf("    -a: bam: BAM alignment file\n");
-  printf("    -r: cutseq: Recognition/label site sequence\n");
+  printf("    -r: cutseq: Recognition/label site sequence, comma-separated for multiple label channels\n");
   printf("    -q: Size of q-gram/k-mer to hash (default: 4)\n");
   printf("    -h: Number of hash functions to apply\n");
   //printf("    -e: Seed to random number generator\n");
   printf("    -t: Minimum number of q-gram/cross-ratio anchors in a chain (default: 1)\n");
-  printf("    -m: max_qgram_hits: Maximum occurrences of a q-gram before it is considered repetitive and ignored\n");
+  printf("    -m: max_qgram_hits: Maximum occurrences of a q-gram before it is considered repetitive and ignored (default: no limit besides --repeat-frac)\n");
   printf("    -d: DTW score threshold to report alignment (default: 5)\n");
   printf("    -x: Simulated molecule coverage\n");
+  printf("    -z: Write BGZF-compressed BNX/CMAP output\n");
+  printf("    --threads: Threads for BGZF compression/decompression, CMAP parsing and assembly (default: 1)\n");
+  printf("  BNX and CMAP inputs may be plain text, gzip or BGZF\n");
   printf("  simulate options:\n");
   printf("    --break-rate: Probability of genome fragmentation per locus (default: 0.000005)\n");
   printf("    --fn: Probability of missed label at true restriction site (default: 0.09893)\n");
@@ -74,12 +93,61 @@ void usage() {
   printf("    --stretch-std: Fragment stretch standard deviation (default: 0.033733)\n");
   printf("    --min-frag: Minimum detectable fragment size (default: 500)\n");
   printf("    -s, --source-output: Output the reference positions of the simulated molecules to the given file\n");
+  printf("    -c: Simulate from the label sites of a reference CMAP (e.g. from digest), with its recognition sequences, instead of -f and -r\n");
+  printf("    --digest-cache: Directory to keep FASTA digests in, keyed by FASTA checksum and recognition sequences, for simulate and digest to reuse\n");
   printf("  label options:\n");
   printf("    --coverage-threshold: Read coverage required (in ~300bp window) to call a label site (default: 10)\n");
   printf("  align options:\n");
   printf("    --min-labels: Minimum molecule labels to align\n");
-  printf("    --start-mol: Molecule ID to start at (for multithreading)\n");
-  printf("    --end-mol: Molecule ID to end at (inclusive)\n");
+  printf("    --start-mol: Molecule number (1-based, in file order) to start at, for sharding - seeks through the .idx molecule index\n");
+  printf("    --end-mol: Molecule number to end at (inclusive)\n");
+  printf("    --seed: Seed index type, qgram or cross-ratio (default: qgram)\n");
+  printf("    --bin-size: Fragment size bin (qgram) or number of cross-ratio bins (cross-ratio) (default: 100)\n");
+  printf("    --repeat-frac: Fraction of the most frequent distinct seeds to mask from the index as repeats, 0 for none (default: 0.0002)\n");
+  printf("    --huge-pages: Seed index pages: none, thp (transparent huge pages) or hugetlb (reserved huge pages, else thp) (default: thp)\n");
+  printf("    --index-mem: Memory for the reference index in MB, beyond which it is split by reference map into shards on disk (in $TMPDIR) that are aligned to in turn (default: 0, no limit)\n");
+  printf("  assemble options (and --min-labels, --seed, --bin-size, --repeat-frac, --huge-pages, -q, -t, -m, -d as for align):\n");
+  printf("    --min-coverage: Minimum molecules observing a consensus label to keep it (default: 2)\n");
+  printf("    --numa: Copy the overlap index to every NUMA node and pin each thread to a node, to probe its local copy\n");
+  printf("  sv options (and the align options, if --alignments is not given):\n");
+  printf("    --alignments: Alignments (text or binary) sorted by rekit sort, - for stdin (default: align the BNX first)\n");
+  printf("    --min-support: Minimum molecules supporting a structural variant call (default: 3)\n");
+  printf("    --min-sv-size: Minimum insertion/deletion size in bp (default: 1500)\n");
+  printf("  alignment options:\n");
+  printf("    --alignments: Alignment file to sort, view or index (text or binary), - for stdin\n");
+  printf("    --binary: Write binary alignments instead of text (with -z, BGZF-compressed)\n");
+  printf("    --region: Only view alignments overlapping <ref_id>[:<start>-<end>], through the region index of a sorted file\n");
+}
+
+#ifndef REKIT_VERSION
+#define REKIT_VERSION "unknown" // set by the Makefile from git
+#endif
+
+// the build and the kernel variants picked for this CPU
+static void version() {
+  printf("rekit %s\n", REKIT_VERSION);
+  printf("cpu: %s\n", cpu_level_name(cpu_level()));
+  printf("dtw: %s, %d lanes\n", dtw_variant(), dtw_batch_lanes());
+}
+
+// splits a comma-separated list of recognition sequences (one per label channel), resolving enzyme names
+static char** parse_motifs(char* seqs, size_t* n_motifs) {
+  char** motifs = NULL;
+  char* tok;
+  *n_motifs = 0;
+  for(tok = strtok(strdup(seqs), ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if(strcmp(tok, "DLE1") == 0 || strcmp(tok, "DLE-1") == 0) {
+      fprintf(stderr, "setting recognition seq to CTTAAG\n");
+      tok = "CTTAAG";
+    }
+    motifs = realloc(motifs, (*n_motifs + 1) * sizeof(char*));
+    motifs[(*n_motifs)++] = tok;
+  }
+  if(*n_motifs > MAX_CHANNELS) {
+    fprintf(stderr, "At most %d recognition sequences (label channels) are supported\n", MAX_CHANNELS);
+    *n_motifs = 0;
+  }
+  return motifs;
 }
 
 static struct option long_options[] = {
@@ -97,6 +165,20 @@ static struct option long_options[] = {
   { "min-labels",             required_argument, 0, 0 },
   { "start-mol",              required_argument, 0, 0 },
   { "end-mol",                required_argument, 0, 0 },
+  { "seed",                   required_argument, 0, 0 },
+  { "threads",                required_argument, 0, 0 },
+  { "min-coverage",           required_argument, 0, 0 },
+  { "alignments",             required_argument, 0, 0 },
+  { "min-support",            required_argument, 0, 0 },
+  { "min-sv-size",            required_argument, 0, 0 },
+  { "binary",                 no_argument,       0, 0 },
+  { "region",                 required_argument, 0, 0 },
+  { "repeat-frac",            required_argument, 0, 0 },
+  { "version",                no_argument,       0, 0 },
+  { "huge-pages",             required_argument, 0, 0 },
+  { "numa",                   no_argument,       0, 0 },
+  { "digest-cache",           required_argument, 0, 0 },
+  { "index-mem",              required_argument, 0, 0 },
   { 0, 0, 0, 0}
 };
 
@@ -109,18 +191,32 @@ int main(int argc, char *argv[]) {
   char* bam_file = NULL; // .bam file path/name (aligned)
   char* restriction_seq = NULL; // restriction enzyme or label recognition sequence (must also be reverse complemented if not symmetrical)
   char* source_outfile = NULL; // output file for the truth/source positions
+  char* alignment_file = NULL; // alignments to sort, view, index or call structural variants from
+  char* region = NULL; // <ref_id>[:<start>-<end>] of alignments to view
+  char* digest_cache = NULL; // directory of cached FASTA digests
   int q = 5; // q-gram size (set to 5 to make sure when we go to hash we have 5 to make sets of 4-mers with each missing)
   int h = 10; // number of hashes
   int verbose = 0;
   int chain_threshold = 1;
   float dtw_threshold = 5;
   int seed = 0; // made this up
-  int max_qgrams = 2000000000; // made this up
+  int max_qgrams = 2000000000; // -m, a fixed cap on seed occurrences besides the automatic cutoff (--repeat-frac)
+  float repeat_frac = 0.0002; // fraction of the most frequent distinct seeds to mask as repeats
   int bin_size = 100; // # bins that x-ratios will be spread across, or divisor for fragment size binning
   int read_limit = -1; // just for testing
   int min_labels = 11; // a parameter, and this works well in practice
+  int compress = 0; // write BGZF instead of plain text
+  int binary = 0; // write binary alignments instead of text
   int start_mol = 0;
   int end_mol = -1;
+  int seed_mode = SEED_QGRAM;
+  int threads = 1;
+  int min_coverage = 2; // molecules supporting a consensus label
+  int min_support = 3; // molecules supporting a structural variant
+  int min_sv_size = 1500;
+  int placement = MEM_THP; // seed index pages
+  int numa = 0; // replicate the seed index per NUMA node (assembly workers)
+  size_t index_mem = 0; // reference index memory before it is split into shards, 0 for no limit
 
   float coverage = 0.0;
   int covg_threshold = 10;
@@ -133,7 +229,7 @@ int main(int argc, char *argv[]) {
 
   int opt, long_idx;
   opterr = 0;
-  while ((opt = getopt_long(argc, argv, "b:c:q:hf:r:t:m:vx:a:s:d:", long_options, &long_idx)) != -1) {
+  while ((opt = getopt_long(argc, argv, "b:c:q:hf:r:t:m:vx:a:s:d:z", long_options, &long_idx)) != -1) {
     switch (opt) {
       case 'b':
         bnx_file = optarg;
@@ -157,6 +253,9 @@ int main(int argc, char *argv[]) {
       case 't':
         chain_threshold = atoi(optarg);
         break;
+      case 'm':
+        max_qgrams = atoi(optarg);
+        break;
       case 'd':
         dtw_threshold = atof(optarg);
         break;
@@ -172,6 +271,9 @@ int main(int argc, char *argv[]) {
       case 's':
         source_outfile = optarg;
         break;
+      case 'z':
+        compress = 1;
+        break;
       case '?':
         if (optopt == 'b' || optopt == 'c' || optopt == 'q' || optopt == 'r' || optopt == 'f' || optopt == 't' || optopt == 'm' || optopt == 'x' || optopt == 'a' || optopt == 's')
           fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -195,6 +297,36 @@ int main(int argc, char *argv[]) {
         else if (long_idx == 10) min_labels = atoi(optarg); // --min-labels
         else if (long_idx == 11) start_mol = atoi(optarg)-1; // --start-mol, decrement to make it match 0-based indices instead of 1-based in BNX
         else if (long_idx == 12) end_mol = atoi(optarg)-1; // --end-mol
+        else if (long_idx == 13) { // --seed
+          if(strcmp(optarg, "qgram") == 0) seed_mode = SEED_QGRAM;
+          else if(strcmp(optarg, "cross-ratio") == 0) seed_mode = SEED_XRATIO;
+          else {
+            fprintf(stderr, "Unknown seed mode '%s' (expected qgram or cross-ratio)\n", optarg);
+            return 1;
+          }
+        }
+        else if (long_idx == 14) { // --threads
+          threads = atoi(optarg);
+          set_io_threads(threads);
+        }
+        else if (long_idx == 15) min_coverage = atoi(optarg); // --min-coverage
+        else if (long_idx == 16) alignment_file = optarg; // --alignments
+        else if (long_idx == 17) min_support = atoi(optarg); // --min-support
+        else if (long_idx == 18) min_sv_size = atoi(optarg); // --min-sv-size
+        else if (long_idx == 19) binary = 1; // --binary
+        else if (long_idx == 20) region = optarg; // --region
+        else if (long_idx == 21) repeat_frac = atof(optarg); // --repeat-frac
+        else if (long_idx == 22) {version(); return 0;} // --version
+        else if (long_idx == 23) { // --huge-pages
+          placement = parse_placement(optarg);
+          if(placement < 0) {
+            fprintf(stderr, "Unknown huge page mode '%s' (expected none, thp or hugetlb)\n", optarg);
+            return 1;
+          }
+        }
+        else if (long_idx == 24) numa = 1; // --numa
+        else if (long_idx == 25) digest_cache = optarg; // --digest-cache
+        else if (long_idx == 26) index_mem = (size_t)atol(optarg) << 20; // --index-mem, in MB
         break;
       default:
         usage();
@@ -234,16 +366,14 @@ int main(int argc, char *argv[]) {
       return 1;
     } else {
       fprintf(stderr, "recognition seq is '%s'\n", restriction_seq);
-      if(strcmp(restriction_seq, "DLE1") == 0 || strcmp(restriction_seq, "DLE-1") == 0) {
-        fprintf(stderr, "setting recognition seq to CTTAAG\n");
-        restriction_seq = "CTTAAG";
-      }
     }
     // make a list of restriction seqs - that's what digest wants
-    char** rseqs = malloc(1 * sizeof(char*));
-    rseqs[0] = restriction_seq;
-    c = digest_fasta(fasta_file, rseqs, 1);
-    ret = write_cmap(&c, stdout);
+    size_t n_rseqs;
+    char** rseqs = parse_motifs(restriction_seq, &n_rseqs);
+    if(n_rseqs == 0) return 1;
+    c = digest_fasta_cached(fasta_file, rseqs, n_rseqs, digest_cache);
+    BGZF* out = open_map_file("-", compress ? "w" : "wu");
+    ret = out == NULL || (write_cmap(&c, out) | bgzf_close(out));
   }
 
   if(strcmp(command, "label") == 0) {
@@ -253,7 +383,26 @@ int main(int argc, char *argv[]) {
       return 1;
     }
     c = get_cmap_from_bam(bam_file, covg_threshold);
-    ret = write_cmap(&c, stdout);
+    BGZF* out = open_map_file("-", compress ? "w" : "wu");
+    ret = out == NULL || (write_cmap(&c, out) | bgzf_close(out));
+  }
+
+  else if(strcmp(command, "index") == 0) {
+    if(bnx_file == NULL && cmap_file == NULL && alignment_file == NULL) {
+      fprintf(stderr, "BNX (-b), CMAP (-c) or alignment (--alignments) file required\n");
+      return 1;
+    }
+    if(alignment_file != NULL) ret = index_alignments(alignment_file);
+    else ret = bnx_file != NULL ? index_bnx(bnx_file) : index_bgzf(cmap_file);
+  }
+
+  else if(strcmp(command, "sort") == 0 || strcmp(command, "view") == 0) {
+    if(alignment_file == NULL) {
+      fprintf(stderr, "Alignment file (--alignments) required\n");
+      return 1;
+    }
+    if(strcmp(command, "sort") == 0) ret = sort_alignments(alignment_file, "-", binary, compress);
+    else ret = view_alignments(alignment_file, region, binary, compress);
   }
 
   else if(strcmp(command, "align") == 0 || strcmp(command, "dtw") == 0) {
@@ -265,16 +414,17 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "CMAP file (-c) required\n");
       return 1;
     }
-    FILE* o = stdout;
+    alnFile* o = aln_open("-", compress ? "w" : "wu", binary);
+    if(o == NULL) return 1;
 
     fprintf(stderr, "# Loading '%s'...\n", bnx_file);
     time_t t0 = time(NULL);
-    cmap b = read_bnx(bnx_file);
+    // only the requested molecule range is read, so from here on molecules are numbered within it
+    cmap b = read_bnx_range(bnx_file, start_mol, end_mol);
     time_t t1 = time(NULL);
     fprintf(stderr, "# Loaded %d molecules in %.2f seconds\n", b.n_maps, (t1-t0));
-    if(end_mol == -1) {
-      end_mol = b.n_maps;
-    }
+    start_mol = 0;
+    end_mol = b.n_maps - 1; // inclusive
 
     fprintf(stderr, "# Loading '%s'...\n", cmap_file);
     t0 = time(NULL);
@@ -282,92 +432,195 @@ int main(int argc, char *argv[]) {
     t1 = time(NULL);
     fprintf(stderr, "# Loaded CMAP '%s': %d maps w/%d recognition sites in %.2f seconds\n", cmap_file, c.n_maps, c.n_rec_seqs, t1-t0);
 
-    int ret;
     if(strcmp(command, "align") == 0)
-      ret = hash_cmap(b, c, o, q, chain_threshold, dtw_threshold, max_qgrams, read_limit, bin_size, min_frag, min_labels, start_mol, end_mol);
+      ret = hash_cmap(b, c, o, seed_mode, q, chain_threshold, dtw_threshold, max_qgrams, repeat_frac, read_limit, bin_size, min_frag, min_labels, start_mol, end_mol, placement, index_mem);
     else { // dtw
 
       int q, r, rv, a;
       result aln;
+      aln_rec rec;
+      // reference fragments are the same for every query
+      uint32_t** rfrags = malloc(c.n_maps * sizeof(uint32_t*));
+      uint8_t** rchan = malloc(c.n_maps * sizeof(uint8_t*));
+      for(r = 0; r < c.n_maps; r++) {
+        rfrags[r] = u32_get_fragments(c.molecules[r].labels, c.molecules[r].n_labels, 1, 0);
+        rchan[r] = get_channels(c.molecules[r].labels, c.molecules[r].n_labels);
+      }
+      dtw_task* tasks = malloc(c.n_maps * 2 * sizeof(dtw_task));
+      result* alignments = malloc(c.n_maps * 2 * sizeof(result));
+
       for(q = start_mol; q <= end_mol; q++) {
         if(b.molecules[q].n_labels < min_labels) continue; // enforce minimum molecule labels
-        result* alignments = malloc(c.n_maps * 2 * sizeof(result));
         uint32_t* qfrags = u32_get_fragments(b.molecules[q].labels, b.molecules[q].n_labels, 1, 0); // 1 is bin_size (no discretization)
+        uint8_t* qchan = get_channels(b.molecules[q].labels, b.molecules[q].n_labels);
+
+        // score every reference and strand in SIMD batches, then trace back only those that will be reported
         for(r = 0; r < c.n_maps; r++) {
-          uint32_t* rfrags = u32_get_fragments(c.molecules[r].labels, c.molecules[r].n_labels, 1, 0);
           for(rv = 0; rv <= 1; rv++) {
-            aln = dtw(qfrags, rfrags, b.molecules[q].n_labels, c.molecules[r].n_labels, -1, -1, 0.2, rv); // ins_score, del_score, neutral_deviation
-            aln.ref = r;
-            if(aln.failed) {
-              fprintf(stderr, "Alignment failed of query %d to ref %d\n", q, r);
-            }
-            alignments[r + rv*c.n_maps] = aln;
+            dtw_task* t = &tasks[r + rv*c.n_maps];
+            t->query = qfrags;
+            t->target = rfrags[r];
+            t->qchan = qchan;
+            t->tchan = rchan[r];
+            t->qlen = b.molecules[q].n_labels;
+            t->tlen = c.molecules[r].n_labels;
+            t->rev = rv;
+          }
+        }
+        dtw_batch(tasks, c.n_maps * 2, -1, -1, 0.2, dtw_threshold, 0); // ins_score, del_score, neutral_deviation, min_score, top_k
+
+        a = 0;
+        for(r = 0; r < c.n_maps * 2; r++) {
+          if(tasks[r].score < dtw_threshold) continue;
+          aln = dtw(qfrags, tasks[r].target, qchan, tasks[r].tchan, tasks[r].qlen, tasks[r].tlen, -1, -1, 0.2, tasks[r].rev);
+          aln.ref = r % c.n_maps;
+          if(aln.failed) {
+            fprintf(stderr, "Alignment failed of query %d to ref %d\n", q, aln.ref);
+            continue;
           }
+          alignments[a++] = aln;
         }
+        free(qfrags);
+        free(qchan);
 
         // sort alignments by (DTW) score decreasing
-        ks_mergesort(aln_cmp, c.n_maps, alignments, 0);
+        ks_mergesort(aln_cmp, a, alignments, 0);
 
-        for(r = 0; r < c.n_maps*2; r++) {
+        for(r = 0; r < a; r++) {
           aln = alignments[r];
-          if(aln.score < dtw_threshold) break;
-          fprintf(o, "%u\t", b.molecules[q].id); // query id
-          fprintf(o, "%u\t", c.molecules[aln.ref].id); // target id
-          fprintf(o, "%u\t", aln.qrev); // query reverse?
-          fprintf(o, "%u\t", aln.qstart); // query start idx
-          fprintf(o, "%u\t", aln.qend); // query end idx
-          fprintf(o, "%u\t", b.molecules[q].n_labels); // query len idx
-          fprintf(o, "%u\t", b.molecules[q].labels[aln.qstart].position); // query start
-          fprintf(o, "%u\t", b.molecules[q].labels[aln.qend > 0 ? aln.qend-1 : 0].position); // query end
-          fprintf(o, "%u\t", b.molecules[q].length); // query len
-          fprintf(o, "%u\t", aln.tstart); // ref start idx
-          fprintf(o, "%u\t", aln.tend); // ref end idx
-          fprintf(o, "%u\t", c.molecules[aln.ref].n_labels); // ref len idx
-          fprintf(o, "%u\t", c.molecules[aln.ref].labels[aln.tstart].position); // ref start
-          fprintf(o, "%u\t", c.molecules[aln.ref].labels[aln.tend > 0 ? aln.tend-1 : 0].position); // ref end
-          fprintf(o, "%u\t", c.molecules[aln.ref].length); // ref len
-          fprintf(o, "%f\t", aln.score); // dtw score
-          // dtw path
-          for(i = 0; i < kv_size(aln.path); i++) {
-            fprintf(o, "%c", kv_A(aln.path, i) == 0 ? '.' : (kv_A(aln.path, i) == 1 ? 'I' : 'D'));
-          }
-          fprintf(o, "\n");
+          aln_set(&rec, &b.molecules[q], &c.molecules[aln.ref], &aln);
+          aln_write(o, &rec);
+          kv_destroy(aln.path);
         }
         if(r == 0) {
-          fprintf(o, "%u\t-\t-\t-\t-\t%u\t-\t-\t%u\t-\t-\t-\t-\t-\t-\t-\t-\n", b.molecules[q].id, b.molecules[q].n_labels, b.molecules[q].length);
+          aln_set_unaligned(&rec, &b.molecules[q]);
+          aln_write(o, &rec);
         }
       }
+      for(r = 0; r < c.n_maps; r++) {
+        free(rfrags[r]);
+        free(rchan[r]);
+      }
+      free(rfrags);
+      free(rchan);
+      free(tasks);
+      free(alignments);
       ret = 0;
     }
+    ret |= aln_close(o) != 0;
 
     // TODO: clean up cmap/bnx memory
   }
 
+  else if(strcmp(command, "assemble") == 0) {
+    if(bnx_file == NULL) {
+      fprintf(stderr, "BNX file (-b) required\n");
+      return 1;
+    }
+    fprintf(stderr, "# Loading '%s'...\n", bnx_file);
+    cmap b = read_bnx_range(bnx_file, start_mol, end_mol);
+    fprintf(stderr, "# Loaded %d molecules\n", b.n_maps);
+
+    init_cmap(&c);
+    ret = assemble_cmap(b, &c, seed_mode, q, bin_size, max_qgrams, repeat_frac, chain_threshold, dtw_threshold, min_labels, min_coverage, threads, placement, numa);
+    if(ret == 0) {
+      BGZF* out = open_map_file("-", compress ? "w" : "wu");
+      ret = out == NULL || (write_cmap(&c, out) | bgzf_close(out));
+    }
+  }
+
+  else if(strcmp(command, "sv") == 0) {
+    if(bnx_file == NULL) {
+      fprintf(stderr, "BNX file (-b) required\n");
+      return 1;
+    }
+    if(cmap_file == NULL) {
+      fprintf(stderr, "CMAP file (-c) required\n");
+      return 1;
+    }
+    fprintf(stderr, "# Loading '%s'...\n", cmap_file);
+    c = read_cmap(cmap_file);
+
+    alnFile* in;
+    bnxReader* mols;
+    if(alignment_file == NULL) {
+      fprintf(stderr, "# Loading '%s'...\n", bnx_file);
+      cmap b = read_bnx(bnx_file);
+      // align first (to binary), then put the alignments in reference order
+      const char* tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+      char* unsorted = malloc(strlen(tmpdir) + 24);
+      char* sorted = malloc(strlen(tmpdir) + 24);
+      sprintf(unsorted, "%s/rekit.XXXXXX", tmpdir);
+      sprintf(sorted, "%s/rekit.XXXXXX", tmpdir);
+      int fd1 = mkstemp(unsorted), fd2 = mkstemp(sorted);
+      if(fd1 < 0 || fd2 < 0) {
+        fprintf(stderr, "Failed to create temporary alignment files in '%s'\n", tmpdir);
+        return 1;
+      }
+      close(fd1);
+      close(fd2);
+      alnFile* tmp = aln_open(unsorted, "wu", 1);
+      ret = tmp == NULL;
+      if(ret == 0) ret = hash_cmap(b, c, tmp, seed_mode, q, chain_threshold, dtw_threshold, max_qgrams, repeat_frac, read_limit, bin_size, min_frag, min_labels, 0, b.n_maps - 1, placement, index_mem);
+      if(tmp != NULL && aln_close(tmp) != 0) ret = 1;
+      ret = ret || sort_alignments(unsorted, sorted, 1, 0);
+      in = ret == 0 ? aln_open(sorted, "r", 1) : NULL;
+      unlink(unsorted);
+      unlink(sorted); // already open, if it is read at all
+      free(unsorted);
+      free(sorted);
+      // already in memory for aligning, so looked up there
+      mols = bnx_reader_wrap(b);
+    } else {
+      in = aln_open(alignment_file, "r", 0);
+      // only the molecules that aligned are read, as they come up
+      mols = in != NULL ? bnx_reader_open(bnx_file) : NULL;
+      ret = mols == NULL;
+    }
+    if(in == NULL) return 1;
+    if(ret == 0) ret = call_svs(in, mols, c, stdout, min_support, min_sv_size);
+    if(mols != NULL) bnx_reader_close(mols);
+    aln_close(in);
+  }
+
   else if(strcmp(command, "simulate") == 0) {
-    if(fasta_file == NULL) {
-      fprintf(stderr, "FASTA file required (-f)\n");
+    if(fasta_file == NULL && cmap_file == NULL) {
+      fprintf(stderr, "FASTA file (-f) or reference CMAP (-c) required\n");
       return 1;
     }
-    if(restriction_seq == NULL) {
+    if(fasta_file != NULL && restriction_seq == NULL) {
       fprintf(stderr, "Restriction sequence is required (-r)\n");
       return 1;
-    } else {
-      if(strcmp(restriction_seq, "DLE1") == 0 || strcmp(restriction_seq, "DLE-1") == 0) {
-        restriction_seq = "CTTAAG";
-      }
     }
     if(coverage < FLT_EPSILON) {
       fprintf(stderr, "Coverage is required (-x)\n");
       return 1;
     }
-    // make a list of restriction seqs - that's what digest wants
-    char** rseqs = malloc(1 * sizeof(char*));
-    rseqs[0] = restriction_seq;
+
+    // the reference label sites: given, or digested (or read from the digest cache)
+    cmap ref;
+    if(cmap_file != NULL) {
+      fprintf(stderr, "# Loading '%s'...\n", cmap_file);
+      ref = read_cmap(cmap_file);
+      if(ref.n_maps > 0 && ref.n_rec_seqs == 0) {
+        fprintf(stderr, "CMAP '%s' has no recognition sequences (# Nickase Recognition Site)\n", cmap_file);
+        return 1;
+      }
+    } else {
+      // make a list of restriction seqs - that's what digest wants
+      size_t n_rseqs;
+      char** rseqs = parse_motifs(restriction_seq, &n_rseqs);
+      if(n_rseqs == 0) return 1;
+      fprintf(stderr, "Loading FASTA file: %s\n", fasta_file);
+      ref = digest_fasta_cached(fasta_file, rseqs, n_rseqs, digest_cache);
+    }
+    if(ref.n_maps == 0) return 1;
 
     fprintf(stderr, "-- Running optical mapping simulation --\n");
-    c = simulate_bnx(fasta_file, rseqs, 1, break_rate, fn, fp, stretch_mean, stretch_std, min_frag, coverage);
+    c = simulate_bnx(&ref, break_rate, fn, fp, stretch_mean, stretch_std, min_frag, coverage);
     fprintf(stderr, "Done simulating, writing to BNX...\n");
-    ret = write_bnx(&c, stdout);
+    BGZF* out = open_map_file("-", compress ? "w" : "wu");
+    ret = out == NULL || (write_bnx(&c, out) | bgzf_close(out));
 
     if(source_outfile != NULL) {
       fprintf(stderr, "Writing truth/source positions to '%s'\n", source_outfile);
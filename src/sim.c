@@ -30,77 +30,138 @@
 #include <math.h>
 #include <float.h>
 #include <time.h>
-#include <zlib.h>
 #include "klib/kvec.h"
 #include "klib/ksort.h"
 #include "klib/kstring.h"
 #include "digest.h"
 #include "sim.h"
 
-#ifndef _kseq_
-#define _kseq_
-
-#include "klib/kseq.h"
-
-// init kseq struct
-KSEQ_INIT(gzFile, gzread)
-
-#endif
-
 KSORT_INIT_GENERIC(uint32_t)
 
 #define PI 3.14159265358979323
 
 
-// from https://en.wikipedia.org/wiki/Box-Muller_transform
-float normal(float mu, float sigma) {
-  const float two_pi = 2.0 * PI;
-  static float z0, z1;
+/*
+ * Random variates
+ *
+ * Every label draws a stretch error (Cauchy) and an FN decision (uniform), so variates are made in blocks:
+ * RNG_LANES independent xoshiro256+ streams are stepped together - a loop of 64-bit shifts and xors the
+ * compiler vectorizes (at -O3) - and each block of uniforms is turned into truncated Cauchy variates by a
+ * branch-free rational tan() that vectorizes too. The streams are seeded from rand(), so srand() still
+ * fixes a simulation
+ */
+#define RNG_LANES 8
+#define RNG_BLOCK 512 // variates per refill, a multiple of RNG_LANES
+
+typedef struct {
+  uint64_t s[4][RNG_LANES]; // xoshiro256+ state of each lane
+  double u[RNG_BLOCK]; // uniforms in [0, 1)
+  int n_u; // unused uniforms, taken from the end
+  float c[RNG_BLOCK]; // stretch errors
+  int n_c;
+  double c_location, c_scale, c_min; // c_min is the Cauchy CDF at 0, below which variates are cut off
+} sim_rng;
+
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
-  static uint8_t generate = 0;
-  generate = !generate;
+// the stretch errors are Cauchy(location, scale) variates, truncated to be non-negative
+static void rng_init(sim_rng *rng, uint64_t seed, double location, double scale) {
+  int i, l;
+  for(i = 0; i < 4; i++) {
+    for(l = 0; l < RNG_LANES; l++) rng->s[i][l] = splitmix64(&seed);
+  }
+  rng->n_u = 0;
+  rng->n_c = 0;
+  rng->c_location = location;
+  rng->c_scale = scale;
+  rng->c_min = 0.5 + atan(-location / scale) / PI;
+}
 
-  if (!generate)
-     return z1 * sigma + mu;
+// n (a multiple of RNG_LANES) uniforms in [0, 1), 52 random bits each
+static void fill_uniform(sim_rng *rng, double *restrict out, int n) {
+  uint64_t *restrict s0 = rng->s[0], *restrict s1 = rng->s[1], *restrict s2 = rng->s[2], *restrict s3 = rng->s[3];
+  int i, l;
+  for(i = 0; i < n; i += RNG_LANES) {
+#pragma GCC unroll 1 // kept a loop over the lanes, for the vectorizer
+    for(l = 0; l < RNG_LANES; l++) {
+      uint64_t x = ((s0[l] + s3[l]) >> 12) | 0x3ff0000000000000ULL; // a double in [1, 2)
+      uint64_t t = s1[l] << 17;
+      s2[l] ^= s0[l];
+      s3[l] ^= s1[l];
+      s1[l] ^= s2[l];
+      s0[l] ^= s3[l];
+      s2[l] ^= t;
+      s3[l] = (s3[l] << 45) | (s3[l] >> 19);
+      double d;
+      memcpy(&d, &x, sizeof(d));
+      out[i + l] = d - 1.0;
+    }
+  }
+}
 
-  float u1, u2;
-  do {
-     u1 = rand() * (1.0 / RAND_MAX);
-     u2 = rand() * (1.0 / RAND_MAX);
-  } while ( u1 <= FLT_EPSILON );
+static inline double uniform(sim_rng *rng) {
+  if(rng->n_u == 0) {
+    fill_uniform(rng, rng->u, RNG_BLOCK);
+    rng->n_u = RNG_BLOCK;
+  }
+  return rng->u[--rng->n_u];
+}
 
-  z0 = sqrt(-2.0 * log(u1)) * cos(two_pi * u2);
-  z1 = sqrt(-2.0 * log(u1)) * sin(two_pi * u2);
-  return z0 * sigma + mu;
+/*
+ * Inverse CDF of the Cauchy distribution restricted to [0, inf), for a block of uniforms, so no variate is
+ * ever rejected: tan(2y) = 2 tan(y) / (1 - tan(y)^2) from the rational tan(y) = n/d of Cephes (exact to double
+ * precision for |y| <= pi/4), with a single division and no branches
+ */
+static void fill_cauchy(sim_rng *rng) {
+  double u[RNG_BLOCK];
+  fill_uniform(rng, u, RNG_BLOCK);
+  const double lo = rng->c_min, span = 1.0 - rng->c_min, location = rng->c_location, scale = rng->c_scale;
+  int i;
+  for(i = 0; i < RNG_BLOCK; i++) {
+    double y = PI * 0.5 * (lo + u[i] * span - 0.5); // half the angle, in (-pi/4, pi/4)
+    double z = y * y;
+    double d = (((z + 1.36812963470692954678E4) * z - 1.32089234440210967447E6) * z + 2.50083801823357915839E7) * z - 5.38695755929454629881E7;
+    double n = y * (((-1.30936939181383777646E4 * z + 1.15351664838587416140E6) * z - 1.79565251976484877988E7) * z + d);
+    rng->c[i] = (float)(location + scale * (2.0 * n * d / ((d - n) * (d + n))));
+  }
+  rng->n_c = RNG_BLOCK;
 }
 
-// inverse of the Cauchy CDF
-float cauchy(float location, float scale) {
-  int r = rand();
-  /*
-  fprintf(stderr, "rand: %d\n", r);
-  fprintf(stderr, "randmax: %d\n", RAND_MAX);
-  fprintf(stderr, "frac: %f\n", (r * (1.0/RAND_MAX)));
-  fprintf(stderr, "tan(...): %f\n", tan(PI * (r * (1.0 / RAND_MAX) - 0.5)));
-  */
-  return scale * tan(PI * (r * (1.0 / RAND_MAX) - 0.5)) + location;
+static inline float stretch_error(sim_rng *rng) {
+  if(rng->n_c == 0) fill_cauchy(rng);
+  return rng->c[--rng->n_c];
+}
+
+// from https://en.wikipedia.org/wiki/Box-Muller_transform - only two are drawn per molecule, so these are not batched
+static float normal(sim_rng *rng, float mu, float sigma) {
+  double u1;
+  do {
+    u1 = uniform(rng);
+  } while(u1 <= FLT_EPSILON);
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * PI * uniform(rng)) * sigma + mu;
 }
 
 // end_idx is *not included* itself
-u32Vec* bn_map(u32Vec *positions, int start_idx, int end_idx, uint64_t start_pos, uint32_t frag_len, float fn_rate, float fp_rate, float err_mean, float err_std, uint32_t resolution_min) {
+// labels are the reference map's (with their channels), modchan receives the channel of each output label (excluding the end)
+u32Vec* bn_map(sim_rng *rng, label *labels, int start_idx, int end_idx, uint64_t start_pos, uint32_t frag_len, float fn_rate, float fp_rate, uint32_t resolution_min, int n_channels, byteVec *modchan) {
   int j, k;
 
-  int fp = round((end_idx - start_idx) * normal(fp_rate, 0.01));
+  int fp = round((end_idx - start_idx) * normal(rng, fp_rate, 0.01));
   u32Vec fp_pos;
   kv_init(fp_pos);
   for(j = 0; j < fp; j++) {
-    kv_push(uint32_t, fp_pos, (uint32_t)round((double)rand() / (double)RAND_MAX * frag_len));
+    kv_push(uint32_t, fp_pos, (uint32_t)round(uniform(rng) * frag_len));
   }
   ks_mergesort(uint32_t, kv_size(fp_pos), fp_pos.a, 0); // sort
   k = 0; // index into fp_pos
 
   // compute per-molecule uniform stretch by observed (query given ref) size / ref
-  float uniform_stretch = (3014.8 + 0.955764 * frag_len) * normal(1.03025, 0.03273) / frag_len;
+  float uniform_stretch = (3014.8 + 0.955764 * frag_len) * normal(rng, 1.03025, 0.03273) / frag_len;
   //fprintf(stderr, "\nuniform stretch factor: %f\n", uniform_stretch);
 
   // now perform modifications for FN, FP, sizing error, and limited resolution
@@ -110,28 +171,31 @@ u32Vec* bn_map(u32Vec *positions, int start_idx, int end_idx, uint64_t start_pos
   uint32_t last_stretched = 0;
   for(j = start_idx; j <= end_idx; j++) {
     uint32_t val;
+    uint8_t ch = 0;
     if(j < end_idx) {
-      if(k < kv_size(fp_pos) && kv_A(fp_pos, k) < kv_A(*positions, j) - start_pos) {
+      if(k < kv_size(fp_pos) && kv_A(fp_pos, k) < labels[j].position - start_pos) {
         val = kv_A(fp_pos, k);
+        ch = 1 + (int)(uniform(rng) * n_channels); // false positives are equally likely in any channel
         k++;
         j--;
       } else {
-        val = kv_A(*positions, j) - start_pos;
+        val = labels[j].position - start_pos;
+        ch = labels[j].channel;
       }
     } else { // add a label for the end of the fragment (which DOES NOT correspond to a label site)
       val = frag_len;
     }
-    // apply Cauchy-distributed inter-label error
-    float c = cauchy(err_mean, err_std);
-    while(c < 0) c = cauchy(err_mean, err_std); // under some error parameters, a proper cauchy random variable will end up with negative values, which we can't allow
+    // apply Cauchy-distributed inter-label error (truncated: under some error parameters, a proper cauchy random variable will end up with negative values, which we can't allow)
+    float c = stretch_error(rng);
     uint32_t f = last_stretched + (val - last) * uniform_stretch * c;
 
     // then include only fragments that exceed some minimum size (typically, ~1kb for Bionano)
     // and fall above FN rate
-    if(((double)rand() / (double)RAND_MAX) > fn_rate || j == end_idx) { // this last position is the end of the molecule and can't be FN
+    if(uniform(rng) > fn_rate || j == end_idx) { // this last position is the end of the molecule and can't be FN
       if(kv_size(*modpos) == 0 || f - last_stretched >= resolution_min) {
         kv_push(uint32_t, *modpos, f);
-      } else { // if this label is too close to the last, use only the midpoint of the two
+        if(j < end_idx) kv_push(uint8_t, *modchan, ch);
+      } else { // if this label is too close to the last, use only the midpoint of the two (keeping the first's channel)
         kv_A(*modpos, kv_size(*modpos)-1) = last_stretched + (f - last_stretched) / 2;
       }
     }
@@ -140,19 +204,34 @@ u32Vec* bn_map(u32Vec *positions, int start_idx, int end_idx, uint64_t start_pos
     last_stretched = f;
   }
   kv_destroy(fp_pos);
+  // the end may have absorbed the last label, which then no longer has a channel
+  if(kv_size(*modchan) >= kv_size(*modpos)) kv_size(*modchan) = kv_size(*modpos) - 1;
 
   return modpos;
 }
 
 
-cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_prob, float fn, float fp, float err_mean, float err_std, uint32_t resolution_min, float coverage) {
+// index of the first label of a map at or past pos (n_labels if none)
+static size_t first_label_from(molecule* m, uint64_t pos) {
+  size_t lo = 0, hi = m->n_labels, mid;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(m->labels[mid].position < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Samples molecules from the label sites of a reference map set - an in silico digest (see digest_fasta()) or
+ * any CMAP - whose recognition sequences become the label channels of the output
+ */
+cmap simulate_bnx(cmap* ref_maps, float frag_prob, float fn, float fp, float err_mean, float err_std, uint32_t resolution_min, float coverage) {
 
   float bimera_prob = 0.01;
   float trimera_prob = 0.0001;
   float quadramera_prob = 0.000001;
 
-  gzFile f;
-  kseq_t* seq;
   uint64_t i;
   int j;
 
@@ -164,102 +243,78 @@ cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_pr
   posVec frag_positions;
   kv_init(frag_positions);
 
-  fragVec ref_labels;
-  kv_init(ref_labels);
-
-  u32Vec ref_lens;
-  kv_init(ref_lens);
+  chanVec frag_channels;
+  kv_init(frag_channels);
 
-  cstrVec ref_names;
-  kv_init(ref_names);
+  sim_rng rng;
+  rng_init(&rng, ((uint64_t)rand() << 32) ^ (uint64_t)rand(), err_mean, err_std);
 
-  f = gzopen(ref_fasta, "r");
-  seq = kseq_init(f);
-  fprintf(stderr, "Loading FASTA file: %s\n", ref_fasta);
-
-  int l;
-  uint32_t ref = 0; // reference seq ID
-  while ((l = kseq_read(seq)) >= 0) {
-    // name: seq->name.s, seq: seq->seq.s, length: l
-    //fprintf(stderr, "Reading sequence '%s' (%i bp).\n", seq->name.s, l);
-    genome_size = genome_size + seq->seq.l;
-
-    int nlimit = 100; // break strings of Ns at least 100bp long
-
-    // do digestion + shearing with some probability
-    u32Vec *positions = (u32Vec*)malloc(sizeof(u32Vec));
-    kv_init(*positions);
-    int res = digest(seq->seq.s, l, motifs, n_motifs, 1, 0, nlimit, positions);
-    //fprintf(stderr, "  has %u labels.\n", kv_size(*positions));
-
-    char* n = malloc((seq->name.l+1)*sizeof(char));
-    n[seq->name.l] = '\0';
-    strncpy(n, seq->name.s, seq->name.l);
-    kv_push(char*, ref_names, n);
-    kv_push(u32Vec*, ref_labels, positions);
-    kv_push(uint32_t, ref_lens, seq->seq.l); // I think this comes as a size_t, hopefully it will cast quietly...
-
-    ref++;
+  molecule* refs = ref_maps->molecules;
+  uint32_t ref = ref_maps->n_maps; // reference seq IDs are indices into refs
+  for(i = 0; i < ref; i++) {
+    genome_size = genome_size + refs[i].length;
   }
-  kseq_destroy(seq);
-  gzclose(f);
 
   uint64_t target_coverage = (uint64_t)((double)coverage * genome_size);
   uint64_t tot_covg = 0;
   fprintf(stderr, "Target bp: %llu (%fx coverage of %u bp genome)\n", target_coverage, coverage, genome_size);
   double chimera_prob;
   int chimera_parts = 0;
-  u32Vec* prev_f;
-  uint64_t bigrand;
+  u32Vec* prev_f = NULL;
+  byteVec* prev_c = NULL;
   uint32_t ref_id;
   uint64_t pos;
   uint32_t frag_len;
   uint32_t last;
   uint32_t tmp;
+  uint8_t tmp_c;
 
   for(tot_covg = 0; tot_covg < target_coverage; ) {
-    bigrand = rand(); // proof ourselves against 32-bit systems where our rand() will not necessarily be big enough 
-    bigrand = (bigrand << 32) | rand();
-    pos = bigrand % genome_size;
+    pos = (uint64_t)(uniform(&rng) * genome_size);
     //fprintf(stderr, "raw pos %lu\n", pos);
     for(i = 0; i < ref; i++) {
-      if(pos < kv_A(ref_lens, i)) {
+      if(pos < refs[i].length) {
         ref_id = i;
         break;
       } else {
-        pos = pos - kv_A(ref_lens, i);
-        //fprintf(stderr, "skipping over ref %u of size %u\n", i, kv_A(ref_lens, i));
+        pos = pos - refs[i].length;
+        //fprintf(stderr, "skipping over ref %u of size %u\n", i, refs[i].length);
       }
     }
     //fprintf(stderr, "ref %u, pos %lu\n", ref_id, pos);
     ref_pos rp = {ref_id, (uint32_t)pos};
-    frag_len = log(1 - (double)rand()/(double)RAND_MAX) / log(1 - frag_prob);
+    frag_len = log(1 - uniform(&rng)) / log(1 - frag_prob);
     //fprintf(stderr, "fragment length: %u\n", frag_len);
-    if(pos + frag_len > kv_A(ref_lens, ref_id))
-      frag_len = kv_A(ref_lens, ref_id) - pos;
+    if(pos + frag_len > refs[ref_id].length)
+      frag_len = refs[ref_id].length - pos;
 
     // find fragment start and end index in ref_pos
-    for(i = 0; i < kv_size(*kv_A(ref_labels, ref_id)) && kv_A(*kv_A(ref_labels, ref_id), i) < pos; i++);
-    for(j = i; j < kv_size(*kv_A(ref_labels, ref_id)) && kv_A(*kv_A(ref_labels, ref_id), j) < pos+frag_len; j++);
+    i = first_label_from(&refs[ref_id], pos);
+    j = first_label_from(&refs[ref_id], pos+frag_len);
     //fprintf(stderr, "labels %d -> %d\n", i, j);
 
-    u32Vec *f = bn_map(kv_A(ref_labels, ref_id), i, j, pos, frag_len, fn, fp, err_mean, err_std, resolution_min);
+    byteVec *fc = (byteVec*)malloc(sizeof(byteVec));
+    kv_init(*fc);
+    u32Vec *f = bn_map(&rng, refs[ref_id].labels, i, j, pos, frag_len, fn, fp, resolution_min, ref_maps->n_rec_seqs, fc);
     //fprintf(stderr, "mapping done, got %u fragments\n", kv_size(*f));
 
     // reverse fragments randomly to represent opposite strand (labels are already strand-agnostic)
-    if(rand()%2 == 0) {
+    if(uniform(&rng) < 0.5) {
       uint32_t len = kv_A(*f, kv_size(*f)-1);
       for(i = 0; i < (kv_size(*f)-1)/2; i++) { // we leave the last label alone since it represents the molecule length
         tmp = kv_A(*f, i);
         kv_A(*f, i) = len - kv_A(*f, kv_size(*f)-2-i); // the rest get reversed in order and adjusted to remain monotonically increasing
         kv_A(*f, kv_size(*f)-2-i) = len - tmp;
+        tmp_c = kv_A(*fc, i);
+        kv_A(*fc, i) = kv_A(*fc, kv_size(*fc)-1-i);
+        kv_A(*fc, kv_size(*fc)-1-i) = tmp_c;
       }
     }
 
     // apply chimerism
     if(chimera_parts == 0) {
       //fprintf(stderr, "new chimera check\n");
-      chimera_prob = (double)rand() / (double)RAND_MAX;
+      chimera_prob = uniform(&rng);
       chimera_parts = (chimera_prob < quadramera_prob ? 4 : (chimera_prob < trimera_prob ? 3 : (chimera_prob < bimera_prob ? 2 : 1)));
       //fprintf(stderr, "  chimera parts: %d\n", chimera_parts);
 
@@ -267,10 +322,12 @@ cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_pr
       if(chimera_parts == 1) { // normal, never chimeric
         //fprintf(stderr, "  pushing singleton\n");
         kv_push(u32Vec*, fragments, f);
+        kv_push(byteVec*, frag_channels, fc);
         chimera_parts = 0;
       } else {
         //fprintf(stderr, "  beginning of new chimera\n");
         prev_f = f;
+        prev_c = fc;
         chimera_parts--;
       }
     } else {
@@ -280,11 +337,19 @@ cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_pr
       for(j = 0; j < kv_size(*f); j++) {
         kv_push(uint32_t, *prev_f, kv_A(*f, j) + last);
       }
+      // the old end becomes an ordinary label at the junction, in the channel of the label next to it
+      tmp_c = kv_size(*prev_c) > 0 ? kv_A(*prev_c, kv_size(*prev_c)-1) : (kv_size(*fc) > 0 ? kv_A(*fc, 0) : 1);
+      kv_push(uint8_t, *prev_c, tmp_c);
+      kv_extend(uint8_t, *prev_c, *fc);
 
       kv_destroy(*f);
       free(f);
-      if(chimera_parts == 1)
+      kv_destroy(*fc);
+      free(fc);
+      if(chimera_parts == 1) {
         kv_push(u32Vec*, fragments, prev_f);
+        kv_push(byteVec*, frag_channels, prev_c);
+      }
       chimera_parts--;
     }
 
@@ -292,26 +357,25 @@ cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_pr
     //fprintf(stderr, "-- running total: %u of %u\n", tot_covg, target_coverage);
   }
 
-  for(i = 0; i < kv_size(ref_labels); i++) {
-    kv_destroy(*kv_A(ref_labels, i));
-  }
-  kv_destroy(ref_labels);
-
   // if last was an incomplete chimera, just end it and add it
-  if(chimera_parts > 0)
+  if(chimera_parts > 0) {
     kv_push(u32Vec*, fragments, prev_f);
+    kv_push(byteVec*, frag_channels, prev_c);
+  }
 
   cmap c;
   init_cmap(&c);
-  c.n_rec_seqs = n_motifs;
-  c.rec_seqs = motifs;
+  c.n_rec_seqs = ref_maps->n_rec_seqs;
+  c.rec_seqs = ref_maps->rec_seqs;
   fprintf(stderr, "Sampled %u fragments\n", kv_size(fragments));
   for(i = 0; i < kv_size(fragments); i++) {
     //fprintf(stderr, "adding map %d of size %u\n", i, kv_size(*kv_A(fragments, i)));
-    add_map(&c, i+1, kv_A(fragments, i)->a, kv_size(*kv_A(fragments, i)), 1);
+    add_map_channels(&c, i+1, kv_A(fragments, i)->a, kv_A(frag_channels, i)->a, kv_size(*kv_A(fragments, i)), 1);
     kv_destroy(*kv_A(fragments, i));
+    kv_destroy(*kv_A(frag_channels, i));
   }
   kv_destroy(fragments);
+  kv_destroy(frag_channels);
   c.source = frag_positions;
   return c;
 }
@@ -28,4 +28,4 @@
 		(v0).n = (v0).n + (v1).n; \
 	} while (0)
 
-cmap simulate_bnx(char* ref_fasta, char** motifs, size_t n_motifs, float frag_prob, float nick_prob, float shear_prob, float stretch_mean, float stretch_std, uint32_t resolution_min, float coverage);
+cmap simulate_bnx(cmap* ref_maps, float frag_prob, float nick_prob, float shear_prob, float stretch_mean, float stretch_std, uint32_t resolution_min, float coverage);
@@ -0,0 +1,585 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jeremy Wang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Structural variant calling from molecule alignments
+ *
+ * Alignments are streamed in reference order (sorted by reference id, then start position), so only the
+ * signals and alignments around the current position are held in memory; molecules are read from the BNX
+ * as their alignments come up, and a small record of each alignment, to pair it with the molecule's other
+ * alignments, goes to temporary files. Within an alignment, matched label intervals
+ * whose molecule and reference sizes disagree are insertion or deletion signals; those are clustered
+ * across molecules as they are passed. Molecules with more than one alignment (split alignments) give
+ * breakpoint signals - inversions where the strand switches, translocations where the reference does -
+ * which are clustered once every alignment has been read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "klib/kvec.h"
+#include "klib/khash.h"
+#include "klib/ksort.h"
+#include "cmap.h"
+#include "dtw.h"
+#include "aln.h"
+#include "sv.h"
+
+#define SV_MIN_FRAC 0.1 // an indel must also be at least this fraction of the interval it is found in
+#define SV_MIN_ANCHOR 3 // consecutive size-consistent intervals that anchor either end of an alignment
+#define SV_MIN_FRACTION 0.3 // fraction of the spanning alignments that must support an indel call
+#define SV_BREAKPOINT_DIST 50000 // bp between split-alignment breakpoints that can be clustered together
+#define SV_MAX_INDEL 1000000 // larger gaps between same-strand split alignments are called translocations
+#define SV_MAX_OVERLAP 0.5 // fraction of the shorter of two alignments they can share and still be split
+#define SV_PART_BUCKETS 16 // temporary files alignment parts are spread over by molecule, to be paired a file at a time
+
+static const char* sv_types[] = {"INS", "DEL", "INV", "TRA"};
+
+typedef struct sv_signal {
+  uint32_t ref;
+  uint32_t start;
+  uint32_t end;
+  uint32_t ref2; // the other side of a translocation (otherwise ref and end)
+  uint32_t pos2;
+  uint32_t size;
+  uint32_t mol;
+  uint32_t depth; // alignments spanning the signal (UINT32_MAX if unknown)
+  uint8_t type;
+} sv_signal;
+
+typedef kvec_t(sv_signal) signalVec;
+
+typedef struct sv_cluster {
+  sv_signal sv; // first signal, then the cluster's extent
+  double sum_start;
+  double sum_end;
+  double sum_pos2;
+  double sum_size;
+  uint32_t n;
+  u32Vec mols;
+} sv_cluster;
+
+typedef kvec_t(sv_cluster) clusterVec;
+
+// reference interval of an alignment, kept while signals it may span are pending
+typedef struct aln_span {
+  uint32_t start;
+  uint32_t end;
+} aln_span;
+
+typedef kvec_t(aln_span) spanVec;
+
+// an alignment reduced to what's needed to pair it with the molecule's other alignments
+typedef struct aln_part {
+  uint32_t ref;
+  uint32_t qstart; // forward molecule coordinates
+  uint32_t qend;
+  uint32_t rstart;
+  uint32_t rend;
+  uint8_t rev;
+} aln_part;
+
+// an aln_part and its molecule, as spilled to a bucket file
+typedef struct mol_part {
+  uint32_t mol;
+  aln_part part;
+} mol_part;
+
+typedef kvec_t(mol_part) molPartVec;
+
+typedef struct sv_ctx {
+  signalVec heap; // indel signals not yet clustered, a min-heap on start
+  clusterVec open; // indel clusters later signals may still join
+  spanVec spans; // alignments that may span pending signals
+  signalVec splits; // split-alignment signals, clustered at the end
+  int min_support;
+  FILE* o;
+  size_t n_calls;
+} sv_ctx;
+
+// ties are broken down to the molecule, so the order doesn't depend on which bucket a signal came from
+#define split_lt(a, b) ((a).type != (b).type ? (a).type < (b).type : (a).ref != (b).ref ? (a).ref < (b).ref : (a).ref2 != (b).ref2 ? (a).ref2 < (b).ref2 : \
+  (a).start != (b).start ? (a).start < (b).start : (a).pos2 != (b).pos2 ? (a).pos2 < (b).pos2 : (a).mol < (b).mol)
+KSORT_INIT(split_cmp, sv_signal, split_lt)
+
+#define mol_part_lt(a, b) ((a).mol < (b).mol)
+KSORT_INIT(mol_part_cmp, mol_part, mol_part_lt)
+
+KSORT_INIT_GENERIC(float)
+
+KHASH_MAP_INIT_INT(svIdx, uint32_t);
+
+// molecule coordinate (in the aligned orientation) of the query boundary after y aligned fragments (see dtw())
+static inline uint32_t query_pos(molecule* m, uint32_t y, int rev) {
+  uint32_t len = m->labels[m->n_labels-1].position; // the end marker
+  uint32_t k = rev ? m->n_labels - y : y;
+  uint32_t fw = k > 0 ? m->labels[k-1].position : 0;
+  return rev ? len - fw : fw;
+}
+
+// reference coordinate of the target boundary after x aligned fragments
+static inline uint32_t target_pos(molecule* r, uint32_t x) {
+  return x > 0 ? r->labels[x-1].position : 0;
+}
+
+static void heap_push(signalVec* h, sv_signal s) {
+  size_t i, p;
+  kv_push(sv_signal, *h, s);
+  for(i = kv_size(*h) - 1; i > 0; i = p) {
+    p = (i - 1) / 2;
+    if(kv_A(*h, p).start <= s.start) break;
+    kv_A(*h, i) = kv_A(*h, p);
+  }
+  kv_A(*h, i) = s;
+}
+
+static sv_signal heap_pop(signalVec* h) {
+  sv_signal top = kv_A(*h, 0);
+  sv_signal last = kv_A(*h, --kv_size(*h));
+  size_t n = kv_size(*h), i = 0, c;
+  while((c = 2*i + 1) < n) {
+    if(c + 1 < n && kv_A(*h, c+1).start < kv_A(*h, c).start) c++;
+    if(last.start <= kv_A(*h, c).start) break;
+    kv_A(*h, i) = kv_A(*h, c);
+    i = c;
+  }
+  if(n > 0) kv_A(*h, i) = last;
+  return top;
+}
+
+/*
+ * Walks an alignment's path to its matched label pairs and compares the molecule and reference size of the
+ * interval between each pair and the next, after scaling the molecule by the alignment's median stretch
+ * Intervals that agree in size anchor the alignment: only the part between its first and last run of
+ * SV_MIN_ANCHOR agreeing intervals is kept (the ends of a DTW path are often unaligned overhang) and
+ * disagreements within it become indel signals
+ * Returns 0 if the alignment has no anchored part, otherwise sets part to it
+ */
+static int alignment_signals(molecule* m, molecule* r, aln_rec* a, int min_size, signalVec* heap, aln_part* part) {
+  size_t plen = kv_size(a->path), n = 0, i, j;
+  uint32_t* qp = malloc((plen + 1) * sizeof(uint32_t));
+  uint32_t* rp = malloc((plen + 1) * sizeof(uint32_t));
+  uint32_t y = a->qend, x = a->tend;
+  int ret = 0;
+
+  // matched pairs of real labels (not a molecule or reference end), from the end back
+  for(i = 0; i <= plen; i++) {
+    if((i == plen || kv_A(a->path, i) == MATCH) && y > 0 && y < m->n_labels && x > 0 && x < r->n_labels) {
+      qp[n] = query_pos(m, y, a->rev);
+      rp[n] = target_pos(r, x);
+      n++;
+    }
+    if(i == plen) break;
+    if(kv_A(a->path, i) != DEL) y--;
+    if(kv_A(a->path, i) != INS) x--;
+  }
+  if(y != a->qstart || x != a->tstart) {
+    fprintf(stderr, "Alignment path of molecule %u does not match its start and end\n", a->qid);
+    n = 0;
+  }
+
+  if(n > SV_MIN_ANCHOR) {
+    float* ratio = malloc(n * sizeof(float));
+    uint8_t* ok = malloc(n * sizeof(uint8_t));
+    size_t n_ratio = 0;
+    // pairs were collected from the end, so interval i runs from pair i+1 to pair i
+    for(i = 0; i + 1 < n; i++) {
+      if(qp[i] > qp[i+1] && rp[i] > rp[i+1]) ratio[n_ratio++] = (float)(rp[i] - rp[i+1]) / (qp[i] - qp[i+1]);
+    }
+    if(n_ratio > 0) {
+      ks_introsort(float, n_ratio, ratio);
+      float scale = ratio[n_ratio / 2];
+      for(i = 0; i + 1 < n; i++) {
+        double d = (double)((int64_t)qp[i] - qp[i+1]) * scale - ((int64_t)rp[i] - rp[i+1]);
+        ok[i] = fabs(d) < min_size || fabs(d) < SV_MIN_FRAC * ((int64_t)rp[i] - rp[i+1]);
+        ratio[i] = d; // reused for the size difference
+      }
+      // anchored extent: first and last runs of SV_MIN_ANCHOR consistent intervals
+      size_t lo = n, hi = 0, run = 0;
+      for(i = 0; i + 1 < n; i++) {
+        run = ok[i] ? run + 1 : 0;
+        if(run >= SV_MIN_ANCHOR) {
+          if(lo == n) lo = i + 1 - run;
+          hi = i;
+        }
+      }
+      if(lo < n) {
+        // a run of inconsistent intervals is one signal - a mispaired label gives two that cancel out
+        for(i = lo; i <= hi; i = j + 1) {
+          double d = 0;
+          for(j = i; j <= hi && !ok[j]; j++) d += ratio[j];
+          if(j == i) continue;
+          sv_signal s;
+          s.ref = a->ref_id;
+          s.start = rp[j];
+          s.end = rp[i];
+          s.ref2 = a->ref_id;
+          s.pos2 = rp[i];
+          s.size = (uint32_t)fabs(d);
+          s.mol = a->qid;
+          s.depth = 0;
+          s.type = d > 0 ? SV_INS : SV_DEL;
+          if(s.size >= min_size && s.size >= SV_MIN_FRAC * (s.end - s.start)) heap_push(heap, s);
+        }
+        // back to forward molecule coordinates
+        j = hi + 1;
+        part->ref = a->ref_id;
+        part->rev = a->rev;
+        part->rstart = rp[j];
+        part->rend = rp[lo];
+        part->qstart = a->rev ? m->labels[m->n_labels-1].position - qp[lo] : qp[j];
+        part->qend = a->rev ? m->labels[m->n_labels-1].position - qp[j] : qp[lo];
+        ret = 1;
+      }
+    }
+    free(ratio);
+    free(ok);
+  }
+  free(qp);
+  free(rp);
+  return ret;
+}
+
+/*
+ * Breakpoint signal between two alignments of the same molecule, if they align different parts of it
+ * Each alignment's breakpoint is its reference end adjoining the other alignment along the molecule
+ */
+static void split_signal(aln_part* a, aln_part* b, uint32_t mol, int min_size, signalVec* out) {
+  if(a->qstart > b->qstart) {
+    aln_part* t = a;
+    a = b;
+    b = t;
+  }
+  int64_t shared = (int64_t)(a->qend < b->qend ? a->qend : b->qend) - b->qstart;
+  uint32_t shorter = a->qend - a->qstart < b->qend - b->qstart ? a->qend - a->qstart : b->qend - b->qstart;
+  if(shared > SV_MAX_OVERLAP * shorter) return; // the same part of the molecule aligned twice
+
+  uint32_t pa = a->rev ? a->rstart : a->rend;
+  uint32_t pb = b->rev ? b->rend : b->rstart;
+  sv_signal s;
+  s.mol = mol;
+  s.depth = UINT32_MAX;
+  s.ref = s.ref2 = a->ref;
+  s.start = s.pos2 = pa < pb ? pa : pb;
+  s.end = pa < pb ? pb : pa;
+  s.size = s.end - s.start;
+  if(a->ref != b->ref) {
+    s.type = SV_TRA;
+    s.size = 0;
+    if(a->ref < b->ref) {
+      s.start = s.end = pa;
+      s.ref2 = b->ref;
+      s.pos2 = pb;
+    } else {
+      s.ref = b->ref;
+      s.start = s.end = pb;
+      s.ref2 = a->ref;
+      s.pos2 = pa;
+    }
+  } else if(a->rev != b->rev) {
+    s.type = SV_INV;
+  } else {
+    int64_t rgap = a->rev ? (int64_t)pa - pb : (int64_t)pb - pa;
+    int64_t d = ((int64_t)b->qstart - a->qend) - rgap;
+    if(rgap < -SV_BREAKPOINT_DIST || d > SV_MAX_INDEL || -d > SV_MAX_INDEL) {
+      // out of order or too far apart on the same reference
+      s.type = SV_TRA;
+      s.size = 0;
+      s.pos2 = s.end;
+      s.end = s.start;
+    } else if(d >= min_size) {
+      s.type = SV_INS;
+      s.size = d;
+    } else if(-d >= min_size) {
+      s.type = SV_DEL;
+      s.size = -d;
+    } else return;
+  }
+  kv_push(sv_signal, *out, s);
+}
+
+static void cluster_init(sv_cluster* c, sv_signal* s) {
+  c->sv = *s;
+  c->sum_start = s->start;
+  c->sum_end = s->end;
+  c->sum_pos2 = s->pos2;
+  c->sum_size = s->size;
+  c->n = 1;
+  kv_init(c->mols);
+  kv_push(uint32_t, c->mols, s->mol);
+}
+
+static void cluster_add(sv_cluster* c, sv_signal* s) {
+  size_t i;
+  c->sum_start += s->start;
+  c->sum_end += s->end;
+  c->sum_pos2 += s->pos2;
+  c->sum_size += s->size;
+  c->n++;
+  if(s->end > c->sv.end) c->sv.end = s->end; // the furthest extent, to know when the cluster is passed
+  if(s->depth != UINT32_MAX && s->depth > c->sv.depth) c->sv.depth = s->depth;
+  for(i = 0; i < kv_size(c->mols); i++) {
+    if(kv_A(c->mols, i) == s->mol) return;
+  }
+  kv_push(uint32_t, c->mols, s->mol);
+}
+
+// writes a cluster's call if enough molecules support it, and frees it
+static void cluster_emit(sv_ctx* ctx, sv_cluster* c) {
+  if(kv_size(c->mols) >= ctx->min_support && (c->sv.depth == UINT32_MAX || kv_size(c->mols) >= SV_MIN_FRACTION * c->sv.depth)) {
+    sv_signal* s = &c->sv;
+    fprintf(ctx->o, "%u\t%.0f\t%.0f\t%s\t%.0f\t%zu\t", s->ref, c->sum_start / c->n, c->sum_end / c->n, sv_types[s->type], c->sum_size / c->n, kv_size(c->mols));
+    if(s->depth == UINT32_MAX) fprintf(ctx->o, "-\t");
+    else fprintf(ctx->o, "%u\t", s->depth);
+    if(s->type == SV_TRA) fprintf(ctx->o, "%u\t%.0f\n", s->ref2, c->sum_pos2 / c->n);
+    else fprintf(ctx->o, "-\t-\n");
+    ctx->n_calls++;
+  }
+  kv_destroy(c->mols);
+}
+
+/*
+ * Indel signals of similar size whose intervals overlap are one event - but an indel larger than the
+ * interval it was found in has displaced the labels around it, so it is only placed to within the difference
+ */
+static int cluster_match(sv_cluster* c, sv_signal* s) {
+  double size = c->sum_size / c->n;
+  double start = c->sum_start / c->n, end = c->sum_end / c->n;
+  double overlap = (s->end < end ? s->end : end) - (s->start > start ? s->start : start);
+  double slack = size - (end - start);
+  if((double)s->size - (s->end - s->start) > slack) slack = (double)s->size - (s->end - s->start);
+  return c->sv.type == s->type && overlap + (slack > 0 ? slack : 0) > 0 &&
+    fabs(s->size - size) <= 0.5 * (s->size > size ? s->size : size);
+}
+
+// clusters every pending indel signal starting before pos, which no alignment still to come can precede
+static void flush_signals(sv_ctx* ctx, uint32_t pos) {
+  size_t i, j;
+  while(kv_size(ctx->heap) > 0 && kv_A(ctx->heap, 0).start < pos) {
+    sv_signal s = heap_pop(&ctx->heap);
+
+    // alignments ending before this signal can't span it or any later one
+    s.depth = 0;
+    for(i = j = 0; i < kv_size(ctx->spans); i++) {
+      aln_span sp = kv_A(ctx->spans, i);
+      if(sp.end < s.start) continue;
+      kv_A(ctx->spans, j++) = sp;
+      if(sp.start <= s.start && sp.end >= s.end) s.depth++;
+    }
+    kv_size(ctx->spans) = j;
+
+    // clusters this signal is past are complete
+    for(i = j = 0; i < kv_size(ctx->open); i++) {
+      if(kv_A(ctx->open, i).sv.end < s.start) cluster_emit(ctx, &kv_A(ctx->open, i));
+      else kv_A(ctx->open, j++) = kv_A(ctx->open, i);
+    }
+    kv_size(ctx->open) = j;
+
+    for(i = 0; i < kv_size(ctx->open); i++) {
+      if(cluster_match(&kv_A(ctx->open, i), &s)) break;
+    }
+    if(i < kv_size(ctx->open)) cluster_add(&kv_A(ctx->open, i), &s);
+    else {
+      sv_cluster c;
+      cluster_init(&c, &s);
+      kv_push(sv_cluster, ctx->open, c);
+    }
+  }
+}
+
+static void finish_reference(sv_ctx* ctx) {
+  size_t i;
+  flush_signals(ctx, UINT32_MAX);
+  for(i = 0; i < kv_size(ctx->open); i++) cluster_emit(ctx, &kv_A(ctx->open, i));
+  kv_size(ctx->open) = 0;
+  kv_size(ctx->spans) = 0;
+}
+
+// split-alignment signals are sorted and clustered by breakpoint once all alignments are in
+static void cluster_splits(sv_ctx* ctx) {
+  size_t i;
+  sv_cluster c;
+  int open = 0;
+  ks_mergesort(split_cmp, kv_size(ctx->splits), ctx->splits.a, 0);
+  for(i = 0; i < kv_size(ctx->splits); i++) {
+    sv_signal* s = &kv_A(ctx->splits, i);
+    if(open && c.sv.type == s->type && c.sv.ref == s->ref && c.sv.ref2 == s->ref2 && s->start <= c.sum_start / c.n + SV_BREAKPOINT_DIST &&
+        fabs(s->pos2 - c.sum_pos2 / c.n) <= SV_BREAKPOINT_DIST) {
+      cluster_add(&c, s);
+      continue;
+    }
+    if(open) cluster_emit(ctx, &c);
+    cluster_init(&c, s);
+    open = 1;
+  }
+  if(open) cluster_emit(ctx, &c);
+}
+
+/*
+ * Pairs each molecule's alignments into split-alignment signals. Parts were spread over the bucket files by
+ * molecule as they were read, so one bucket at a time holds every part of its molecules - in the order they
+ * were read, which the stable sort keeps
+ */
+static int pair_parts(FILE** buckets, int min_size, signalVec* splits) {
+  molPartVec parts;
+  kv_init(parts);
+  mol_part p;
+  size_t i, j, k;
+  int b, ret = 0;
+  for(b = 0; b < SV_PART_BUCKETS; b++) {
+    kv_size(parts) = 0;
+    rewind(buckets[b]);
+    while(fread(&p, sizeof(mol_part), 1, buckets[b]) == 1) kv_push(mol_part, parts, p);
+    if(ferror(buckets[b])) {
+      fprintf(stderr, "Failed to read alignment parts back from a temporary file\n");
+      ret = 1;
+      break;
+    }
+    ks_mergesort(mol_part_cmp, kv_size(parts), parts.a, 0);
+    for(i = 0; i < kv_size(parts); i = j) {
+      for(j = i + 1; j < kv_size(parts) && kv_A(parts, j).mol == kv_A(parts, i).mol; j++) {
+        for(k = i; k < j; k++) split_signal(&kv_A(parts, k).part, &kv_A(parts, j).part, kv_A(parts, j).mol, min_size, splits);
+      }
+    }
+  }
+  kv_destroy(parts);
+  return ret;
+}
+
+// map id -> index lookup
+static khash_t(svIdx)* index_ids(cmap* c) {
+  khash_t(svIdx)* h = kh_init(svIdx);
+  uint32_t i;
+  int absent;
+  for(i = 0; i < c->n_maps; i++) {
+    khiter_t k = kh_put(svIdx, h, c->molecules[i].id, &absent);
+    kh_val(h, k) = i;
+  }
+  return h;
+}
+
+/*
+ * Calls structural variants from alignments (text or binary, see aln.h) sorted by reference id and start
+ * position by sort_alignments() - or for text, e.g. by `sort -k2,2n -k13,13n`
+ * b holds the aligned molecules and c is the reference; calls supported by at least min_support molecules
+ * are written to o as they are completed, so they are in reference order for each kind of signal
+ */
+int call_svs(alnFile* in, bnxReader* b, cmap c, FILE* o, int min_support, int min_size) {
+  khash_t(svIdx)* ref_idx = index_ids(&c);
+  FILE* buckets[SV_PART_BUCKETS];
+  sv_ctx ctx;
+  kv_init(ctx.heap);
+  kv_init(ctx.open);
+  kv_init(ctx.spans);
+  kv_init(ctx.splits);
+  ctx.min_support = min_support;
+  ctx.o = o;
+  ctx.n_calls = 0;
+
+  size_t n_aln = 0, n_records = 0, i;
+  uint32_t cur_ref = 0, last_pos = 0;
+  int started = 0, ret = 0, r = 0;
+  aln_rec a;
+  mol_part p;
+  kv_init(a.path);
+
+  for(i = 0; i < SV_PART_BUCKETS; i++) {
+    buckets[i] = tmpfile();
+    if(buckets[i] == NULL) {
+      fprintf(stderr, "Failed to create a temporary file for alignment parts\n");
+      ret = 1;
+    }
+  }
+
+  fprintf(o, "#ref_id\tstart\tend\ttype\tsize\tsupport\tdepth\tmate_ref_id\tmate_pos\n");
+  while(ret == 0 && (r = aln_read(in, &a)) == 0) {
+    n_records++;
+    if(!a.aligned) continue;
+
+    if(started && (a.ref_id < cur_ref || (a.ref_id == cur_ref && a.tpos_start < last_pos))) {
+      fprintf(stderr, "Alignments must be sorted by reference and position (rekit sort), record %zu is not\n", n_records);
+      ret = 1;
+      break;
+    }
+    if(started && a.ref_id != cur_ref) finish_reference(&ctx);
+    started = 1;
+    cur_ref = a.ref_id;
+    last_pos = a.tpos_start;
+
+    molecule* m = bnx_reader_get(b, a.qid);
+    khiter_t kr = kh_get(svIdx, ref_idx, a.ref_id);
+    if(m == NULL || kr == kh_end(ref_idx)) {
+      fprintf(stderr, "Molecule %u or reference %u in record %zu is not in the BNX/CMAP\n", a.qid, a.ref_id, n_records);
+      ret = 1;
+      break;
+    }
+    molecule* ref = &c.molecules[kh_val(ref_idx, kr)];
+    if(m->n_labels != a.qlen || ref->n_labels != a.tlen || a.qend > a.qlen || a.tend > a.tlen) {
+      fprintf(stderr, "Alignment record %zu does not match molecule %u or reference %u\n", n_records, a.qid, a.ref_id);
+      ret = 1;
+      break;
+    }
+
+    // no alignment still to come starts before this one, so neither do its signals
+    flush_signals(&ctx, target_pos(ref, a.tstart));
+    if(!alignment_signals(m, ref, &a, min_size, &ctx.heap, &p.part)) continue;
+    n_aln++;
+    aln_span sp = {p.part.rstart, p.part.rend};
+    kv_push(aln_span, ctx.spans, sp);
+
+    // paired with the molecule's other alignments once all are read
+    p.mol = a.qid;
+    if(fwrite(&p, sizeof(mol_part), 1, buckets[a.qid % SV_PART_BUCKETS]) != 1) {
+      fprintf(stderr, "Failed to write alignment parts to a temporary file\n");
+      ret = 1;
+    }
+  }
+  if(r < 0) {
+    fprintf(stderr, "Malformed alignment record %zu\n", n_records + 1);
+    ret = 1;
+  }
+  kv_destroy(a.path);
+
+  if(ret == 0) {
+    finish_reference(&ctx);
+    ret = pair_parts(buckets, min_size, &ctx.splits);
+  }
+  if(ret == 0) {
+    cluster_splits(&ctx);
+    fprintf(stderr, "# Called %zu structural variants from %zu alignments\n", ctx.n_calls, n_aln);
+  }
+
+  for(i = 0; i < SV_PART_BUCKETS; i++) {
+    if(buckets[i] != NULL) fclose(buckets[i]);
+  }
+  kh_destroy(svIdx, ref_idx);
+  kv_destroy(ctx.heap);
+  for(i = 0; i < kv_size(ctx.open); i++) kv_destroy(kv_A(ctx.open, i).mols);
+  kv_destroy(ctx.open);
+  kv_destroy(ctx.spans);
+  kv_destroy(ctx.splits);
+  return ret;
+}